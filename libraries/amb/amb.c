@@ -26,14 +26,26 @@
 
 /* Version of SOFTWARE */
 #define SW_VERSION_MAJOR 1
-#define SW_VERSION_MINOR 2
-#define SW_VERSION_PATCH 3
+#define SW_VERSION_MINOR 3
+#define SW_VERSION_PATCH 0
 /* Version of HARDWARE */
 #define HW_VERSION_MAJOR 1
 #define HW_VERSION_MINOR 6
 
 /* REVISION HISTORY */
 /*
+ * Version 01.03.00 - Callback ranges are kept sorted and non-overlapping by
+                      amb_register_function() and found by binary search in
+                      amb_handle_transaction().  Added amb_init_slave_n().
+                      Optional page table dispatch (AMB_PAGE_DISPATCH in amb.h).
+                      The CAN interrupt only queues M&C requests; they are
+                      dispatched from a lower priority software interrupt.
+                      Monitor replies go out of message objects 3 and 4, in
+                      the order of the requests.
+                      Static monitor points are preloaded in message objects
+                      11 to 14 and sent from the CAN interrupt.
+                      Latency statistics timed by T3, CAN errors by cause.
+                      Monitor reply cache with a time to live per RA range.
  * Version 01.01.02 - Released as Ver_1_1_2
            01.02.03   Patch by Andrea Vaccari - NRAO NTC
 		   			  Changed code to assure that any RCA is not serviced more than once in
@@ -110,13 +122,122 @@
  */
 
 #define XP0INT   0x40
+#define ADCINT   0x28	/* ADC conversion complete: unused, triggered by software */
+#define T3INT    0x23	/* GPT1 timer 3 overflow */
+
+/* Interrupt control for the T3 overflow count: ILVL = 9, GLVL = 0, enabled */
+#define AMB_T3_IC	0x0064
+
+/* Interrupt control for the bottom half: ILVL = 4, GLVL = 0, enabled */
+#define AMB_BH_IC	0x0050
+
+/* Start the bottom half */
+#define AMB_BH_TRIGGER	ADCIR = 1
+
+/*
+ * Queue of M&C requests from the CAN interrupt to the bottom half.
+ * Single producer (amb_can_isr) and single consumer (amb_bottom_half): the
+ * head is only written by the former and the tail by the latter.
+ * One slot is always left free, so AMB_RX_QUEUE_SIZE - 1 requests can wait.
+ */
+#define AMB_RX_QUEUE_SIZE	8	/* Must be a power of 2 */
+#define AMB_RX_QUEUE_MASK	(AMB_RX_QUEUE_SIZE - 1)
+
+/*
+ * Monitor replies are sent from message objects 3 and 4 (CAN_OBJ[2] and
+ * CAN_OBJ[3]), so a reply can be loaded while the previous one is still
+ * waiting for the bus.  The 82527 sends the lowest numbered object with TXRQ
+ * set first, so a reply goes in the object after the highest one still
+ * waiting, never below it, and the replies leave in the order of the
+ * requests.  Once the last object waits, it is waited for up to AMB_TX_WAIT
+ * polls (about 1 ms) before it is overwritten.
+ */
+#define AMB_TX_FIRST	2
+#define AMB_TX_LAST		3
+#define AMB_TX_WAIT		2500
+
+/*
+ * Message objects 11 to 14 (CAN_OBJ[10] to CAN_OBJ[13]) hold the replies to
+ * monitor points which never change, preloaded by
+ * amb_register_static_monitor().  A request for one of them only needs TXRQ
+ * set, the same way object 2 holds the serial number.
+ */
+#define AMB_STATIC_FIRST	10
+#define AMB_STATIC_LAST		13
+
+/*
+ * A queued request.  The CAN interrupt copies the data bytes straight into
+ * msg, which is then handed to the callback in place; the arbitration
+ * registers are kept so the monitor reply needs no ID encoding.
+ */
+struct rx_frame {
+  CAN_MSG_TYPE msg; /* Request, and reply for monitor requests */
+  uword  UAR;       /* Upper Arbitration Register */
+  uword  LAR;       /* Lower Arbitration Register */
+  uword  stamp;     /* T3 on entry to the CAN interrupt */
+} ;
+
+/*
+ * Latency from entry to the CAN interrupt until TXRQ is set for a monitor
+ * reply, or until the callback returns for a control request.  T3 runs
+ * free at fCPU/8, 0.4 us per count.  Bucket b of the histogram holds
+ * latencies below 12.8 us << b, the last bucket everything above.
+ */
+#define AMB_T3CON				0x0040	/* timer mode, count up, fCPU/8, run */
+#define AMB_LATENCY_DEADLINE	375		/* 150 us: ICD limit for monitor replies */
+
+/*
+ * Monitor reply cache.  Replies of callbacks for RAs with a cache policy are
+ * kept for the time to live of the policy, in ms, and given to later
+ * requests for the same RA without calling the callback.  A control request
+ * to the RA drops its entry.  Times are T3 counts extended to 32 bits by the
+ * T3 overflow interrupt, which wraps after 28 minutes.  An entry is fresh
+ * while its age, taken unsigned, is below its time to live.  The bottom
+ * half, started at least every 26 ms by the T3 overflow, frees the next
+ * stale entry in turn each time it runs, so no entry lives long enough for
+ * the time to wrap around and make it look fresh again.
+ */
+#define AMB_CACHE_SIZE		16
+#define AMB_CACHE_POLICIES	8
+#define AMB_CACHE_FREE		0xFFFFFFFF	/* RA of an unused entry */
+#define AMB_TICKS_PER_MS	2500
+
+struct cache_entry {
+  ulong  ra;        /* Relative address, or AMB_CACHE_FREE */
+  ulong  stored;    /* Time the reply was stored */
+  uword  ttl;       /* Its time to live in ms */
+  ubyte  len;       /* Reply length */
+  ubyte  data[8];   /* Reply data */
+} ;
+
+struct cache_policy {
+  ulong  low_address;   /* First RA of the range */
+  ulong  high_address;  /* Last RA of the range */
+  uword  ttl;           /* Time to live in ms, 0 if unused */
+} ;
 
 /* Local Function prototypes */
 static ubyte 	amb_get_node_address();
 static int		amb_get_serial_number();
 static int		amb_setup_CAN_hw();
-static void		amb_handle_transaction();
-static void		amb_transmit_monitor();
+static void		amb_handle_transaction(struct rx_frame idata *frame);
+static void		amb_queue_frame(ubyte obj);
+static ubyte	amb_answer_static(ubyte obj);
+static ubyte	amb_tx_object();
+static void		amb_set_id(ubyte obj, ulong id);
+static void		amb_transmit_monitor(struct rx_frame idata *frame, ubyte lat_class);
+static void		amb_log_latency(ubyte lat_class, uword stamp);
+static void		amb_count_error(ubyte cause);
+static uword	amb_cache_ttl(ulong ra);
+static ubyte	amb_cache_lookup(CAN_MSG_TYPE idata *msg);
+static void		amb_cache_store(CAN_MSG_TYPE idata *msg, uword ttl);
+static ulong	amb_cache_left(ubyte i, ulong now);
+static void		amb_cache_expire();
+static void		amb_call_function(ubyte i, struct rx_frame idata *frame);
+static void		amb_insert_cb(ubyte pos, ulong low_address, ulong high_address, read_or_write_func func);
+#ifdef AMB_PAGE_DISPATCH
+static void		amb_build_page_table();
+#endif /* AMB_PAGE_DISPATCH */
 
 /* All pertinent slave data */
 
@@ -130,28 +251,93 @@ static void		amb_transmit_monitor();
 	ubyte		sw_revision_level[3];	/* Software version */
 	ubyte		hw_revision_level[2];	/* Hardware version */
 	uword		num_errors;			/* Number of CAN errors */
+	uword		err_count[AMB_NUM_ERR_CAUSES];	/* CAN errors by cause, saturating */
 	ubyte		last_slave_error;	/* Last internal slave error */
 	ulong		num_transactions;	/* Number of completed transactions */
 
 	ubyte		identify_mode;		/* True when responding to identify broadcast */
 
+	ubyte		rx_high_water;		/* Most requests ever waiting in the queue */
+	uword		rx_overflows;		/* Requests lost because the queue was full */
+
+	ubyte		num_static;			/* No of static monitor objects in use */
+	uword		tx_delayed;			/* Replies which had to wait for a free object */
+	uword		tx_clobbered;		/* Replies which overwrote a pending one */
+
+	uword		lat_hist[AMB_LATENCY_CLASSES][AMB_LATENCY_BUCKETS];	/* Latency histograms */
+	uword		lat_misses[AMB_LATENCY_CLASSES];	/* Latencies over AMB_LATENCY_DEADLINE */
+	uword		lat_max[AMB_LATENCY_CLASSES];		/* Longest latency in T3 counts */
+
 	ubyte		num_cbs;			/* No of callbacks registered */
-	CALLBACK_STRUCT	*cb_ops;		/* User supplied callbacks */
+	ubyte		max_cbs;			/* Size of the callback array */
+	ubyte		num_regs;			/* No of successful registrations */
+	CALLBACK_STRUCT	*cb_ops;		/* User supplied callbacks, sorted by address */
 } idata slave_node;
 
-/* Structure for sharing message data with callbacks */
+#ifdef AMB_PAGE_DISPATCH
+
+/* Refuse to build if the page table doesn't fit its share of IDATA */
+typedef char amb_page_table_fits_idata[(AMB_NUM_PAGES <= AMB_PAGE_TABLE_MAX) ? 1 : -1];
+
+#define AMB_PAGE_EMPTY	0xFF	/* No callback range in this page */
+
+/*
+ * Index of the first callback range ending in or after each page, or
+ * AMB_PAGE_EMPTY.  Only used while amb_page_table_valid: the CAN interrupt
+ * falls back to the binary search while the table is being rebuilt.
+ */
+	static ubyte idata amb_page_table[AMB_NUM_PAGES];
+	static ubyte idata amb_page_table_valid;
+
+#endif /* AMB_PAGE_DISPATCH */
+
+/* Requests waiting for the bottom half */
+
+	static struct rx_frame idata rx_queue[AMB_RX_QUEUE_SIZE];
+	static ubyte idata rx_head;
+	static ubyte idata rx_tail;
 
-	static CAN_MSG_TYPE idata current_msg;
+/* T3 on entry to the current CAN interrupt */
+
+	static uword idata isr_stamp;
+
+/* Work deferred to the bottom half when no request is waiting */
+
+	static idle_func_type amb_idle_func;
+
+/* T3 overflows, the upper half of the time returned by amb_get_time() */
+
+	static uword idata t3_overflows;
+
+/* Monitor reply cache, policies and statistics.  Only used by the bottom half */
+
+	static struct cache_entry amb_cache[AMB_CACHE_SIZE];
+	static struct cache_policy amb_cache_policies[AMB_CACHE_POLICIES];
+	static uword amb_cache_stats[4];	/* hits, misses, evictions, invalidations */
+	static ubyte amb_cache_sweep;		/* Next entry amb_cache_expire() looks at */
 
 
 
 /* Initialise routine */
 int amb_init_slave(void *cb_ops_memory){
+/* Size of the callback memory unknown: trust the caller */
+	return amb_init_slave_n(cb_ops_memory, 0xFF);
+}
+
+/* Initialise routine with size of the callback memory */
+int amb_init_slave_n(void *cb_ops_memory, ubyte max_cbs){
+	ubyte i, k;
+
 /* Point to callback memory */
 	slave_node.cb_ops = (CALLBACK_STRUCT *) cb_ops_memory;
+	slave_node.max_cbs = max_cbs;
 
 /* Initially we have no registered callbacks */
 	slave_node.num_cbs = 0;
+	slave_node.num_regs = 0;
+#ifdef AMB_PAGE_DISPATCH
+	amb_page_table_valid = FALSE;
+#endif /* AMB_PAGE_DISPATCH */
 
 /* Get the address of this slave from the hardware */
 	slave_node.node_address = amb_get_node_address();
@@ -174,43 +360,204 @@ int amb_init_slave(void *cb_ops_memory){
 	slave_node.hw_revision_level[0] = HW_VERSION_MAJOR;
 	slave_node.hw_revision_level[1] = HW_VERSION_MINOR;
 	slave_node.num_errors = 0;
+	for (i = 0; i < AMB_NUM_ERR_CAUSES; i++)
+		slave_node.err_count[i] = 0;
 	slave_node.last_slave_error = 0x0;
 	slave_node.num_transactions = 0;
+	slave_node.rx_high_water = 0;
+	slave_node.rx_overflows = 0;
+	rx_head = 0;
+	rx_tail = 0;
 
 	slave_node.identify_mode = FALSE;
+	slave_node.num_static = 0;
+	slave_node.tx_delayed = 0;
+	slave_node.tx_clobbered = 0;
+	for (i = 0; i < AMB_LATENCY_CLASSES; i++) {
+		for (k = 0; k < AMB_LATENCY_BUCKETS; k++)
+			slave_node.lat_hist[i][k] = 0;
+		slave_node.lat_misses[i] = 0;
+		slave_node.lat_max[i] = 0;
+	}
+
+	amb_idle_func = 0;
+
+/* Empty cache, no policies */
+	for (i = 0; i < AMB_CACHE_SIZE; i++)
+		amb_cache[i].ra = AMB_CACHE_FREE;
+	amb_cache_sweep = 0;
+	for (i = 0; i < AMB_CACHE_POLICIES; i++)
+		amb_cache_policies[i].ttl = 0;
+	for (i = 0; i < 4; i++)
+		amb_cache_stats[i] = 0;
+
+/* Free running timer for the latency measurements and the cache */
+	t3_overflows = 0;
+	T3 = 0;
+	T3CON = AMB_T3CON;
+	T3IC = AMB_T3_IC;
 	
 /* Setup the CAN hardware */
-	return amb_setup_CAN_hw();
+	if (amb_setup_CAN_hw() != 0) {
+		return -1;
+	}
+
+/* Preload the monitor points which never change */
+	amb_register_static_monitor(0x30000, 3, slave_node.revision_level);		/* Slave protocol revision level */
+	amb_register_static_monitor(0x30004, 3, slave_node.sw_revision_level);	/* Slave software revision level */
+	amb_register_static_monitor(0x30005, 2, slave_node.hw_revision_level);	/* Slave hardware revision level */
+
+	return 0;
+}
+
+/* Insert one range in the callback array at position pos */
+void amb_insert_cb(ubyte pos, ulong low_address, ulong high_address, read_or_write_func func){
+	ubyte i;
+
+/* Make room by moving the following ranges up */
+	for (i = slave_node.num_cbs; i > pos; i--)
+		slave_node.cb_ops[i] = slave_node.cb_ops[i - 1];
+
+	slave_node.cb_ops[pos].low_address = low_address;
+	slave_node.cb_ops[pos].high_address = high_address;
+	slave_node.cb_ops[pos].cb_func = func;
+	slave_node.cb_ops[pos].reg_id = slave_node.num_regs;
+	slave_node.num_cbs++;
 }
 
 /* Register callback routine */
 int amb_register_function(ulong low_address, ulong high_address, read_or_write_func func){
-/* Store callback info */
-	slave_node.cb_ops[slave_node.num_cbs].low_address = low_address;
-	slave_node.cb_ops[slave_node.num_cbs].high_address = high_address;
-	slave_node.cb_ops[slave_node.num_cbs].cb_func = func;
+	ubyte i, num_new, done, ien;
+	ulong low;
 
-/* Increment the number of callbacks */
-	slave_node.num_cbs++;
+	if (low_address > high_address)
+		return -1;
+
+/* Count the gaps between the ranges already registered which the new range covers */
+	num_new = 0;
+	done = FALSE;
+	low = low_address;
+	for (i = 0; i < slave_node.num_cbs; i++) {
+		if (slave_node.cb_ops[i].high_address < low)
+			continue;
+		if (slave_node.cb_ops[i].low_address > high_address)
+			break;
+		if (slave_node.cb_ops[i].low_address > low)
+			num_new++;
+		if (slave_node.cb_ops[i].high_address >= high_address) {
+			done = TRUE;
+			break;
+		}
+		low = slave_node.cb_ops[i].high_address + 1;
+	}
+	if (!done)
+		num_new++;
+
+/* Nothing left to register, or no room for it */
+	if (!num_new || (uword) slave_node.num_cbs + num_new > slave_node.max_cbs)
+		return -1;
+
+/* Store callback info.  The CAN interrupt must not see the array half sorted */
+	ien = IEN;
+	IEN = 0;
+
+#ifdef AMB_PAGE_DISPATCH
+	amb_page_table_valid = FALSE;
+#endif /* AMB_PAGE_DISPATCH */
+
+	done = FALSE;
+	low = low_address;
+	for (i = 0; i < slave_node.num_cbs; i++) {
+		if (slave_node.cb_ops[i].high_address < low)
+			continue;
+		if (slave_node.cb_ops[i].low_address > high_address)
+			break;
+		if (slave_node.cb_ops[i].low_address > low) {
+			amb_insert_cb(i, low, slave_node.cb_ops[i].low_address - 1, func);
+			i++;
+		}
+		if (slave_node.cb_ops[i].high_address >= high_address) {
+			done = TRUE;
+			break;
+		}
+		low = slave_node.cb_ops[i].high_address + 1;
+	}
+	if (!done)
+		amb_insert_cb(i, low, high_address, func);
+
+	slave_node.num_regs++;
+
+	IEN = ien;
+
+#ifdef AMB_PAGE_DISPATCH
+	amb_build_page_table();
+#endif /* AMB_PAGE_DISPATCH */
 
-/* Always succeeds */
 	return 0;
 }
 
 /* Unregister last registered callback routine */
 int amb_unregister_last_function(void){
+	ubyte i, j, ien;
 
 /* If no function is registered, nothing to be done. */
-	if(!slave_node.num_cbs){
+	if(!slave_node.num_regs){
 		return 0;
 	}
 
-/* Decrement the number of callbacks. */
-	slave_node.num_cbs--;
+/* Remove all the ranges stored by the last registration, keeping the rest in order */
+	ien = IEN;
+	IEN = 0;
+
+#ifdef AMB_PAGE_DISPATCH
+	amb_page_table_valid = FALSE;
+#endif /* AMB_PAGE_DISPATCH */
+
+	slave_node.num_regs--;
+	for (i = 0, j = 0; i < slave_node.num_cbs; i++) {
+		if (slave_node.cb_ops[i].reg_id != slave_node.num_regs)
+			slave_node.cb_ops[j++] = slave_node.cb_ops[i];
+	}
+	slave_node.num_cbs = j;
+
+	IEN = ien;
+
+#ifdef AMB_PAGE_DISPATCH
+	amb_build_page_table();
+#endif /* AMB_PAGE_DISPATCH */
 
 	return 0;
 }
 
+#ifdef AMB_PAGE_DISPATCH
+/*
+ * Rebuild the page table from the sorted callback array.  This runs with
+ * interrupts enabled; the table is only marked valid once it is complete.
+ */
+void amb_build_page_table(){
+	uword page;
+	ubyte i;
+	ulong page_low;
+
+	i = 0;
+	for (page = 0; page < AMB_NUM_PAGES; page++) {
+		page_low = ((ulong) page) << AMB_PAGE_SHIFT;
+
+		/* Skip ranges which end before this page */
+		while (i < slave_node.num_cbs && slave_node.cb_ops[i].high_address < page_low)
+			i++;
+
+		if (i < slave_node.num_cbs &&
+			slave_node.cb_ops[i].low_address <= page_low + (1L << AMB_PAGE_SHIFT) - 1)
+			amb_page_table[page] = i;
+		else
+			amb_page_table[page] = AMB_PAGE_EMPTY;
+	}
+
+	amb_page_table_valid = TRUE;
+}
+#endif /* AMB_PAGE_DISPATCH */
+
 /* Startup routine */
 int amb_start(){
 	IEN = 1;
@@ -255,6 +602,7 @@ int amb_get_serial_number(){
 int amb_setup_CAN_hw(){
 
 		ulong LAR, UAR;
+		ubyte k;
 
 		/* Set up for the various arbitration registers */
 
@@ -333,40 +681,46 @@ int amb_setup_CAN_hw(){
   		CAN_OBJ[1].Data[7] = slave_node.serial_number[7];   /* set data byte 7 */
 
 	  	/*  ------------------------------------------------------------------------
-  		 *  ----------------- Configure Message Object 3 ---------------------------
-		 *  --- This message object is used to transmit all monitor data back to ---
-		 *  --- the master. --------------------------------------------------------
+  		 *  ----------------- Configure Message Objects 3 and 4 --------------------
+		 *  --- These message objects are used in turn to transmit all monitor ----
+		 *  --- data back to the master. -------------------------------------------
   		 *  ------------------------------------------------------------------------
-  		 *  Message object 3 is valid
+  		 *  Message objects 3 and 4 are valid
    		 */
-	  	CAN_OBJ[2].MCR  = 0x5695;    /* set Message Control Register */
-
-	  	/* 
-		 * message direction is transmit
-  		 * extended 29-bit identifier
-  		 * 0 valid data bytes
-      	 */
-  		CAN_OBJ[2].MCFG = 0x0C;      /* set Message Configuration Register */
-
-	  	CAN_OBJ[2].UAR  = 0x0000;    /* set Upper Arbitration Register */
-  		CAN_OBJ[2].LAR  = 0x0000;    /* set Lower Arbitration Register */
+		for (k = AMB_TX_FIRST; k <= AMB_TX_LAST; k++) {
+		  	CAN_OBJ[k].MCR  = 0x5695;    /* set Message Control Register */
+
+		  	/* 
+			 * message direction is transmit
+  			 * extended 29-bit identifier
+  			 * 0 valid data bytes
+      		 */
+  			CAN_OBJ[k].MCFG = 0x0C;      /* set Message Configuration Register */
+
+		  	CAN_OBJ[k].UAR  = 0x0000;    /* set Upper Arbitration Register */
+  			CAN_OBJ[k].LAR  = 0x0000;    /* set Lower Arbitration Register */
+		}
   		
 	  	/*  ------------------------------------------------------------------------
-  		 *  ----------------- Configure Message Objects 4 to 14 --------------------
-		 *  --- These objects are not used at present ------------------------------
+  		 *  ----------------- Configure Message Objects 5 to 10 --------------------
+		 *  --- These objects are not used at present.  Without chaining the ------
+		 *  --- controller stores every message in the lowest matching object, ----
+		 *  --- so they can't queue a burst: object 15 and its second buffer do ----
   		 *  ------------------------------------------------------------------------
 		 */
-  	   	CAN_OBJ[3].MCR  = 0x5555;    /* set Message Control Register */
-  		CAN_OBJ[4].MCR  = 0x5555;    /* set Message Control Register */
-	  	CAN_OBJ[5].MCR  = 0x5555;    /* set Message Control Register */
-  		CAN_OBJ[6].MCR  = 0x5555;    /* set Message Control Register */
-  		CAN_OBJ[7].MCR  = 0x5555;    /* set Message Control Register */
-  		CAN_OBJ[8].MCR  = 0x5555;    /* set Message Control Register */
-  		CAN_OBJ[9].MCR  = 0x5555;    /* set Message Control Register */
-  		CAN_OBJ[10].MCR  = 0x5555;    /* set Message Control Register */
-  		CAN_OBJ[11].MCR  = 0x5555;    /* set Message Control Register */
-  		CAN_OBJ[12].MCR  = 0x5555;    /* set Message Control Register */
-  		CAN_OBJ[13].MCR  = 0x5555;    /* set Message Control Register */
+		for (k = AMB_TX_LAST + 1; k < AMB_STATIC_FIRST; k++) {
+	  		CAN_OBJ[k].MCR  = 0x5555;    /* set Message Control Register */
+		}
+
+	  	/*  ------------------------------------------------------------------------
+  		 *  ----------------- Configure Message Objects 11 to 14 -------------------
+		 *  --- These objects transmit the static monitor points. They stay -------
+		 *  --- invalid until amb_register_static_monitor() loads them ------------
+  		 *  ------------------------------------------------------------------------
+		 */
+		for (k = AMB_STATIC_FIRST; k <= AMB_STATIC_LAST; k++) {
+	  		CAN_OBJ[k].MCR  = 0x5555;    /* set Message Control Register */
+		}
 
 	  	/*  ------------------------------------------------------------------------
   		 *  ----------------- Configure Message Object 15 --------------------------
@@ -398,6 +752,11 @@ int amb_setup_CAN_hw(){
     	 */
   		XP0IC = 0x0077;
 
+		/*
+		 *  enable the bottom half software interrupt, below the CAN interrupt
+		 */
+		ADCIC = AMB_BH_IC;
+
 	  	/* ------------ CAN Control/Status Register --------------
   		 *  reset CCE and INIT
   		 * enable interrupt generation from CAN Module
@@ -428,6 +787,8 @@ int amb_setup_CAN_hw(){
   	uword uwIntID;
   	uword uwStatus;
 
+		isr_stamp = T3;
+
 	  	while (uwIntID = C1IR & 0x00ff) {
 	    	switch (uwIntID & 0x00ff) {
 	     		case 1:  /* Status Change Interrupt
@@ -441,7 +802,7 @@ int amb_setup_CAN_hw(){
 						 * Indicates when the CAN controller is in busoff state.
 						 * Increment error counter
 					 	 */
-						slave_node.num_errors++;
+						amb_count_error(AMB_ERR_BOFF);
 					}
 
 		            if (uwStatus & 0x4000) { /* if EWRN */
@@ -450,7 +811,7 @@ int amb_setup_CAN_hw(){
                 		* EML has reached the error warning limit of 96.
 					 	* Increment the error counter
 					 	*/
-						slave_node.num_errors++;
+						amb_count_error(AMB_ERR_EWRN);
             		}
 
  		           if (uwStatus & 0x0800) { /* if TXOK */
@@ -483,7 +844,7 @@ int amb_setup_CAN_hw(){
                         			 * allowed. 
 									 */
 								/* Increment error counter */
-								slave_node.num_errors++;
+								amb_count_error(AMB_ERR_STUFF);
 	               				break;
 
 			               case 2: /* Form Error
@@ -491,7 +852,7 @@ int amb_setup_CAN_hw(){
                         			* wrong format. 
 									*/
 								/* Increment error counter */
-				 			 	slave_node.num_errors++;
+				 			 	amb_count_error(AMB_ERR_FORM);
         			          	break;
 
 			               case 3: /* Ack Error
@@ -499,7 +860,7 @@ int amb_setup_CAN_hw(){
                         			* not acknowledged by another node. 
 									*/
 								/* Increment error counter */
-								slave_node.num_errors++;
+								amb_count_error(AMB_ERR_ACK);
                   				break;
 
 			               case 4: /* Bit1 Error
@@ -509,7 +870,7 @@ int amb_setup_CAN_hw(){
                         			* monitored bus value was dominant.
 									*/
 								/* Increment error counter */
-					 			slave_node.num_errors++;
+					 			amb_count_error(AMB_ERR_BIT1);
 
 								/* 
 								 * If we are responding to an identify request, this means a
@@ -533,10 +894,10 @@ int amb_setup_CAN_hw(){
 									*/
 				               	if (uwStatus & 0x8000) { /* if Busoff status */
 									/* Increment error counter */
-						 			slave_node.num_errors++;
+						 			amb_count_error(AMB_ERR_BIT0);
                   				} else {
 									/* Increment error counter */
-									slave_node.num_errors++;
+									amb_count_error(AMB_ERR_BIT0);
                   				}
                   				break;
 
@@ -545,7 +906,7 @@ int amb_setup_CAN_hw(){
                         			* received.
 									*/
 								/* Increment error counter */
-					 			slave_node.num_errors++;
+					 			amb_count_error(AMB_ERR_CRC);
                   				break;
 
 			               default:
@@ -568,10 +929,10 @@ int amb_setup_CAN_hw(){
 						 * do something wih them  Increment error, because we missed
 						 * a message 
 						 */
-						slave_node.num_errors++;
+						amb_count_error(AMB_ERR_MSGLST_OBJ15);
 
 						if (slave_node.last_slave_error != DUP_SLAVE_ADDR_E) {
-							amb_handle_transaction();
+							amb_queue_frame(14);
 						}
     	     		} else {
         	       		/* 
@@ -581,7 +942,7 @@ int amb_setup_CAN_hw(){
 						 * do something wih them.
 						 */
 						if (slave_node.last_slave_error != DUP_SLAVE_ADDR_E) {
-							amb_handle_transaction();
+							amb_queue_frame(14);
 						}
             		}
            			CAN_OBJ[14].MCR = 0x7dfd;      /* release buffer */
@@ -609,7 +970,7 @@ int amb_setup_CAN_hw(){
 							CAN_OBJ[1].MCR = 0xe7ff;  /* set TXRQ,reset CPUUPD */
 
 							/* This is an error, because we missed a message */
-							slave_node.num_errors++;
+							amb_count_error(AMB_ERR_MSGLST_OBJ1);
         		        } else {
                 			/* 
 							 * The CAN controller has stored a new message
@@ -636,36 +997,160 @@ int amb_setup_CAN_hw(){
 		}
 	}
 
+/*
+ ****************************************************************************
+ *  T3 overflow: counts the upper half of the time.  Every 26 ms it also
+ *  starts the bottom half, which frees stale cache entries and calls the
+ *  idle function, so periodic work gets done without CAN traffic.
+ ****************************************************************************
+ */
+
+	void amb_t3_overflow(void) interrupt T3INT{
+		t3_overflows++;
+		AMB_BH_TRIGGER;
+	}
+
+/* Count a CAN error in the total and in the counter of its cause */
+void amb_count_error(ubyte cause){
+	slave_node.num_errors++;
+	if (slave_node.err_count[cause] != 0xFFFF)
+		slave_node.err_count[cause]++;
+}
+
+/* Copy the message in CAN_OBJ[obj] to the queue and start the bottom half */
+void amb_queue_frame(ubyte obj){
+	ubyte i, len, next, depth;
+
+	/* The serial number and static monitor points need no callback */
+	if (amb_answer_static(obj))
+		return;
+
+	next = (rx_head + 1) & AMB_RX_QUEUE_MASK;
+
+	/* Queue full: the request is lost */
+	if (next == rx_tail) {
+		slave_node.rx_overflows++;
+		amb_count_error(AMB_ERR_RX_OVERFLOW);
+		return;
+	}
+
+	/* Only the bytes actually received: none for a monitor request */
+	rx_queue[rx_head].UAR = CAN_OBJ[obj].UAR;
+	rx_queue[rx_head].LAR = CAN_OBJ[obj].LAR;
+	rx_queue[rx_head].stamp = isr_stamp;
+	len = (CAN_OBJ[obj].MCFG & 0xf0) >> 4;
+	rx_queue[rx_head].msg.len = len;
+	for (i = 0; i < len; i++)
+		rx_queue[rx_head].msg.data[i] = CAN_OBJ[obj].Data[i];
+	rx_head = next;
+
+	depth = (rx_head - rx_tail) & AMB_RX_QUEUE_MASK;
+	if (depth > slave_node.rx_high_water)
+		slave_node.rx_high_water = depth;
+
+	AMB_BH_TRIGGER;
+}
+
+/*
+ * Answer a monitor request for the serial number or a static monitor point
+ * by requesting transmission of the object which already holds the reply.
+ * The request is matched on the arbitration registers, which are the same
+ * for request and reply, so the ID needs no decoding.  Returns TRUE if the
+ * request has been answered.
+ */
+ubyte amb_answer_static(ubyte obj){
+	ubyte k;
+	uword UAR, LAR;
+
+	/* Only monitor requests (no data) */
+	if (CAN_OBJ[obj].MCFG & 0xf0)
+		return FALSE;
+
+	UAR = CAN_OBJ[obj].UAR;
+	LAR = CAN_OBJ[obj].LAR & 0xf8ff;
+
+	if (UAR == CAN_OBJ[1].UAR && LAR == (CAN_OBJ[1].LAR & 0xf8ff)) {
+		/* RCA 0: In order to avoid confusion between the interrupts I use message 
+		   number 2 to respond to this request.
+		   Added JSK 10/06/2005 */
+		/* We are responding to the identify broadcast */
+		slave_node.identify_mode = TRUE;
+
+		/* Turn status interrupts on */
+		C1CSR = 0x000E;
+
+		/* Send the serial number */
+		slave_node.num_transactions++;
+		CAN_OBJ[1].MCR = 0xe7ff;  /* set TXRQ,reset CPUUPD */
+		amb_log_latency(AMB_LATENCY_MONITOR_BUILTIN, isr_stamp);
+		return TRUE;
+	}
+
+	for (k = AMB_STATIC_FIRST; k < AMB_STATIC_FIRST + slave_node.num_static; k++) {
+		if (UAR == CAN_OBJ[k].UAR && LAR == (CAN_OBJ[k].LAR & 0xf8ff)) {
+			slave_node.num_transactions++;
+			CAN_OBJ[k].MCR = 0xe7ff;  /* set TXRQ,reset CPUUPD */
+			amb_log_latency(AMB_LATENCY_MONITOR_BUILTIN, isr_stamp);
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/*
+ ****************************************************************************
+ *  This is the bottom half of the CAN interrupt.  It is requested by
+ *  amb_queue_frame() and runs at a lower priority than amb_can_isr, so
+ *  that new messages are still received while the callbacks run.
+ *  Once the queue is empty the idle function, if any, is called until it
+ *  has nothing more to do, checking the queue again after each call.
+ ****************************************************************************
+ */
+
+	void amb_bottom_half(void) interrupt ADCINT{
+		amb_cache_expire();
+		for (;;) {
+			while (rx_tail != rx_head) {
+				amb_handle_transaction(&rx_queue[rx_tail]);
+				rx_tail = (rx_tail + 1) & AMB_RX_QUEUE_MASK;
+			}
+
+			/* Nothing waiting: deferred work, one piece at a time */
+			if (amb_idle_func == 0 || !amb_idle_func())
+				break;
+		}
+	}
+
 /* Routine to check if a callback should be run */
 
-void amb_handle_transaction(){
+void amb_handle_transaction(struct rx_frame idata *frame){
+	CAN_MSG_TYPE idata *msg = &frame->msg;
 	ulong incoming_ID;
-	ubyte i;
-	/* Get incoming ID from Object 15 */
+	ubyte lo, hi, i;
+#ifdef AMB_PAGE_DISPATCH
+	uword page;
+#endif /* AMB_PAGE_DISPATCH */
+	/* Get incoming ID from the queued message */
 	incoming_ID = 0x0;
   
-	    incoming_ID += ((ulong) (CAN_OBJ[14].LAR & 0xf800)) >> 11;  /* ID  4.. 0 */
-   		incoming_ID += ((ulong) (CAN_OBJ[14].LAR & 0x00ff)) <<  5;  /* ID 12.. 5 */
-   		incoming_ID += ((ulong) (CAN_OBJ[14].UAR & 0xff00)) <<  5;  /* ID 13..20 */
-  		incoming_ID += ((ulong) (CAN_OBJ[14].UAR & 0x00ff)) << 21;  /* ID 21..28 */
+	    incoming_ID += ((ulong) (frame->LAR & 0xf800)) >> 11;  /* ID  4.. 0 */
+   		incoming_ID += ((ulong) (frame->LAR & 0x00ff)) <<  5;  /* ID 12.. 5 */
+   		incoming_ID += ((ulong) (frame->UAR & 0xff00)) <<  5;  /* ID 13..20 */
+  		incoming_ID += ((ulong) (frame->UAR & 0x00ff)) << 21;  /* ID 21..28 */
 
 	/* Calculate relative address from base address */
-	current_msg.relative_address = incoming_ID - slave_node.base_address;
+	msg->relative_address = incoming_ID - slave_node.base_address;
  	/* Ignore messages that are outside our range (>3FFFF OR <0)*/
-	if ((current_msg.relative_address > 262143) ||
-		(current_msg.relative_address < 0))
+	if ((msg->relative_address > 262143) ||
+		(msg->relative_address < 0))
 		return;
  
-	/* Get the message length */
-
-		current_msg.len = (CAN_OBJ[14].MCFG & 0xf0) >> 4;
-	/* This is a monitor request if data length is zero */
-	if (current_msg.len != 0) {
-		current_msg.dirn = CAN_CONTROL;
-		/* Control message: get the data */
-		for (i=0; i<current_msg.len; i++)
-				current_msg.data[i] = CAN_OBJ[14].Data[i];
-		switch (current_msg.relative_address) {	
+	/* This is a monitor request if data length is zero.
+	   The data has already been copied by amb_queue_frame() */
+	if (msg->len != 0) {
+		msg->dirn = CAN_CONTROL;
+		switch (msg->relative_address) {	
 			case 0x31000: /*Device or software reset */
 				_trap_ (0x00);
 				return;
@@ -676,129 +1161,424 @@ void amb_handle_transaction(){
 				break;
 		}
 	} else {
-			current_msg.dirn = CAN_MONITOR;
+			msg->dirn = CAN_MONITOR;
 			/* Check for common monitor points */
-		switch (current_msg.relative_address ) {
-
- 			case 0x000: /* Slave hardware revision level */
-				/* In order to avoid confusion between the interrupts I use message 
-				   number 2 to respond to this request.
-				   Added JSK 10/06/2005 */
-				/* We are responding to the identify broadcast */
-				slave_node.identify_mode = TRUE;
-
-				/* Turn status interrupts on */
-				C1CSR = 0x000E;
+		switch (msg->relative_address ) {
 
-				/* Send the serial number */
-				slave_node.num_transactions++;
-				CAN_OBJ[1].MCR = 0xe7ff;  /* set TXRQ,reset CPUUPD */
-				return;
-				break;
-
-			case 0x30000: /* Slave protocol revision level */
-				current_msg.len = 3;
-				current_msg.data[0] = (ubyte) (slave_node.revision_level[0]);
-				current_msg.data[1] = (ubyte) (slave_node.revision_level[1]);
-				current_msg.data[2] = (ubyte) (slave_node.revision_level[2]);
-				amb_transmit_monitor();
-				slave_node.num_transactions++;
-				return;
-				break;
+			/* 0x000 (serial number), 0x30000, 0x30004 and 0x30005 (revision
+			   levels) have already been answered by amb_answer_static() */
 			case 0x30001: /* Number of errors and last error */
-				current_msg.len = 4;
-				current_msg.data[0] = (ubyte) (slave_node.num_errors>>8);
-				current_msg.data[1] = (ubyte) (slave_node.num_errors);
-				current_msg.data[2] = 0x0;
+				msg->len = 4;
+				msg->data[0] = (ubyte) (slave_node.num_errors>>8);
+				msg->data[1] = (ubyte) (slave_node.num_errors);
+				msg->data[2] = 0x0;
 			 	/* LEC from CAN controller */
- 				current_msg.data[3] = C1CSR >> 8;
-				amb_transmit_monitor();
+ 				msg->data[3] = C1CSR >> 8;
+				amb_transmit_monitor(frame, AMB_LATENCY_MONITOR_BUILTIN);
 				slave_node.num_transactions++;
 				return;
 				break;
 			case 0x30002: /* Number of transactions */
-				current_msg.len = 4;
-				current_msg.data[0] = (ubyte) (slave_node.num_transactions>>24);
-				current_msg.data[1] = (ubyte) (slave_node.num_transactions>>16);
-				current_msg.data[2] = (ubyte) (slave_node.num_transactions>>8);
-				current_msg.data[3] = (ubyte) (slave_node.num_transactions);
-				amb_transmit_monitor();
-				slave_node.num_transactions++;
-				return;
-				break;
-			case 0x30004: /* Slave software revision level */
-				current_msg.len = 3;
-				current_msg.data[0] = (ubyte) (slave_node.sw_revision_level[0]);
-				current_msg.data[1] = (ubyte) (slave_node.sw_revision_level[1]);
-				current_msg.data[2] = (ubyte) (slave_node.sw_revision_level[2]);
-				amb_transmit_monitor();
-				slave_node.num_transactions++;
-				return;
-				break;
-			case 0x30005: /* Slave hardware revision level */
-				current_msg.len = 2;
-				current_msg.data[0] = (ubyte) (slave_node.hw_revision_level[0]);
-				current_msg.data[1] = (ubyte) (slave_node.hw_revision_level[1]);
-				amb_transmit_monitor();
+				msg->len = 4;
+				msg->data[0] = (ubyte) (slave_node.num_transactions>>24);
+				msg->data[1] = (ubyte) (slave_node.num_transactions>>16);
+				msg->data[2] = (ubyte) (slave_node.num_transactions>>8);
+				msg->data[3] = (ubyte) (slave_node.num_transactions);
+				amb_transmit_monitor(frame, AMB_LATENCY_MONITOR_BUILTIN);
 				slave_node.num_transactions++;
 				return;
 				break;
 		}
 	}
 
-	/* For each registered callback, see if this message was in range */
-	for (i=0; i<slave_node.num_cbs; i++) {
-		if ((current_msg.relative_address >= slave_node.cb_ops[i].low_address) &&
-			(current_msg.relative_address <= slave_node.cb_ops[i].high_address)) {
+	lo = 0;
+	hi = slave_node.num_cbs;
 
-			/* Increment the transaction counter */
-			slave_node.num_transactions++;
-			(slave_node.cb_ops[i].cb_func)(&current_msg);
+#ifdef AMB_PAGE_DISPATCH
+	/* Only the ranges reaching into this page need searching: from its first one
+	   up to the first one of the next page, which may also reach into this one */
+	if (amb_page_table_valid) {
+		page = (uword) (msg->relative_address >> AMB_PAGE_SHIFT);
+		if (amb_page_table[page] == AMB_PAGE_EMPTY)
+			return;
+		lo = amb_page_table[page];
+		if (page + 1 < AMB_NUM_PAGES && amb_page_table[page + 1] != AMB_PAGE_EMPTY)
+			hi = amb_page_table[page + 1] + 1;
+	}
+#endif /* AMB_PAGE_DISPATCH */
+
+	/* Binary search the sorted callback ranges for the one holding this message */
+	while (lo < hi) {
+		i = (lo + hi) >> 1;
+		if (msg->relative_address < slave_node.cb_ops[i].low_address) {
+			hi = i;
+		} else if (msg->relative_address > slave_node.cb_ops[i].high_address) {
+			lo = i + 1;
+		} else {
+			amb_call_function(i, frame);
+			return;
+		}
+	}
+}
+
+/* Run callback i for the queued message and send the monitor reply */
+void amb_call_function(ubyte i, struct rx_frame idata *frame){
+	uword ttl = 0;
+	CAN_DIRN_TYPE dirn;
 
-			if (current_msg.dirn == CAN_MONITOR)
-				amb_transmit_monitor();
+	/* Increment the transaction counter */
+	slave_node.num_transactions++;
 
+	/* Answer from the cache if possible, a control request makes the entry stale */
+	if (frame->msg.dirn == CAN_MONITOR) {
+		ttl = amb_cache_ttl(frame->msg.relative_address);
+		if (ttl && amb_cache_lookup(&frame->msg)) {
+			amb_transmit_monitor(frame, AMB_LATENCY_MONITOR_CALLBACK);
 			return;
-		}	
+		}
+	} else {
+		amb_cache_invalidate(frame->msg.relative_address);
 	}
+
+	dirn = frame->msg.dirn;
+	(slave_node.cb_ops[i].cb_func)(&frame->msg);
+
+	/* The callback turns a monitor request it has no reply for into a control.
+	   Its latency is still that of a monitor request */
+	if (frame->msg.dirn == CAN_MONITOR) {
+		if (ttl)
+			amb_cache_store(&frame->msg, ttl);
+		amb_transmit_monitor(frame, AMB_LATENCY_MONITOR_CALLBACK);
+	} else
+		amb_log_latency(dirn == CAN_MONITOR ? AMB_LATENCY_MONITOR_CALLBACK : AMB_LATENCY_CONTROL_CALLBACK, frame->stamp);
 }
 
-/* Routine to send monitor data back to master using CAN object 3 */
-void amb_transmit_monitor(){
-  	ubyte i;
-  	ulong TX_ID;
-		ulong v;
-  		CAN_OBJ[2].MCR = 0xfb7f;     /* set CPUUPD, reset MSGVAL */
+/* Time to live of cached replies for an RA, 0 if it isn't cached */
+uword amb_cache_ttl(ulong ra){
+	ubyte i;
 
-	/* Recalculate CAN message from relative address */
-	TX_ID = slave_node.base_address + current_msg.relative_address;
+	for (i = 0; i < AMB_CACHE_POLICIES; i++) {
+		if (amb_cache_policies[i].ttl &&
+			ra >= amb_cache_policies[i].low_address &&
+			ra <= amb_cache_policies[i].high_address)
+			return amb_cache_policies[i].ttl;
+	}
+	return 0;
+}
 
-	/* Calculate the arbitration registers */
+/* Copy a fresh cached reply into the message.  Returns TRUE on a hit */
+ubyte amb_cache_lookup(CAN_MSG_TYPE idata *msg){
+	ubyte i, k;
 
-   		v = 0x00000000;
-   		v += (TX_ID & 0x0000001f) << 11;  /* ID  4.. 0 */
-   		v += (TX_ID & 0x00001fe0) >>  5;  /* ID 12.. 5 */
-   		CAN_OBJ[2].LAR  = v;
+	for (i = 0; i < AMB_CACHE_SIZE; i++) {
+		if (amb_cache[i].ra != msg->relative_address)
+			continue;
+		if (!amb_cache_left(i, amb_get_time())) {
+			amb_cache[i].ra = AMB_CACHE_FREE;
+			break;
+		}
+		msg->len = amb_cache[i].len;
+		for (k = 0; k < msg->len; k++)
+			msg->data[k] = amb_cache[i].data[k];
+		if (amb_cache_stats[0] != 0xFFFF)
+			amb_cache_stats[0]++;
+		return TRUE;
+	}
+	if (amb_cache_stats[1] != 0xFFFF)
+		amb_cache_stats[1]++;
+	return FALSE;
+}
 
-	   	v = 0x00000000;
-   		v += (TX_ID & 0x001fe000) >>  5;  /* ID 13..20 */
-   		v += (TX_ID & 0x1fe00000) >> 21;  /* ID 21..28 */
-   		CAN_OBJ[2].UAR  = v;
+/* Keep a reply, in its old entry, a free one or the one with the least time left */
+void amb_cache_store(CAN_MSG_TYPE idata *msg, uword ttl){
+	ubyte i, k, victim;
+	ulong now, left, least;
+
+	now = amb_get_time();
+	victim = 0;
+	least = 0xFFFFFFFF;
+	for (i = 0; i < AMB_CACHE_SIZE; i++) {
+		if (amb_cache[i].ra == msg->relative_address || amb_cache[i].ra == AMB_CACHE_FREE) {
+			victim = i;
+			break;
+		}
+		left = amb_cache_left(i, now);
+		if (left < least) {
+			victim = i;
+			least = left;
+		}
+	}
+	if (i == AMB_CACHE_SIZE && least && amb_cache_stats[2] != 0xFFFF)
+		amb_cache_stats[2]++;
+
+	amb_cache[victim].ra = msg->relative_address;
+	amb_cache[victim].stored = now;
+	amb_cache[victim].ttl = ttl;
+	amb_cache[victim].len = msg->len;
+	for (k = 0; k < msg->len; k++)
+		amb_cache[victim].data[k] = msg->data[k];
+}
+
+/* Time left to the reply in cache entry i in T3 counts, 0 once it is stale */
+ulong amb_cache_left(ubyte i, ulong now){
+	ulong age, life;
+
+	age = now - amb_cache[i].stored;
+	life = (ulong) amb_cache[i].ttl * AMB_TICKS_PER_MS;
+	return (age < life) ? life - age : 0;
+}
+
+/* Free the next cache entry in turn if its reply is stale */
+void amb_cache_expire(){
+	ubyte i;
+
+	i = amb_cache_sweep;
+	amb_cache_sweep = (i + 1) % AMB_CACHE_SIZE;
+	if (amb_cache[i].ra != AMB_CACHE_FREE && !amb_cache_left(i, amb_get_time()))
+		amb_cache[i].ra = AMB_CACHE_FREE;
+}
+
+/* Routine to send monitor data back to master using CAN object 3 or 4 */
+void amb_transmit_monitor(struct rx_frame idata *frame, ubyte lat_class){
+  	ubyte i, k;
 
+	k = amb_tx_object();
+  		CAN_OBJ[k].MCR = 0xfb7f;     /* set CPUUPD, reset MSGVAL */
+
+	/* The reply has the ID of the request */
+   		CAN_OBJ[k].UAR  = frame->UAR;
+   		CAN_OBJ[k].LAR  = frame->LAR & 0xf8ff;
 
 	/* set transmit direction and length */
 
-   		CAN_OBJ[2].MCFG = 0x0c | (current_msg.len << 4);
+   		CAN_OBJ[k].MCFG = 0x0c | (frame->msg.len << 4);
 
-	/* Copy data to CAN object 3 */
-   	for(i = 0; i < current_msg.len; i++) {
+	/* Copy data to the transmit object */
+   	for(i = 0; i < frame->msg.len; i++) {
 
-      		CAN_OBJ[2].Data[i] = current_msg.data[i];
+      		CAN_OBJ[k].Data[i] = frame->msg.data[i];
 	}
-  		CAN_OBJ[2].MCR  = 0xf6bf;  /* set NEWDAT, reset CPUUPD, set MSGVAL */
+  		CAN_OBJ[k].MCR  = 0xf6bf;  /* set NEWDAT, reset CPUUPD, set MSGVAL */
 	
 		/* Transmit the object */
-  		CAN_OBJ[2].MCR = 0xe7ff;  /* set TXRQ,reset CPUUPD */
+  		CAN_OBJ[k].MCR = 0xe7ff;  /* set TXRQ,reset CPUUPD */
+
+	amb_log_latency(lat_class, frame->stamp);
+}
+
+/* Add the time since stamp to the latency statistics of a class */
+void amb_log_latency(ubyte lat_class, uword stamp){
+	uword ticks;
+	ubyte b, ien;
+
+	ticks = T3 - stamp;
+	for (b = 0; b < AMB_LATENCY_BUCKETS - 1 && ticks >= (32 << b); b++)
+		;
+
+	/* Also called from the CAN interrupt */
+	ien = IEN;
+	IEN = 0;
+	if (slave_node.lat_hist[lat_class][b] != 0xFFFF)
+		slave_node.lat_hist[lat_class][b]++;
+	if (ticks > AMB_LATENCY_DEADLINE && slave_node.lat_misses[lat_class] != 0xFFFF)
+		slave_node.lat_misses[lat_class]++;
+	if (ticks > slave_node.lat_max[lat_class])
+		slave_node.lat_max[lat_class] = ticks;
+	IEN = ien;
+}
+
+/* Pick the transmit object for the next monitor reply */
+ubyte amb_tx_object(){
+	ubyte k;
+	uword wait;
+
+	/* The object after the highest one still waiting for the bus (TXRQ set) */
+	for (k = AMB_TX_LAST; k >= AMB_TX_FIRST; k--) {
+		if ((CAN_OBJ[k].MCR & 0x3000) == 0x2000)
+			break;
+	}
+	if (k < AMB_TX_LAST)
+		return (k < AMB_TX_FIRST) ? AMB_TX_FIRST : k + 1;
+
+	/* The last one waits, and those below it go before it: give it some time to go */
+	slave_node.tx_delayed++;
+	for (wait = 0; wait < AMB_TX_WAIT; wait++) {
+		if ((CAN_OBJ[AMB_TX_LAST].MCR & 0x3000) != 0x2000)
+			return AMB_TX_FIRST;
+	}
+
+	/* Overwrite it: the newest reply still goes last.  Local overload, not a CAN error */
+	slave_node.tx_clobbered++;
+	return AMB_TX_LAST;
+}
+
+/* Calculate the arbitration registers of a message object from a CAN ID */
+void amb_set_id(ubyte obj, ulong id){
+		ulong v;
+
+   		v = 0x00000000;
+   		v += (id & 0x0000001f) << 11;  /* ID  4.. 0 */
+   		v += (id & 0x00001fe0) >>  5;  /* ID 12.. 5 */
+   		CAN_OBJ[obj].LAR  = v;
+
+	   	v = 0x00000000;
+   		v += (id & 0x001fe000) >>  5;  /* ID 13..20 */
+   		v += (id & 0x1fe00000) >> 21;  /* ID 21..28 */
+   		CAN_OBJ[obj].UAR  = v;
+}
+
+/* Preload a transmit object with the reply to a monitor point which never changes */
+int amb_register_static_monitor(ulong address, ubyte len, ubyte *data){
+	ubyte i, k;
+
+	if (slave_node.num_static > AMB_STATIC_LAST - AMB_STATIC_FIRST || len > 8)
+		return -1;
+	k = AMB_STATIC_FIRST + slave_node.num_static;
+
+  		CAN_OBJ[k].MCR = 0xfb7f;     /* set CPUUPD, reset MSGVAL */
+
+	amb_set_id(k, slave_node.base_address + address);
+
+	/* set transmit direction and length */
+   		CAN_OBJ[k].MCFG = 0x0c | (len << 4);
+
+   	for(i = 0; i < len; i++) {
+      		CAN_OBJ[k].Data[i] = data[i];
+	}
+  		CAN_OBJ[k].MCR  = 0xf6bf;  /* set NEWDAT, reset CPUUPD, set MSGVAL */
+
+	/* The CAN interrupt may match requests against it from now on */
+	slave_node.num_static++;
+
+	return 0;
+}
+
+/* Report the state of the queue between the CAN interrupt and the bottom half */
+void amb_get_queue_status(ubyte *depth, ubyte *high_water, uword *overflows){
+	ubyte ien;
+
+	ien = IEN;
+	IEN = 0;
+	*depth = (rx_head - rx_tail) & AMB_RX_QUEUE_MASK;
+	*high_water = slave_node.rx_high_water;
+	*overflows = slave_node.rx_overflows;
+	IEN = ien;
+}
+
+/* Report how often monitor replies found no free transmit object */
+void amb_get_tx_status(uword *delayed, uword *clobbered){
+	ubyte ien;
+
+	ien = IEN;
+	IEN = 0;
+	*delayed = slave_node.tx_delayed;
+	*clobbered = slave_node.tx_clobbered;
+	IEN = ien;
+}
+
+/* Report the latency statistics of one class */
+void amb_get_latency(ubyte lat_class, uword *hist, uword *misses, uword *max){
+	ubyte b, ien;
+
+	ien = IEN;
+	IEN = 0;
+	for (b = 0; b < AMB_LATENCY_BUCKETS; b++)
+		hist[b] = slave_node.lat_hist[lat_class][b];
+	*misses = slave_node.lat_misses[lat_class];
+	*max = slave_node.lat_max[lat_class];
+	IEN = ien;
+}
+
+/* Report the CAN error counters, all taken at the same time */
+void amb_get_error_counts(uword *counts){
+	ubyte i, ien;
+
+	ien = IEN;
+	IEN = 0;
+	for (i = 0; i < AMB_NUM_ERR_CAUSES; i++)
+		counts[i] = slave_node.err_count[i];
+	IEN = ien;
+}
+
+/* Set the function the bottom half calls when no request is waiting */
+void amb_register_idle_function(idle_func_type func){
+	amb_idle_func = func;
 }
 
+/* Start the bottom half for the idle function */
+void amb_wake_idle(void){
+	if (amb_idle_func)
+		AMB_BH_TRIGGER;
+}
+
+/* Time in T3 counts, 0.4 us each */
+ulong amb_get_time(){
+	uword high, low;
+	ubyte ien;
+
+	ien = IEN;
+	IEN = 0;
+	high = t3_overflows;
+	low = T3;
+	/* Overflow not counted yet */
+	if (T3IR && low < 0x8000)
+		high++;
+	IEN = ien;
+	return ((ulong) high << 16) | low;
+}
 
+/* Set the time to live of cached monitor replies for a range of RAs */
+int amb_cache_policy(ulong low_address, ulong high_address, uword ttl){
+	ubyte i, free;
+
+	free = AMB_CACHE_POLICIES;
+	for (i = 0; i < AMB_CACHE_POLICIES; i++) {
+		if (amb_cache_policies[i].ttl == 0) {
+			if (free == AMB_CACHE_POLICIES)
+				free = i;
+		} else if (amb_cache_policies[i].low_address == low_address &&
+				   amb_cache_policies[i].high_address == high_address) {
+			free = i;
+			break;
+		}
+	}
+	if (free == AMB_CACHE_POLICIES)
+		return -1;
+
+	amb_cache_policies[free].low_address = low_address;
+	amb_cache_policies[free].high_address = high_address;
+	amb_cache_policies[free].ttl = ttl;
+
+	/* Replies kept under the old policy go */
+	for (i = 0; i < AMB_CACHE_SIZE; i++) {
+		if (amb_cache[i].ra >= low_address && amb_cache[i].ra <= high_address)
+			amb_cache[i].ra = AMB_CACHE_FREE;
+	}
+	return 0;
+}
+
+/* Drop the cached reply for an RA */
+void amb_cache_invalidate(ulong ra){
+	ubyte i;
+
+	for (i = 0; i < AMB_CACHE_SIZE; i++) {
+		if (amb_cache[i].ra == ra) {
+			amb_cache[i].ra = AMB_CACHE_FREE;
+			if (amb_cache_stats[3] != 0xFFFF)
+				amb_cache_stats[3]++;
+		}
+	}
+}
+
+/* Report the cache counters */
+void amb_get_cache_stats(uword *hits, uword *misses, uword *evictions, uword *invalidations){
+	ubyte ien;
+
+	ien = IEN;
+	IEN = 0;
+	*hits = amb_cache_stats[0];
+	*misses = amb_cache_stats[1];
+	*evictions = amb_cache_stats[2];
+	*invalidations = amb_cache_stats[3];
+	IEN = ien;
+}
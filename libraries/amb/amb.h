@@ -48,12 +48,46 @@
 
 	#endif /* TRUE */
 
+	/*
+	 * Optional page table dispatch.  When defined, amb_register_function()
+	 * also builds a table indexed by the top bits of the 18 bit relative
+	 * address which points at the first callback range in each page, so that
+	 * the CAN interrupt binary searches only the ranges reaching into the
+	 * page of the request instead of all of them.  A page covered by one range
+	 * takes a single compare.  The table costs AMB_NUM_PAGES bytes of IDATA:
+	 * 256 bytes with the default AMB_PAGE_SHIFT of 10 (1024 RCAs per page),
+	 * 64 bytes with 12.
+	 */
+	// #define AMB_PAGE_DISPATCH
+
+	#ifdef AMB_PAGE_DISPATCH
+
+		#define AMB_PAGE_SHIFT		10								/* log2 of RCAs per page */
+		#define AMB_NUM_PAGES		(0x40000L >> AMB_PAGE_SHIFT)	/* Pages in 0..3FFFF */
+		#define AMB_PAGE_TABLE_MAX	256								/* IDATA budget for the table, bytes */
+
+	#endif /* AMB_PAGE_DISPATCH */
+
 	/* Define internal slave error codes */
 	#define DUP_SLAVE_ADDR_E	0x01	/* Duplicate slave address detected */
 	#define NO_DS1820_E			0x02	/* No DS1820 device found */
 	#define NO_SN_E				0x03	/* No serial number read */
 	#define ONEWIRE_CRC_E		0x04	/* CRC error on a 1-Wire bus transaction */
 
+	/* Causes of CAN errors, see amb_get_error_counts() */
+	#define AMB_ERR_BOFF			0	/* Bus off */
+	#define AMB_ERR_EWRN			1	/* Error warning limit reached */
+	#define AMB_ERR_STUFF			2	/* LEC stuff error */
+	#define AMB_ERR_FORM			3	/* LEC form error */
+	#define AMB_ERR_ACK				4	/* LEC acknowledge error */
+	#define AMB_ERR_BIT1			5	/* LEC bit 1 error */
+	#define AMB_ERR_BIT0			6	/* LEC bit 0 error, also seen during bus off recovery */
+	#define AMB_ERR_CRC				7	/* LEC CRC error */
+	#define AMB_ERR_MSGLST_OBJ1		8	/* Identify broadcast lost in message object 1 */
+	#define AMB_ERR_MSGLST_OBJ15	9	/* M&C request lost in message object 15 */
+	#define AMB_ERR_RX_OVERFLOW		10	/* M&C request lost with the request queue full */
+	#define AMB_NUM_ERR_CAUSES		11
+
 	/* An enum for CAN message direction */
 	typedef enum {	CAN_MONITOR,
 					CAN_CONTROL
@@ -67,14 +101,26 @@
 		CAN_DIRN_TYPE		dirn;				/* Direction of message */
 	} CAN_MSG_TYPE;
 
+	/* Classes of the latency statistics, see amb_get_latency() */
+	#define AMB_LATENCY_MONITOR_BUILTIN		0	/* Monitor points answered by the library */
+	#define AMB_LATENCY_MONITOR_CALLBACK	1	/* Monitor points answered by a callback, or from its cached replies */
+	#define AMB_LATENCY_CONTROL_BUILTIN		2	/* Control points handled by the library */
+	#define AMB_LATENCY_CONTROL_CALLBACK	3	/* Control points handled by a callback */
+	#define AMB_LATENCY_CLASSES				4
+	#define AMB_LATENCY_BUCKETS				8
+
 	/* Callback function typedef */
 	typedef int(*read_or_write_func)(CAN_MSG_TYPE *message);
 
+	/* Idle function typedef: returns nonzero if it did some work */
+	typedef int(*idle_func_type)(void);
+
 	/* Callback info */
 	typedef struct {
 		ulong				low_address;	/* First RA in range */
 		ulong				high_address;	/* Last RA in range */
 		read_or_write_func	cb_func;		/* Function to call when message in range */
+		ubyte				reg_id;			/* Registration this range belongs to */
 	} CALLBACK_STRUCT;
 
 	/*
@@ -92,21 +138,64 @@
 	 */
 	extern int amb_init_slave(void *cb_ops_memory);
 
+	/**
+	 * As amb_init_slave() but also tells the library how many elements the
+	 * CALLBACK_STRUCT array holds, so that amb_register_function() can refuse
+	 * registrations which would overflow it.
+	 */
+	extern int amb_init_slave_n(void *cb_ops_memory, ubyte max_cbs);
+
 	/**
 	 * Register a callback function to be called when a CAN message with a 
 	 * relative address between low_address and high_address is received.
 	 * The callback is passed a pointer to a CAN_MSG_TYPE structure
 	 * Note that if the message is a monitor message, the called function
 	 * should set the message data length and data bytes before returning 
+	 *
+	 * The ranges are kept sorted and never overlap: any part of the new range
+	 * which is already registered stays with the earlier registration, so the
+	 * new range may take up more than one element of the callback array.
+	 * Returns -1 if nothing of the range is left to register or if the
+	 * callback array is full.
+	 * Callbacks run in the bottom half of the CAN interrupt, a software
+	 * interrupt below the CAN interrupt level, so requests arriving meanwhile
+	 * are queued rather than lost.
 	 */
 	extern int amb_register_function(ulong low_address, ulong high_address, read_or_write_func func);
 
+	/**
+	 * Preload the reply to a monitor point which never changes after boot
+	 * into a dedicated transmit object.  Requests for it are then answered
+	 * straight from the CAN interrupt without calling any function.  The
+	 * library uses three of the four objects for its own revision levels
+	 * (0x30000, 0x30004 and 0x30005).  Returns -1 if no object is left.
+	 */
+	extern int amb_register_static_monitor(ulong address, ubyte len, ubyte *data);
+
 	/**
 	 * Unregister last registered function if any. This allows to roll back
      * in case of error during the registration of the callback functions.
+     * All the ranges stored by the last successful registration are removed.
      */
 	extern int amb_unregister_last_function(void);
 
+	/**
+	 * Register a function for work the application defers from its
+	 * callbacks.  The bottom half calls it whenever no request is waiting,
+	 * for as long as it returns nonzero, so each call should do one short
+	 * piece of work.  It runs at the bottom half level, like the callbacks.
+	 * The bottom half is also started every 26 ms (T3 overflow) for it.
+	 * 0 removes it.
+	 */
+	extern void amb_register_idle_function(idle_func_type func);
+
+	/**
+	 * Start the bottom half for the idle function now, e.g. from an
+	 * interrupt which has finished a piece of deferred work.  Does nothing
+	 * with no idle function registered.
+	 */
+	extern void amb_wake_idle(void);
+
 	/**
 	 * Start handling CAN interrupts. Currently this routine enables all
 	 * interrupts on the C167. 
@@ -121,6 +210,50 @@
 	extern void amb_get_error_status(uword	*num_errors,		             /* Number of CAN errors */
 									 ubyte	*last_slave_error);	             /* Last internal slave error */
 	extern void amb_get_num_transactions(ulong *num_transactions);           /* Number of completed transactions */
+	extern void amb_get_queue_status(ubyte *depth,                            /* Requests waiting for the bottom half */
+									 ubyte *high_water,                       /* Most requests ever waiting */
+									 uword *overflows);                       /* Requests lost with the queue full */
+	extern void amb_get_tx_status(uword *delayed,                            /* Monitor replies which waited for a transmit object */
+								  uword *clobbered);                         /* Monitor replies which overwrote a pending one */
+
+	/**
+	 * Latency statistics of one class, in counts of 0.4 us of timer T3,
+	 * which the library runs free from amb_init_slave().  Latency runs from
+	 * entry to the CAN interrupt until the monitor reply is requested for
+	 * transmission, or until the callback of a control request returns.
+	 * hist[AMB_LATENCY_BUCKETS]: bucket b counts latencies below
+	 * 12.8 us << b, the last bucket all longer ones.  misses counts
+	 * latencies over 150 us.  Counters saturate at 0xFFFF.
+	 */
+	extern void amb_get_latency(ubyte lat_class, uword *hist, uword *misses, uword *max);
+
+	/**
+	 * Copy the CAN error counters, one per AMB_ERR_ cause, into
+	 * counts[AMB_NUM_ERR_CAUSES].  The copy is made with interrupts off so
+	 * the counters are consistent.  Counters saturate at 0xFFFF; the total
+	 * returned by monitor point 0x30001 still wraps.
+	 */
+	extern void amb_get_error_counts(uword *counts);
+
+	/**
+	 * Time in counts of 0.4 us since amb_init_slave(), from T3 and the
+	 * count of its overflows.  Wraps after about 28 minutes.
+	 */
+	extern ulong amb_get_time(void);
+
+	/**
+	 * Monitor reply cache.  amb_cache_policy() makes the replies of the
+	 * callbacks for RAs low_address to high_address valid for ttl ms:
+	 * requests in that time get the last reply without a call.  ttl = 0
+	 * stops caching the range.  Returns -1 if all policies are in use.
+	 * A control request to an RA drops its cached reply;
+	 * amb_cache_invalidate() does the same for other RAs the application
+	 * knows are affected.  Cache functions are not reentrant: call them from
+	 * callbacks or before amb_start().
+	 */
+	extern int amb_cache_policy(ulong low_address, ulong high_address, uword ttl);
+	extern void amb_cache_invalidate(ulong ra);
+	extern void amb_get_cache_stats(uword *hits, uword *misses, uword *evictions, uword *invalidations);
 
 #endif /* AMB_H */
 
@@ -23,13 +23,112 @@
 
 #include <reg167.h>
 #include <intrins.h>
+#ifndef DS1820_FIXED_POINT_ONLY
 #include <math.h>
+#endif
 
 #include "ds1820.h"
 
+/*
+ ****************************************************************************
+ * Interrupt Vectors
+ ****************************************************************************
+ */
+
+#define T2INT    0x22	/* GPT1 timer 2 overflow */
+
+/* Interrupt control for the non-blocking engine: ILVL = 5, GLVL = 0, enabled.
+ * Above the AMB bottom half, so its callbacks don't stretch a time slot,
+ * and below the CAN interrupt. */
+#define DS1820_T2_IC	0x0054
+
 /* Global */
 static ubyte ds1820Running=0;
 
+/* ROM codes of the sensors found by ds1820_search() */
+static ubyte ds1820_roms[DS1820_MAX_SENSORS][8];
+static ubyte ds1820_sensors=0;
+
+/* Last good scratchpad of each sensor.  ds1820_seq[] counts the updates,
+ * so that a reader interrupted by one can tell and read again. */
+static ubyte ds1820_scratch[DS1820_MAX_SENSORS][9];
+static volatile ubyte ds1820_seq[DS1820_MAX_SENSORS];
+static volatile short ds1820_status[DS1820_MAX_SENSORS];	/* Last reading: 0 OK, -1 none yet, -2 CRC error */
+
+/* Family of the only device on the wire, from ds1820_get_sn(), for when none was searched for */
+static ubyte ds1820_family=DS1820_FAMILY;
+
+/* ROM code of the DS1820 on the board, which ds1820_search() keeps first */
+#define ONBOARD_UNKNOWN		0
+#define ONBOARD_FOUND		1	/* by ds1820_get_sn() */
+#define ONBOARD_SET			2	/* by ds1820_set_onboard() */
+static ubyte ds1820_onboard[8];
+static ubyte ds1820_onboard_known=ONBOARD_UNKNOWN;
+
+/* DS18B20 resolution, and the polls a conversion may take with it */
+static ubyte ds1820_resolution=12;
+static uword ds1820_max_polls;
+
+/*
+ * Non-blocking engine.  A script of 1-Wire operations is run from the
+ * Timer 2 interrupt, one step per interrupt.  Like the blocking routines
+ * the interrupt busy waits for the first counts of a time slot; it then
+ * loads T2 to overflow when the slot is over.
+ */
+
+/* Script operations */
+#define OW_END		0	/* Done */
+#define OW_RESET	1	/* Reset pulse and presence pulse */
+#define OW_WRITE	2	/* Write the byte which follows in the script */
+#define OW_STORE	3	/* Read as many bytes as follows in the script, the scratchpad of the current sensor */
+#define OW_CONVERT	4	/* Wait for the end of a temperature conversion */
+#define OW_ROM		5	/* Write the ROM code of the current sensor */
+#define OW_NEXT_SENSOR	6	/* Go on with the next sensor at the offset which follows in the script, if any */
+
+/* Engine states */
+#define OW_NEXT		0	/* Start the next operation */
+#define OW_RELEASE	1	/* End of the reset pulse */
+#define OW_PRESENCE	2	/* Sample the presence pulse */
+#define OW_SLOTS	3	/* Write or read the bits of a byte */
+#define OW_POLL		4	/* Read a slot every 10 ms until the conversion is done */
+
+#define OW_POLL_TICKS	1563	/* 10 ms */
+#define OW_MAX_POLLS	100		/* a conversion takes up to 750 ms, halved for each bit less on a DS18B20 */
+
+/* Temperature reading of the only device on the wire, as in the earlier ds1820_get_temp() */
+static const ubyte temp_script[] = {
+	OW_RESET, OW_WRITE, 0xCC, OW_WRITE, 0x44, OW_CONVERT,			/* Skip ROM, start conversion */
+	OW_RESET, OW_WRITE, 0xCC, OW_WRITE, 0xBE, OW_STORE, 9, OW_END	/* Skip ROM, read scratchpad */
+};
+
+/* Temperature reading of all the sensors found by ds1820_search():
+ * one conversion for all of them, then each scratchpad in turn */
+static const ubyte sweep_script[] = {
+	OW_RESET, OW_WRITE, 0xCC, OW_WRITE, 0x44, OW_CONVERT,				/* Skip ROM, all start converting */
+	OW_RESET, OW_WRITE, 0x55, OW_ROM, OW_WRITE, 0xBE, OW_STORE, 9,	/* 6: Match ROM, read scratchpad */
+	OW_NEXT_SENSOR, 6, OW_END
+};
+
+static const ubyte *ow_script;
+static ubyte ow_pc, ow_state, ow_op, ow_in_slot, ow_sensor;
+static const ubyte *ow_src;
+static ubyte ow_byte, ow_bit, ow_count, ow_index, ow_crc;
+static uword ow_polls;
+static ubyte ow_buffer[9];
+static volatile short ow_result;	/* DS1820_BUSY while the engine runs */
+
+static void ow_finish(short result);
+static void ow_store(void);
+static void ow_start_slot(void);
+static void ow_write_slot(ubyte tx_bit);
+static ubyte ow_read_slot(void);
+static ubyte sensor_family(ubyte index);
+static ubyte select_sensor(ubyte index);
+static ubyte search_roms(void);
+static void onboard_first(ubyte count);
+static void update_max_polls(void);
+static void ds18b20_compatible(ubyte scratch[9]);
+
 /* Reset one wire bus and test for presence pulse */
 ubyte Reset_1W(void)
 {
@@ -77,36 +176,41 @@ void Write_1W(ubyte tx_byte)
 {
 	int i;
 
+	for (i=0; i<8; i++)
+		WriteBit_1W((tx_byte >> i) & 0x01);
+}
+
+/* Write one bit on the One Wire bus */
+void WriteBit_1W(ubyte tx_bit)
+{
 	/* Make sure pin will be high */
 	SET_PIN;
 
 	/* Set port pin to output */
 	SET_OUTPUT;
-	
-	for (i=0; i<8; i++) {
-		/* Start timer */
-		CLEAR_T2;
-		START_T2;
 
-		/* Set pin low to initiate timeslot */
-		RESET_PIN;
-
-		/* Wait for at least 1 usec (6.4 actually) */
-		while (READ_T2 < 1) ;
+	/* Start timer */
+	CLEAR_T2;
+	START_T2;
 
-		/* Write the bit if necessary */
-		if ((tx_byte >> i) & 0x01)
-			SET_PIN;
+	/* Set pin low to initiate timeslot */
+	RESET_PIN;
 
-		/* Wait out til end of timeslot */
-		while (READ_T2 < 12) ;	
+	/* Wait for at least 1 usec (6.4 actually) */
+	while (READ_T2 < 1) ;
 
-		/* Bring line high */
+	/* Write the bit if necessary */
+	if (tx_bit)
 		SET_PIN;
 
-		/* Wait another usec before next timeslot */
-		while (READ_T2 < 13) ;
-	}
+	/* Wait out til end of timeslot */
+	while (READ_T2 < 12) ;	
+
+	/* Bring line high */
+	SET_PIN;
+
+	/* Wait another usec before next timeslot */
+	while (READ_T2 < 13) ;
 }
 
 /* Read a byte from the One Wire bus */
@@ -115,49 +219,60 @@ ubyte Read_1W(void)
 	int i;
 	ubyte rx_byte = 0x0; /* initialise to zero */
 
+	for (i=0; i<8; i++) {
+		if (ReadBit_1W())
+			rx_byte |= (0x01 << i);
+	}
+
+	return rx_byte; /* Return the byte read */
+}
+
+/* Read one bit from the One Wire bus */
+ubyte ReadBit_1W(void)
+{
+	ubyte rx_bit;
+
 	/* Make sure pin will be high */
 	SET_PIN;
 
 	/* Set port pin to output */
 	SET_OUTPUT;
 	
-	for (i=0; i<8; i++) {
-		/* Start timer */
-		CLEAR_T2;
-		START_T2;
+	/* Start timer */
+	CLEAR_T2;
+	START_T2;
 
-		/* Set pin low to initiate timeslot */
-		RESET_PIN;
+	/* Set pin low to initiate timeslot */
+	RESET_PIN;
 
-		/* Wait for at least 1 usec (6.4 actually) */
-		while (READ_T2 < 1) ;
+	/* Wait for at least 1 usec (6.4 actually) */
+	while (READ_T2 < 1) ;
 
-		/* Make pin an input */
-		SET_INPUT;
+	/* Make pin an input */
+	SET_INPUT;
 
-		/* Wait for slave to write bit */
-		while (READ_T2 < 2) ;
+	/* Wait for slave to write bit */
+	while (READ_T2 < 2) ;
 
-		/* Sample line */
-		if (READ_PIN) 
-			rx_byte |= (0x01 << i);
+	/* Sample line */
+	rx_bit = READ_PIN;
 
-		/* Wait out til end of timeslot */
-		while (READ_T2 < 11) ;	
+	/* Wait out til end of timeslot */
+	while (READ_T2 < 11) ;	
 
-		/* Bring line high */
-		SET_PIN;
+	/* Bring line high */
+	SET_PIN;
 
-		/* Set port pin to output */
-		SET_OUTPUT;
+	/* Set port pin to output */
+	SET_OUTPUT;
 
-		/* Wait another usec before next timeslot */
-		while (READ_T2 < 12) ;
-	}
+	/* Wait another usec before next timeslot */
+	while (READ_T2 < 12) ;
 	
-	return rx_byte; /* Return the byte read */
+	return rx_bit; /* Return the bit read */
 }
 
+#ifndef DS1820_FIXED_POINT_ONLY
 /* Convert from first two bytes of temperature data to degrees C */
 /* Gives 1/2 degree C resolution */
 float Do_1W_Temperature(ubyte MSB, ubyte LSB)
@@ -206,11 +321,133 @@ float Do_1W_Temperature_Full(ubyte MSB, ubyte LSB,
 
 	return amt;
 }
+#endif /* DS1820_FIXED_POINT_ONLY */
+
+/* Whole degrees from the first two bytes of temperature data */
+static signed char whole_degrees(ubyte MSB, ubyte LSB)
+{
+	signed char temp;
+
+/* shift the byte to remove the least significant bit */
+	temp = LSB>>1;
+	
+/* Most significant byte indicates sign */
+	if (MSB)
+		temp |= 0x80;
+
+	return temp;
+}
+
+/* Divide rounding to the nearest, halves away from zero as the float results are rounded */
+static long div_round(long num, ubyte den)
+{
+	if (num < 0)
+		return -((-num + den / 2) / den);
+	return (num + den / 2) / den;
+}
+
+/* Convert from first two bytes of temperature data to 1/16 degree C */
+/* Gives 1/2 degree C resolution, the same as Do_1W_Temperature() */
+short Do_1W_Temperature_16(ubyte MSB, ubyte LSB)
+{
+	short amt;
+
+	amt = (short) whole_degrees(MSB, LSB) * 16;
+
+/* Least significant bit signifies half a degree */
+	if (LSB & 0x01)
+		amt += 8;
+
+	return amt;
+}
+
+/* Convert temperature with full resolution to 1/16 degree C */
+/* Exact for the COUNT_PER_C of 16 which the DS1820 always gives */
+short Do_1W_Temperature_Full_16(ubyte MSB, ubyte LSB,
+							    ubyte count_remain, ubyte count_per_C)
+{
+	long amt;
+
+	amt = (long) whole_degrees(MSB, LSB) * 16;
+
+/* Calculation from p4 of the DS1820 Data Sheet, scaled by 16 */
+	if (count_per_C)
+		amt = div_round(amt * count_per_C + 16L * ((short) count_per_C - (short) count_remain) - 4 * (short) count_per_C, count_per_C);
+
+	return (short) amt;
+}
+
+/* Convert temperature with full resolution to 1/100 degree C */
+/* 1/16 degree steps are rounded to the nearest 1/100 */
+short Do_1W_Temperature_Centi(ubyte MSB, ubyte LSB,
+							  ubyte count_remain, ubyte count_per_C)
+{
+	long amt;
+
+	amt = (long) whole_degrees(MSB, LSB) * 100;
+
+/* Calculation from p4 of the DS1820 Data Sheet, scaled by 100 */
+	if (count_per_C)
+		amt = div_round(amt * count_per_C + 100L * ((short) count_per_C - (short) count_remain) - 25 * (short) count_per_C, count_per_C);
+
+	return (short) amt;
+}
 
 /*
  * Routine to calculate 8 bit CRC from DalSemi
  * Polynomial is CRC = X^8 + X^5 + X^4 + 1
- * Adapted from assembly language in Dallas Semiconductor
+ * The implementation is chosen in ds1820.h
+ */
+#if defined(DS1820_CRC_TABLE)
+
+/* CRC of each byte value with CRC 0 */
+static const ubyte crc_table[256] = {
+	0x00, 0x5E, 0xBC, 0xE2, 0x61, 0x3F, 0xDD, 0x83, 0xC2, 0x9C, 0x7E, 0x20, 0xA3, 0xFD, 0x1F, 0x41,
+	0x9D, 0xC3, 0x21, 0x7F, 0xFC, 0xA2, 0x40, 0x1E, 0x5F, 0x01, 0xE3, 0xBD, 0x3E, 0x60, 0x82, 0xDC,
+	0x23, 0x7D, 0x9F, 0xC1, 0x42, 0x1C, 0xFE, 0xA0, 0xE1, 0xBF, 0x5D, 0x03, 0x80, 0xDE, 0x3C, 0x62,
+	0xBE, 0xE0, 0x02, 0x5C, 0xDF, 0x81, 0x63, 0x3D, 0x7C, 0x22, 0xC0, 0x9E, 0x1D, 0x43, 0xA1, 0xFF,
+	0x46, 0x18, 0xFA, 0xA4, 0x27, 0x79, 0x9B, 0xC5, 0x84, 0xDA, 0x38, 0x66, 0xE5, 0xBB, 0x59, 0x07,
+	0xDB, 0x85, 0x67, 0x39, 0xBA, 0xE4, 0x06, 0x58, 0x19, 0x47, 0xA5, 0xFB, 0x78, 0x26, 0xC4, 0x9A,
+	0x65, 0x3B, 0xD9, 0x87, 0x04, 0x5A, 0xB8, 0xE6, 0xA7, 0xF9, 0x1B, 0x45, 0xC6, 0x98, 0x7A, 0x24,
+	0xF8, 0xA6, 0x44, 0x1A, 0x99, 0xC7, 0x25, 0x7B, 0x3A, 0x64, 0x86, 0xD8, 0x5B, 0x05, 0xE7, 0xB9,
+	0x8C, 0xD2, 0x30, 0x6E, 0xED, 0xB3, 0x51, 0x0F, 0x4E, 0x10, 0xF2, 0xAC, 0x2F, 0x71, 0x93, 0xCD,
+	0x11, 0x4F, 0xAD, 0xF3, 0x70, 0x2E, 0xCC, 0x92, 0xD3, 0x8D, 0x6F, 0x31, 0xB2, 0xEC, 0x0E, 0x50,
+	0xAF, 0xF1, 0x13, 0x4D, 0xCE, 0x90, 0x72, 0x2C, 0x6D, 0x33, 0xD1, 0x8F, 0x0C, 0x52, 0xB0, 0xEE,
+	0x32, 0x6C, 0x8E, 0xD0, 0x53, 0x0D, 0xEF, 0xB1, 0xF0, 0xAE, 0x4C, 0x12, 0x91, 0xCF, 0x2D, 0x73,
+	0xCA, 0x94, 0x76, 0x28, 0xAB, 0xF5, 0x17, 0x49, 0x08, 0x56, 0xB4, 0xEA, 0x69, 0x37, 0xD5, 0x8B,
+	0x57, 0x09, 0xEB, 0xB5, 0x36, 0x68, 0x8A, 0xD4, 0x95, 0xCB, 0x29, 0x77, 0xF4, 0xAA, 0x48, 0x16,
+	0xE9, 0xB7, 0x55, 0x0B, 0x88, 0xD6, 0x34, 0x6A, 0x2B, 0x75, 0x97, 0xC9, 0x4A, 0x14, 0xF6, 0xA8,
+	0x74, 0x2A, 0xC8, 0x96, 0x15, 0x4B, 0xA9, 0xF7, 0xB6, 0xE8, 0x0A, 0x54, 0xD7, 0x89, 0x6B, 0x35
+};
+
+ubyte Do_1W_CRC(ubyte next_byte, ubyte CRC)
+{
+	return crc_table[next_byte ^ CRC];
+}
+
+#elif defined(DS1820_CRC_NIBBLE)
+
+/* CRC of the low and of the high nibble values with CRC 0: the CRC is linear,
+ * so the CRC of a byte is the XOR of the CRCs of its nibbles */
+static const ubyte crc_low[16] = {
+	0x00, 0x5E, 0xBC, 0xE2, 0x61, 0x3F, 0xDD, 0x83,
+	0xC2, 0x9C, 0x7E, 0x20, 0xA3, 0xFD, 0x1F, 0x41
+};
+static const ubyte crc_high[16] = {
+	0x00, 0x9D, 0x23, 0xBE, 0x46, 0xDB, 0x65, 0xF8,
+	0x8C, 0x11, 0xAF, 0x32, 0xCA, 0x57, 0xE9, 0x74
+};
+
+ubyte Do_1W_CRC(ubyte next_byte, ubyte CRC)
+{
+	next_byte ^= CRC;
+	return crc_low[next_byte & 0x0F] ^ crc_high[next_byte >> 4];
+}
+
+#else /* DS1820_CRC_BITWISE */
+
+/*
+ * Bit by bit, adapted from assembly language in Dallas Semiconductor
  * Application Note 27
  */
 ubyte Do_1W_CRC(ubyte next_byte, ubyte CRC)
@@ -232,8 +469,12 @@ ubyte Do_1W_CRC(ubyte next_byte, ubyte CRC)
 	return CRC;
 }
 
+#endif /* DS1820_CRC_TABLE */
+
 short ds1820_init(void)
 {
+	int i;
+
   /* ---------- Timer 2 Control Register ----------
    *  timer 2 works in timer mode
    *  prescaler factor is 128 (6.4 usec resolution)
@@ -244,6 +485,11 @@ short ds1820_init(void)
   T2CON = 0x0004;
   T2    = 0x0000;  /* load timer 2 register */
 
+	/* No reading yet */
+	for (i=0; i<DS1820_MAX_SENSORS; i++)
+		ds1820_status[i] = -1;
+	update_max_polls();
+
 	/* Reset pulse and presence sequence */
 	if (!Reset_1W())
 		return -1;
@@ -253,7 +499,17 @@ short ds1820_init(void)
 short ds1820_get_sn(ubyte sn[8])
 {
 	int i;
-	ubyte CRC;
+	ubyte CRC, index, count=0, found;
+
+	/* The ROM code given by the application */
+	if (ds1820_onboard_known == ONBOARD_SET) {
+		for (i=0; i<8; i++)
+			sn[i] = ds1820_onboard[i];
+		ds1820_family = sn[0];
+		update_max_polls();
+		return 0;
+	}
+	ds1820_onboard_known = ONBOARD_UNKNOWN;
 
 	/* Start cycle on 1 wire bus by issuing reset and detecting presence */
 	Reset_1W();
@@ -269,70 +525,616 @@ short ds1820_get_sn(ubyte sn[8])
 		CRC = Do_1W_CRC(sn[i], CRC);
 	}
 
-	if (CRC != 0x0)
-		return -1;
+	if (CRC != 0x0) {
+		/* More than one device answered: the board's is the only DS1820 among them */
+		count = search_roms();
+		found = count;
+		for (index = 0; index < count; index++) {
+			if (ds1820_roms[index][0] != DS1820_FAMILY)
+				continue;
+			if (found != count) /* Two DS1820s: can't tell which */
+				return -1;
+			found = index;
+		}
+		if (found == count)
+			return -1;
+		for (i=0; i<8; i++)
+			sn[i] = ds1820_roms[found][i];
+	}
+
+	for (i=0; i<8; i++)
+		ds1820_onboard[i] = sn[i];
+	ds1820_onboard_known = ONBOARD_FOUND;
+
+	/* Several devices: read them all, the board's first */
+	if (CRC != 0x0) {
+		onboard_first(count);
+		return 0;
+	}
+
+	/* The scratchpad to expect when reading the only device on the wire */
+	ds1820_family = sn[0];
+	update_max_polls();
 	return 0;
 }
 
-short ds1820_get_temp(ubyte *MSB, ubyte *LSB, ubyte *count_remain, ubyte *count_per_C)
+/*
+ * Give the ROM code of the DS1820 on the board, for a line with other
+ * DS1820s on it.  ds1820_get_sn() then returns it without asking the wire.
+ */
+short ds1820_set_onboard(const ubyte rom[8])
 {
 	int i;
-	uword wait_count;
-	ubyte rx_buffer[10];
 	ubyte CRC;
 
-	if(ds1820Running){ // Check if the subrutine is still running
-		return 0;
-	}	
+	CRC = 0x0;
+	for (i=0; i<8; i++)
+		CRC = Do_1W_CRC(rom[i], CRC);
+	if (CRC != 0x0 || rom[0] != DS1820_FAMILY)
+		return -1;
 
-	ds1820Running = 1; // Signal that this is running
+	for (i=0; i<8; i++)
+		ds1820_onboard[i] = rom[i];
+	ds1820_onboard_known = ONBOARD_SET;
+	return 0;
+}
 
-	/* Start temperature reading cycle of DS1820 */
-	Reset_1W();
+/*
+ * Find the sensors on the wire, the board's DS1820 first.  Without its ROM
+ * code from ds1820_get_sn() none is taken, so that a probe is never read as
+ * the board.
+ */
+short ds1820_search(void)
+{
+	ds1820_sensors = 0;
+	if (ds1820_onboard_known == ONBOARD_UNKNOWN) {
+		update_max_polls();
+		return -1;
+	}
+	onboard_first(search_roms());
+	return ds1820_sensors;
+}
+
+/*
+ * Find the ROM codes of the DS1820 and DS18B20 devices on the wire with Search ROM,
+ * as in Dallas Semiconductor Application Note 187.  Each pass reads two
+ * bits (the bit and its complement, ANDed over all the devices still
+ * taking part) for each of the 64 ROM bits, and writes the bit to follow.
+ * Where devices differ the 0 branch is taken first, and the 1 branch on
+ * the next pass.  Returns their number, in ds1820_roms[].
+ */
+static ubyte search_roms(void)
+{
+	ubyte rom[8];
+	ubyte last_discrepancy, discrepancy, bit_index, id_bit, cmp_bit, direction, mask, CRC, count;
+	int i;
+
+	count = 0;
+	last_discrepancy = 0;
+	do {
+		/* Start cycle on 1 wire bus by issuing reset and detecting presence */
+		if (!Reset_1W())
+			break;
+
+		Write_1W(0xF0); /* Search ROM */
+
+		discrepancy = 0;
+		for (bit_index = 1; bit_index <= 64; bit_index++) {
+			id_bit = ReadBit_1W();
+			cmp_bit = ReadBit_1W();
+			if (id_bit && cmp_bit) /* no device left */
+				break;
+
+			mask = 0x01 << ((bit_index - 1) & 0x07);
+			if (id_bit != cmp_bit) {
+				/* All the devices left have the same bit */
+				direction = id_bit;
+			} else if (bit_index < last_discrepancy) {
+				/* Same branch as on the previous pass */
+				direction = (rom[(bit_index - 1) >> 3] & mask) != 0;
+			} else {
+				/* 1 branch where the previous pass took the 0 branch last */
+				direction = (bit_index == last_discrepancy);
+			}
+			if (id_bit == cmp_bit && !direction)
+				discrepancy = bit_index;
+
+			if (direction)
+				rom[(bit_index - 1) >> 3] |= mask;
+			else
+				rom[(bit_index - 1) >> 3] &= ~mask;
+			WriteBit_1W(direction);
+		}
+		if (bit_index <= 64)
+			break;
+
+		CRC = 0x0;
+		for (i=0; i<8; i++)
+			CRC = Do_1W_CRC(rom[i], CRC);
+		if (CRC != 0x0)
+			break;
+
+		/* Temperature sensors only */
+		if ((rom[0] == DS1820_FAMILY || rom[0] == DS18B20_FAMILY) && count < DS1820_MAX_SENSORS) {
+			for (i=0; i<8; i++)
+				ds1820_roms[count][i] = rom[i];
+			count++;
+		}
+
+		last_discrepancy = discrepancy;
+	} while (last_discrepancy);
+
+	return count;
+}
+
+/*
+ * Make the sensors found by search_roms() those read by the engine, the
+ * board's DS1820 first.  If the search missed it, it still takes the first
+ * place, in that of the last probe if there's no room, so that its reading
+ * fails instead of being that of a probe.
+ */
+static void onboard_first(ubyte count)
+{
+	ubyte index, swap;
+	int i;
 
-	Write_1W(0xCC); /* Skip ROM */
-	Write_1W(0x44); /* Start conversion command */
+	for (index = 0; index < count; index++) {
+		for (i=0; i<8 && ds1820_roms[index][i] == ds1820_onboard[i]; i++) ;
+		if (i == 8)
+			break;
+	}
+	if (index == count) {
+		if (count == DS1820_MAX_SENSORS)
+			count--;
+		index = count++;
+		for (i=0; i<8; i++)
+			ds1820_roms[index][i] = ds1820_onboard[i];
+	}
+	for (i=0; i<8; i++) {
+		swap = ds1820_roms[0][i];
+		ds1820_roms[0][i] = ds1820_roms[index][i];
+		ds1820_roms[index][i] = swap;
+	}
 
-	/* Wait for conversion to complete (signalled by all 1s) */
-	wait_count = 0;
-	while ((Read_1W() != 0xff) &&     /* Avoid lockup by quitting after 1000 */
-			 (wait_count++ < 1000)) ;   /* byte reads (~600 ms) */
+	for (index = 0; index < count; index++)
+		ds1820_status[index] = -1;
+	ds1820_sensors = count;
+	update_max_polls();
+}
 
-	if (wait_count > 999){ /* Error: wait for temperature conversion timed out */
-		ds1820Running = 0; // Function is done and can be called again
+/*
+ * Set the resolution of the DS18B20 sensors: the configuration register
+ * is written with Write Scratchpad, keeping the alarm bytes read back
+ * from the scratchpad, then copied to EEPROM with Copy Scratchpad, so that
+ * a sensor which loses power comes back with it.  A sensor which already
+ * has it is left alone, which spares its EEPROM at every start.
+ */
+short ds1820_set_resolution(ubyte bits)
+{
+	ubyte scratch[9];
+	ubyte index, count, CRC, config;
+	int i;
+
+	if (bits < 9 || bits > 12 || ds1820Running)
 		return -1;
+
+	ds1820_resolution = bits;
+	update_max_polls();
+
+	/* R1 R0 in bits 6 and 5 of the configuration register */
+	config = ((bits - 9) << 5) | 0x1F;
+
+	/* All the sensors found, or the only device on the wire if none was searched for */
+	count = ds1820_sensors ? ds1820_sensors : 1;
+	for (index = 0; index < count; index++) {
+		if (sensor_family(index) != DS18B20_FAMILY)
+			continue;
+
+		/* Read the scratchpad for the alarm bytes and the configuration register */
+		if (!select_sensor(index))
+			return -1;
+		Write_1W(0xBE);
+		CRC = 0x0;
+		for (i=0; i<9; i++) {
+			scratch[i] = Read_1W();
+			CRC = Do_1W_CRC(scratch[i], CRC);
+		}
+		if (CRC != 0x0)
+			return -1;
+		if (scratch[4] == config)
+			continue;
+
+		/* Write Scratchpad: TH, TL and the configuration register */
+		if (!select_sensor(index))
+			return -1;
+		Write_1W(0x4E);
+		Write_1W(scratch[2]);
+		Write_1W(scratch[3]);
+		Write_1W(config);
+
+		/* Copy Scratchpad, with the line held high for the 10 ms it takes */
+		if (!select_sensor(index))
+			return -1;
+		Write_1W(0x48);
+		CLEAR_T2;
+		START_T2;
+		while (READ_T2 < OW_POLL_TICKS) ;
+		SET_INPUT;
 	}
+	return 0;
+}
 
-	/* Reset bus */
-	Reset_1W();
+/* Number of sensors found by ds1820_search() */
+ubyte ds1820_num_sensors(void)
+{
+	return ds1820_sensors;
+}
 
-	Write_1W(0xCC); /* Skip ROM */
-	Write_1W(0xBE); /* Read scratchpad */
+/* ROM code of a sensor found by ds1820_search() */
+short ds1820_get_rom(ubyte index, ubyte rom[8])
+{
+	int i;
 
-	CRC = 0x0;
+	if (index >= ds1820_sensors)
+		return -1;
+	for (i=0; i<8; i++)
+		rom[i] = ds1820_roms[index][i];
+	return 0;
+}
+
+/* Last good reading of a sensor */
+short ds1820_get_sensor(ubyte index, ubyte *MSB, ubyte *LSB, ubyte *count_remain, ubyte *count_per_C)
+{
+	ubyte seq;
+
+	if (index >= DS1820_MAX_SENSORS || (index && index >= ds1820_sensors))
+		return -1;
+	if (ds1820_status[index] == -1) /* Never read */
+		return -1;
+
+	/* Read again if the interrupt updated it meanwhile */
+	do {
+		seq = ds1820_seq[index];
 
-	/* read 9 data bytes */
-	for (i=0; i<9; i++) {
-		rx_buffer[i] = Read_1W();
-		CRC = Do_1W_CRC(rx_buffer[i], CRC);
+		/* Low accuracy temperature is in first two bytes */
+		*LSB = ds1820_scratch[index][0];
+		*MSB = ds1820_scratch[index][1];
+
+		/* Higher resolution data is in bytes 6 and 7 */
+		*count_remain = ds1820_scratch[index][6];
+		*count_per_C = ds1820_scratch[index][7];
+	} while (seq != ds1820_seq[index]);
+
+	return ds1820_status[index];
+}
+
+/* Blocking temperature reading: the engine, waited for */
+short ds1820_get_temp(ubyte *MSB, ubyte *LSB, ubyte *count_remain, ubyte *count_per_C)
+{
+	short result;
+
+	if (ds1820_start_temp()) { // Check if a reading is still running
+		return 0;
 	}
 
-	if (CRC != 0x0){
-		ds1820Running = 0; // Function is done and can be called again
-		return -2;
+	while ((result = ds1820_poll_temp(MSB, LSB, count_remain, count_per_C)) == DS1820_BUSY) ;
+
+	return result;
+}
+
+/* Start a temperature reading in the background */
+short ds1820_start_temp(void)
+{
+	if (ds1820Running) {
+		return -1;
 	}
 
-	/* Low accuracy temperature is in first two bytes */
-	*LSB = rx_buffer[0];
- 	*MSB = rx_buffer[1];
+	ds1820Running = 1; // Signal that this is running
 
-	/* Higher resolution data is in bytes 6 and 7 */
-	*count_remain = rx_buffer[6];
-	*count_per_C = rx_buffer[7];
+	/* All the sensors found, or the only device on the wire if none was searched for */
+	ow_script = ds1820_sensors ? sweep_script : temp_script;
+	ow_sensor = 0;
+	ow_pc = 0;
+	ow_state = OW_NEXT;
+	ow_in_slot = 0;
+	ow_result = DS1820_BUSY;
+
+	/* First step at the next count of the timer */
+	T2IE = 0;
+	T2IR = 0;
+	CLEAR_T2;
+	T2 = 0xFFFF;
+	T2IC = DS1820_T2_IC;
+	START_T2;
+
+	return 0;
+}
+
+/* Check on the temperature reading started by ds1820_start_temp() */
+short ds1820_poll_temp(ubyte *MSB, ubyte *LSB, ubyte *count_remain, ubyte *count_per_C)
+{
+	if (!ds1820Running)
+		return -1;
+
+	if (ow_result == DS1820_BUSY)
+		return DS1820_BUSY;
 
 	ds1820Running = 0; // Function is done and can be called again
 
-	return 0;
+	if (ow_result != 0)
+		return ow_result;
+
+	/* The board's sensor, first */
+	if (ds1820_status[0] != 0)
+		return ds1820_status[0];
+	return ds1820_get_sensor(0, MSB, LSB, count_remain, count_per_C);
+}
+
+/* Timer 2 overflow: next step of the engine */
+void ds1820_t2_isr(void) interrupt T2INT
+{
+	uword delay;
+
+	/* End the time slot in progress */
+	if (ow_in_slot) {
+		SET_PIN;
+		SET_OUTPUT;
+		ow_in_slot = 0;
+	}
+
+	delay = 0;
+	while (!delay && ow_result == DS1820_BUSY) {
+		switch (ow_state) {
+		case OW_NEXT:
+			ow_op = ow_script[ow_pc++];
+			switch (ow_op) {
+			case OW_RESET:
+				/* Pull the line low for 500 usec */
+				SET_OUTPUT;
+				RESET_PIN;
+				ow_state = OW_RELEASE;
+				delay = 78;
+				break;
+			case OW_WRITE:
+				ow_src = &ow_script[ow_pc++];
+				ow_byte = *ow_src++;
+				ow_count = 1;
+				ow_bit = 0;
+				ow_state = OW_SLOTS;
+				break;
+			case OW_ROM:
+				ow_src = ds1820_roms[ow_sensor];
+				ow_byte = *ow_src++;
+				ow_count = 8;
+				ow_bit = 0;
+				ow_state = OW_SLOTS;
+				break;
+			case OW_NEXT_SENSOR:
+				if (++ow_sensor < ds1820_sensors)
+					ow_pc = ow_script[ow_pc];
+				else
+					ow_pc++;
+				break;
+			case OW_STORE:
+				ow_count = ow_script[ow_pc++];
+				ow_index = 0;
+				ow_crc = 0;
+				ow_byte = 0;
+				ow_bit = 0;
+				ow_state = OW_SLOTS;
+				break;
+			case OW_CONVERT:
+				ow_polls = 0;
+				ow_state = OW_POLL;
+				break;
+			default:
+				ow_finish(0);
+				break;
+			}
+			break;
+
+		case OW_RELEASE:
+			/* Set pin to input and sample the presence pulse 70 usec later */
+			SET_INPUT;
+			ow_state = OW_PRESENCE;
+			delay = 11;
+			break;
+
+		case OW_PRESENCE:
+			if (READ_PIN) { /* no presence pulse, so failure */
+				ow_finish(-1);
+				break;
+			}
+			/* Wait around to end procedure: 500 usec from the end of the reset pulse */
+			ow_state = OW_NEXT;
+			delay = 67;
+			break;
+
+		case OW_SLOTS:
+			if (ow_bit == 8) {
+				/* Byte done */
+				ow_bit = 0;
+				if (ow_op == OW_STORE) {
+					ow_buffer[ow_index++] = ow_byte;
+					ow_crc = Do_1W_CRC(ow_byte, ow_crc);
+					ow_byte = 0;
+				}
+				if (--ow_count == 0) {
+					if (ow_op == OW_STORE)
+						ow_store();
+					ow_state = OW_NEXT;
+					break;
+				}
+				if (ow_op != OW_STORE)
+					ow_byte = *ow_src++;
+			}
+
+			if (ow_op != OW_STORE) {
+				ow_write_slot((ow_byte >> ow_bit) & 0x01);
+			} else if (ow_read_slot()) {
+				ow_byte |= (0x01 << ow_bit);
+			}
+			ow_bit++;
+
+			/* Wait out til end of timeslot */
+			delay = 12 - READ_T2;
+			break;
+
+		case OW_POLL:
+			/* The device holds the line low until the conversion is done */
+			if (ow_read_slot()) {
+				ow_state = OW_NEXT;
+				delay = 12 - READ_T2;
+			} else if (++ow_polls >= ds1820_max_polls) {
+				ow_finish(-1);
+			} else {
+				delay = OW_POLL_TICKS;
+			}
+			break;
+		}
+	}
+
+	if (ow_result == DS1820_BUSY) {
+		/* Overflow when the next step is due */
+		T2 = 0 - delay;
+		START_T2;
+	}
+}
+
+/* Scratchpad of the current sensor read: keep it if the CRC is good */
+static void ow_store(void)
+{
+	ubyte i;
+
+	if (ow_crc != 0) {
+		ds1820_status[ow_sensor] = -2;
+		return;
+	}
+	if (sensor_family(ow_sensor) == DS18B20_FAMILY)
+		ds18b20_compatible(ow_buffer);
+	for (i=0; i<9; i++)
+		ds1820_scratch[ow_sensor][i] = ow_buffer[i];
+	ds1820_seq[ow_sensor]++;
+	ds1820_status[ow_sensor] = 0;
+}
+
+/* Engine done: leave the line high and stop the timer */
+static void ow_finish(short result)
+{
+	SET_PIN;
+	SET_OUTPUT;
+	ow_in_slot = 0;
+	T2IE = 0;
+	STOP_T2;
+	ow_result = result;
+}
+
+/* Start a time slot after the recovery time, and wait for at least 1 usec (6.4 actually) */
+static void ow_start_slot(void)
+{
+	/* Make sure pin will be high, and drive it: after a reset it is still an input */
+	SET_PIN;
+	SET_OUTPUT;
+
+	/* Recovery time after the previous slot */
+	CLEAR_T2;
+	START_T2;
+	while (READ_T2 < 1) ;
+
+	/* Start timer */
+	CLEAR_T2;
+	START_T2;
+
+	/* Set pin low to initiate timeslot */
+	RESET_PIN;
+	ow_in_slot = 1;
+
+	while (READ_T2 < 1) ;
+}
+
+/* Write time slot, as in Write_1W().  The interrupt ends it */
+static void ow_write_slot(ubyte tx_bit)
+{
+	ow_start_slot();
+
+	/* Write the bit if necessary */
+	if (tx_bit)
+		SET_PIN;
+}
+
+/* Read time slot up to the sample, as in Read_1W().  The interrupt ends it */
+static ubyte ow_read_slot(void)
+{
+	ow_start_slot();
+
+	/* Make pin an input */
+	SET_INPUT;
+
+	/* Wait for slave to write bit */
+	while (READ_T2 < 2) ;
+
+	/* Sample line */
+	return READ_PIN;
 }
 
+/* Family code of a sensor */
+static ubyte sensor_family(ubyte index)
+{
+	return ds1820_sensors ? ds1820_roms[index][0] : ds1820_family;
+}
+
+/* Reset and address a sensor: Match ROM, or Skip ROM if none was searched for */
+static ubyte select_sensor(ubyte index)
+{
+	int i;
 
+	if (!Reset_1W())
+		return 0;
+	if (!ds1820_sensors) {
+		Write_1W(0xCC);
+		return 1;
+	}
+	Write_1W(0x55);
+	for (i=0; i<8; i++)
+		Write_1W(ds1820_roms[index][i]);
+	return 1;
+}
+
+/* A conversion may take less than 750 ms if all the sensors are DS18B20s */
+static void update_max_polls(void)
+{
+	ubyte index, count;
+
+	ds1820_max_polls = OW_MAX_POLLS >> (12 - ds1820_resolution);
+	count = ds1820_sensors ? ds1820_sensors : 1;
+	for (index = 0; index < count; index++) {
+		if (sensor_family(index) != DS18B20_FAMILY)
+			ds1820_max_polls = OW_MAX_POLLS;
+	}
+}
+
+/*
+ * Rewrite a DS18B20 scratchpad the way a DS1820 gives the same temperature.
+ * The DS18B20 gives 1/16 degree C in bytes 0 and 1, the bits below its
+ * resolution undefined.  A DS1820 gives half degrees in bytes 0 and 1 and
+ * COUNT_REMAIN and COUNT_PER_C in bytes 6 and 7, with
+ * T = whole degrees - 0.25 + (COUNT_PER_C - COUNT_REMAIN) / COUNT_PER_C.
+ * With COUNT_PER_C = 16 that gives the DS18B20 temperature exactly.
+ */
+static void ds18b20_compatible(ubyte scratch[9])
+{
+	short temp, half;
+
+	/* 1/16 degree C, without the undefined bits */
+	temp = (short) (((uword) scratch[1] << 8) | scratch[0]);
+	temp &= ~((1 << (12 - (9 + ((scratch[4] >> 5) & 0x03)))) - 1);
+
+	/* Half degrees, rounded up as the DS1820 does */
+	half = (temp + 4) >> 3;
+	scratch[0] = (ubyte) half;
+	scratch[1] = half < 0 ? 0xFF : 0x00;
+
+	/* Whole degrees are half >> 1 */
+	scratch[6] = (ubyte) (16 * (half >> 1) + 12 - temp);
+	scratch[7] = 16;
+}
@@ -31,6 +31,23 @@
 #define uword unsigned int
 #define ubyte unsigned char
 
+/**
+ * Implementation of Do_1W_CRC(), chosen when the library is built:
+ * DS1820_CRC_TABLE - a 256 byte table in ROM, one lookup per byte.  The default.
+ * DS1820_CRC_NIBBLE - two 16 byte tables, two lookups per byte, for a
+ * tight ROM budget.
+ * DS1820_CRC_BITWISE - bit by bit, eight shifts and tests per byte.
+ */
+#if !defined(DS1820_CRC_TABLE) && !defined(DS1820_CRC_NIBBLE) && !defined(DS1820_CRC_BITWISE)
+#define DS1820_CRC_TABLE
+#endif
+
+/**
+ * Define DS1820_FIXED_POINT_ONLY to leave out the float conversions below,
+ * and the floating point library with them.
+ */
+// #define DS1820_FIXED_POINT_ONLY
+
 /**
  * Routines for ALMA specific things.  All routines return 0 for success and -1
  * on error.
@@ -39,17 +56,81 @@ short ds1820_init(void);
 short ds1820_get_sn(ubyte sn[8]);
 short ds1820_get_temp(ubyte *MSB, ubyte *LSB, ubyte *count_remain, ubyte *count_per_C);
 
+/**
+ * Non-blocking temperature reading.  ds1820_start_temp() starts the reading
+ * done by ds1820_get_temp(), which a state machine then runs from the Timer 2
+ * interrupt.  ds1820_poll_temp() returns DS1820_BUSY until it is done, then
+ * what ds1820_get_temp() would have.  ds1820_start_temp() returns -1 while a
+ * reading is running.  ds1820_init() must have been called before, and the
+ * 1 Wire primitives below must not be used while a reading is running.
+ */
+#define DS1820_BUSY 1
+
+short ds1820_start_temp(void);
+short ds1820_poll_temp(ubyte *MSB, ubyte *LSB, ubyte *count_remain, ubyte *count_per_C);
+
+/**
+ * More than one sensor on the wire.  ds1820_search() finds the ROM codes of
+ * up to DS1820_MAX_SENSORS DS1820 and DS18B20 devices with Search ROM and returns their
+ * number, the board's DS1820 first: sensor 0, which ds1820_poll_temp()
+ * returns, is always the board, and probes follow from sensor 1.  It needs
+ * the board's ROM code from ds1820_get_sn(), and returns -1 without it.  It
+ * uses the blocking primitives, so call it after ds1820_init() and not while
+ * a reading runs.  Once sensors are found a reading started by
+ * ds1820_start_temp() converts on all of them at once (Skip ROM), then
+ * reads each scratchpad in turn (Match ROM).  ds1820_get_sensor() returns
+ * the last good reading of any sensor, and the result of its last reading:
+ * 0, -2 for a CRC error, or -1 if it was never read.
+ *
+ * If more than one device answers ds1820_get_sn() takes the only DS1820
+ * among them as the board's, the probes being DS18B20s, and fails if there
+ * are none or several.  With DS1820 probes, give the board's ROM code to
+ * ds1820_set_onboard() before.
+ */
+#define DS1820_MAX_SENSORS 4
+#define DS1820_FAMILY 0x10	/* ROM family code of the DS1820 */
+#define DS18B20_FAMILY 0x28	/* ROM family code of the DS18B20 */
+
+short ds1820_search(void);
+ubyte ds1820_num_sensors(void);
+short ds1820_get_rom(ubyte index, ubyte rom[8]);
+short ds1820_set_onboard(const ubyte rom[8]);
+short ds1820_get_sensor(ubyte index, ubyte *MSB, ubyte *LSB, ubyte *count_remain, ubyte *count_per_C);
+
+/**
+ * DS18B20 sensors are read like the DS1820: the family is told from the ROM
+ * code, and their readings are returned as the DS1820 bytes which give the
+ * same temperature.  ds1820_set_resolution() writes 9, 10, 11 or 12 bits
+ * (0.5 to 0.0625 degree C) to their configuration register and its copy in
+ * EEPROM, which they come back with after losing power; a conversion
+ * then takes 93.75, 187.5, 375 or 750 ms.  DS1820s always take 750 ms.  Call
+ * it after ds1820_search() and not while a reading runs.
+ */
+short ds1820_set_resolution(ubyte bits);
+
 /**
  * Generic 1 Wire primitive functions 
  */
 ubyte Reset_1W(void);              /* Reset bus and test for presence pulse */
 void  Write_1W(ubyte tx_byte);	  /* Write a byte to the bus */
 ubyte Read_1W(void);				     /* Read a byte from the bus */
+void  WriteBit_1W(ubyte tx_bit);	  /* Write a bit to the bus */
+ubyte ReadBit_1W(void);				  /* Read a bit from the bus */
 
 ubyte Do_1W_CRC(ubyte next_byte, ubyte CRC);   /* Calculate CRC */
+#ifndef DS1820_FIXED_POINT_ONLY
 float Do_1W_Temperature(ubyte MSB, ubyte LSB); /* Calculate temperature from DS1820 data with 0.5C resolution */
 float Do_1W_Temperature_Full(ubyte MSB, ubyte LSB, /* Calculate accurate temperature from DS1820 data */
 							 ubyte count_remain, ubyte count_per_C); 
+#endif
+
+/**
+ * The same conversions without floating point: in 1/16 degree C, which the
+ * full resolution formula gives exactly, or rounded to 1/100 degree C.
+ */
+short Do_1W_Temperature_16(ubyte MSB, ubyte LSB);
+short Do_1W_Temperature_Full_16(ubyte MSB, ubyte LSB, ubyte count_remain, ubyte count_per_C);
+short Do_1W_Temperature_Centi(ubyte MSB, ubyte LSB, ubyte count_remain, ubyte count_per_C);
 
 /*
  ****************************************************************************
@@ -42,12 +42,62 @@
 #define GET_TIMERS_RCA              0x20020L    //!< Get monitor and command timing countdown registers.
 #define GET_MON_TIMERS2_RCA         0x20021L    //!< DEPRECATED
 #define GET_PPORT_STATE             0x20023L    //!< Get the state of the parallel port lines and other state info
+#define GET_CAN_QUEUE_STATUS        0x20024L    //!< Get the depth, high-water mark and overflows of the CAN request queue
+#define GET_CAN_TX_STATUS           0x20025L    //!< Get the number of delayed and overwritten monitor replies
+#define GET_LATENCY_HIST            0x20026L    //!< 0x20026 through 0x2002D return the CAN latency histograms, two RCAs per class:
+                                                //!< monitor built-in, monitor forwarded (or cached), control built-in, control forwarded.
+#define GET_LATENCY_MISSES          0x2002EL    //!< Get the number of transactions over 150 uS for each latency class
+#define GET_LATENCY_MAX             0x2002FL    //!< Get the longest latency for each class, in 0.4 uS units
+#define GET_CAN_ERRORS              0x20030L    //!< 0x20030 through 0x20032 return the CAN error counters by cause, four per RCA:
+                                                //!< bus off, error warning, stuff, form / ack, bit1, bit0, CRC /
+                                                //!< lost in object 1, in object 15, in the request queue.
+#define SET_EPP_DEADLINES           0x20033L    //!< Monitor: get, control: set the EPP budgets in uS for the monitor request,
+                                                //!< the monitor reply and a control request.  Three 16 bit values, MSB first.
+#define SET_CACHE_POLICY            0x20034L    //!< Monitor: get the reply cache hits, misses, evictions and invalidations.
+                                                //!< Control: set the time to live in mS of the replies for a range of RCAs:
+                                                //!< first RCA (3 bytes), last RCA (3 bytes), TTL (2 bytes), MSB first.  TTL 0 stops caching.
+#define GET_CONTROL_QUEUE           0x20035L    //!< Get the control queue depth (1 byte), commands dropped with the queue full (2 bytes),
+                                                //!< commands which timed out (2 bytes) and the last RCA dropped or timed out (3 bytes).
+#define SET_HOT_LIST                0x20036L    //!< Control: 1 byte 0 clears the hot list, 2 bytes set its refresh period in mS,
+                                                //!< 3 bytes add an ARCOM monitor RCA, see GET_HOT_LIST_REFUSED.  Monitor: number of points (1 byte), period in mS (2 bytes),
+                                                //!< last refresh cycle time in 0.4 uS units (3 bytes) and age of the oldest point in mS (2 bytes).
+#define SET_LINK_BREAKER            0x20037L    //!< Control: 1 byte, EPP timeouts in a row which open the ARCOM link breaker, 0 never opens it.
+                                                //!< Monitor: breaker open (1 byte), timeouts in a row (1 byte), times opened (2 bytes),
+                                                //!< times closed (2 bytes) and requests refused while open (2 bytes).
+#define GET_LINK_RECOVERY           0x20038L    //!< Get the number of times the ARCOM link was set up again (2 bytes), failed attempts (2 bytes)
+                                                //!< and the time from losing the link to having it back in mS, last time (4 bytes).
+#define SET_EPP_BENCHMARK           0x20039L    //!< Control: run a number (2 bytes) of monitor requests for an ARCOM RCA (3 bytes, default
+                                                //!< GET_ARCOM_VERSION_INFO) in the background to measure the EPP link.  Number 0 stops it.
+                                                //!< Monitor: requests left (2 bytes), timeouts (2 bytes) and bytes per second (4 bytes).
+#define GET_BENCHMARK_TIMES         0x2003AL    //!< 0x2003A and 0x2003B return the times of the request and of the reply phases in the benchmark:
+                                                //!< minimum, mean and maximum in 0.4 uS units and number of requests (2 bytes each).
+#define GET_HOT_LIST_REFUSED        0x2003CL    //!< Get the number of RCAs refused by SET_HOT_LIST (2 bytes), why the last one was (1 byte,
+                                                //!< HOT_REFUSED_ values) and that RCA (3 bytes).
+#define EPP_PROTOCOL_RCA            0x2003EL    //!< Not on the CAN bus: sent only to the ARCOM to agree on the EPP transaction format.
+                                                //!< No ARCOM firmware before 1.3.0 saw it, as this firmware never forwards its reserved RCAs.
+                                                //!< Monitor: EPP_PROTOCOL_LEN bytes 'E', 'P', version, formats understood as EPP_PROTOCOL_ bits.
+                                                //!< Control: the same 4 bytes with the formats to use from the next transaction on.
 #define LAST_AMBSI1_RESERVED        0x2003FL    //!< Highest special RCA served by this firmware not forwarded to ARCOM.
 
+//! \b 0x30006 -> Board temperature converted
+/*! The reading of 0x30003 with the full resolution formula of the DS1820 data sheet already applied:
+    2 bytes in 1/100 degree C then 2 bytes in 1/16 degree C, both signed and MSB first. */
+#define GET_AMBIENT_TEMP_CONVERTED  0x30006L
+
+//! \b 0x30008 -> Temperatures of the 1-Wire sensors
+/*! 0x30008 through 0x3000B return the last reading of each DS1820 found on the 1-Wire line
+    in the same 4 bytes as the board temperature 0x30003.  0x30008 is always the board's DS1820,
+    as 0x30003, and the probes follow from 0x30009. */
+#define GET_SENSOR_TEMP             0x30008L
+
+/*! Resolution for DS18B20 sensors, 9 to 12 bits.  Each bit less halves their conversion time, from 750 ms
+    at 12 bits to 93.75 ms at 9, and so doubles the rate of the temperature readings when they are all DS18B20s. */
+#define DS18B20_RESOLUTION          12
+
 /* Version Info */
 #define VERSION_MAJOR 01	//!< Major Version
-#define VERSION_MINOR 02	//!< Minor Revision
-#define VERSION_PATCH 05	//!< Patch Level
+#define VERSION_MINOR 03	//!< Minor Revision
+#define VERSION_PATCH 00	//!< Patch Level
 
 /* Uses GPIO ports */
 #include <reg167.h>
@@ -59,20 +109,48 @@
 
 /* Set aside memory for the callbacks in the AMB library
    This is larger than the number of handlers because some handlers get registered for more than one range.
-   There should be a slot here for each call to amb_register_function() in this program.
+   There should be a slot here for each call to amb_register_function() in this program, plus one for each
+   extra piece a range is split into when it overlaps ranges registered before it (e.g. the ARCOM special
+   monitor range around the RCAs reserved for this firmware).
    This being too small caused a buffer overflow in 1.2.0 and before! */
-static CALLBACK_STRUCT idata cb_memory[8];
+#define NUM_CB_MEMORY 16
+static CALLBACK_STRUCT idata cb_memory[NUM_CB_MEMORY];
 
 /* CAN message callbacks */
 int ambient_msg(CAN_MSG_TYPE *message); 	//!< Called to get the board temperature temperature
+int ambient_converted_msg(CAN_MSG_TYPE *message); //!< Called to get the board temperature in degrees C
+int sensor_msg(CAN_MSG_TYPE *message); 	    //!< Called to get the temperature of one of the 1-Wire sensors
 int controlMsg(CAN_MSG_TYPE *message);  	//!< Called to handle CAN control messages
 int monitorMsg(CAN_MSG_TYPE *message);  	//!< Called to handle CAN monitor messages 
 int getSetupInfo(CAN_MSG_TYPE *message);  	//!< Called to get the AMBSI1 <-> ARCOM link/setup information 
 int getVersionInfo(CAN_MSG_TYPE *message);	//!< Called to get firmware version informations 
 int getReservedMsg(CAN_MSG_TYPE *message);  //!< Monitor timers and debugging info from this firmware
 
-/* implementation helper */
+/* implementation helpers */
 int implMonitorSingle(CAN_MSG_TYPE *message, unsigned char sendReply);
+int implControlSingle(CAN_MSG_TYPE *message);
+int implMonitorBlock(unsigned char first, unsigned char count);
+int forwardControls(void);
+void flushControls(unsigned long monitorRCA);
+int backgroundWork(void);
+int setupLink(void);
+int refreshHotPoint(void);
+int probeLink(void);
+void linkResult(unsigned char timeout);
+int relink(void);
+int benchmarkStep(void);
+int discoverLink(void);
+int queryRange(unsigned long rca, unsigned long *low, unsigned long *high);
+int selectProtocol(void);
+unsigned char queryProtocol(void);
+unsigned char getHotPoint(CAN_MSG_TYPE *message);
+unsigned char hotFresh(unsigned char i);
+void expireHotPoint(void);
+void configHotList(CAN_MSG_TYPE *message);
+unsigned char sendHeader(CAN_MSG_TYPE *message, unsigned char len, unsigned int idata *timer);
+unsigned char buildHeader(CAN_MSG_TYPE *message, unsigned char len, unsigned char *header);
+unsigned char eppAsyncBusy(void);
+void eppAsyncWait(void);
 
 /* A global for the last read temperature */
 static ubyte idata ambient_temp_data[4];
@@ -89,30 +167,159 @@ sbit  EPPS_INTERRUPT    = P2^7;   // output
 sbit  EPPS_NWAIT        = P2^8;   // output
 sbit  SPPS_SELECTIN     = P2^10;  // output
 
-/* Separate timers for each phase of monitor and control transaction */
+/* Separate timers for each phase of monitor and control transaction:
+   time left to the deadline at the last handshake, in T3 counts */
 static unsigned int idata monTimer1, monTimer2, cmdTimer;
 
-/* Macros to implement EPP handshake */
+/* EPP deadlines.
+   Each forwarded transaction gets an absolute deadline from timer T3, which the AMB library runs free
+   at 0.4 uS per count.  A monitor request has until start + REQUEST budget to send its header and until
+   start + REQUEST + REPLY budget to receive the reply.  The defaults are as lenient as the old spin count
+   of about 1 mS per byte; SET_EPP_DEADLINES tightens them at run time, down to the 150 uS ICD limit for
+   an ARCOM known to keep up. */
+#define EPP_US_TO_TICKS(US)     ((unsigned int) (((unsigned long) (US) * 5) / 2))
+#define EPP_TICKS_TO_US(TICKS)  ((unsigned int) (((unsigned long) (TICKS) * 2) / 5))
+#define EPP_PHASE_REQUEST       0       //!< monitor request: sending the header
+#define EPP_PHASE_REPLY         1       //!< monitor request: receiving the reply
+#define EPP_PHASE_CONTROL       2       //!< control request: sending header and payload
+#define EPP_NUM_PHASES          3
+#define EPP_MAX_BUDGET_US       6000    //!< request + reply stay below 2^15 counts, the reach of the signed test in EPP_HANDSHAKE
+
+//! Budget for each phase in T3 counts, defaults 1, 2 and 3 mS
+static unsigned int idata eppBudget[EPP_NUM_PHASES];
+
+//! Deadline of the current phase in T3 counts
+static unsigned int idata eppDeadline;
 
-//! Timeout waiting for EPP ready when sending or receiving bytes
-#define EPP_MAX_TIMEOUT 1000
-// about 1 millisecond based on 0xFFFF = 70 ms
-// This is intentionally much longer than it should ever take because recovery from timeouts is messy.
+/* Macros to implement EPP handshake */
 
-//! Wait for Data Strobe to go low and detect timeout
+//! Wait for Data Strobe to go low or the deadline to pass, and detect timeout
 #define EPP_HANDSHAKE(TIMER, TIMEOUT) { \
-    for(TIMER = EPP_MAX_TIMEOUT; TIMER && EPPC_NDATASTROBE; TIMER--) {} \
-    TIMEOUT = !TIMER; }
+    do { TIMER = eppDeadline - T3; } while (EPPC_NDATASTROBE && (int) TIMER > 0); \
+    TIMEOUT = EPPC_NDATASTROBE && (int) TIMER <= 0; \
+    if ((int) TIMER < 0) TIMER = 0; }
 
 /* Macro to toggle WAIT high then low */
 #define TOGGLE_NWAIT { EPPS_NWAIT = 1; EPPS_NWAIT = 0; }
 
+/* EPP transaction formats for forwarded CAN requests */
+#define EPP_PROTOCOL_LEGACY     0x00    //!< 4 bytes of RCA, LSB first, then the payload size
+#define EPP_PROTOCOL_COMPACT    0x01    //!< a descriptor byte then 1 or 2 bytes of RCA
+#define EPP_PROTOCOL_BLOCK      0x02    //!< monitor requests for a list of RCAs in one transaction, needs COMPACT
+#define EPP_PROTOCOL_UNKNOWN    0xFF    //!< no valid reply at EPP_PROTOCOL_RCA
+
+/* Compact header descriptor: bits 7-6 format, bits 5-4 RCA bits 17-16, bits 3-0 payload size */
+#define EPP_COMPACT_FULL        0x00    //!< followed by RCA bits 15-8 and 7-0
+#define EPP_COMPACT_PAGE        0x40    //!< followed by RCA bits 7-0. RCA bits 17-8 same as the previous header.
+                                        //!< Both sides forget the page when a transaction doesn't complete.
+#define EPP_COMPACT_BLOCK       0x80    //!< bits 3-0 number of RCAs, each sent as bits 17-16, 15-8, 7-0.
+                                        //!< The ARCOM replies with payload size and payload for each, in order.
+                                        //!< Leaves the page unchanged.
+#define EPP_BLOCK_MAX           8       //!< Most RCAs in a block request
+
+/* Replies and controls at EPP_PROTOCOL_RCA: magic, version and formats.
+   The ARCOM board uses the selected formats from the next transaction on, which must be a monitor
+   request at EPP_PROTOCOL_RCA in the new format to confirm them.  Otherwise it goes back to the old one. */
+#define EPP_PROTOCOL_LEN        4
+#define EPP_PROTOCOL_MAGIC0     0x45    //!< 'E'
+#define EPP_PROTOCOL_MAGIC1     0x50    //!< 'P'
+#define EPP_PROTOCOL_VERSION    1
+
+#define EPP_HEADER_MAX          5       //!< Longest header, legacy format
+
+/* Formats in use and RCA bits 17-8 of the last compact header sent */
+static unsigned char idata eppProtocol;
+static unsigned int idata eppPage;
+static bit idata eppPageValid;
+
+/* Control transaction in flight.
+   Queued controls are sent by the Data Strobe capture interrupt on CC3 (P2.3), one byte per strobe,
+   so the CPU is free while the ARCOM is slow.  The interrupt runs above the bottom half and below the
+   CAN interrupt.  Transactions which must wait for the ARCOM anyway (monitor requests, link setup)
+   keep the polled handshake, after the control in flight is through, and sleep until then.
+   T4 runs as a one-shot from the start of the control and ends it at its deadline if the ARCOM stops
+   strobing; its interrupt is on the level of the strobe, so neither preempts the other.  The bottom half
+   counts the failure. */
+#define EPP_STROBE_IC   0x0020  // CC3IC: ILVL=8, GLVL=0, enabled while a control is in flight
+#define EPP_TIMEOUT_IC  0x0021  // T4IC: ILVL=8, GLVL=1, enabled while a control is in flight
+#define EPP_T4CON       0x0000  // T4CON: timer mode, count up, fCPU/8 as T3, stopped
+static unsigned char idata eppTxBuf[EPP_HEADER_MAX + MAX_CAN_MSG_PAYLOAD];
+static unsigned char idata eppTxLen, eppTxNext;
+static unsigned int idata eppTxDeadline;
+static unsigned long idata eppTxRCA;
+static bit idata eppTxBusy;
+static bit idata eppTxFailed;   // T4 ended the last control, not counted yet
+
 /* RCAs address ranges */
 static unsigned long idata lowestMonitorRCA,highestMonitorRCA,
 						   lowestControlRCA,highestControlRCA,
                            lowestSpecialMonitorRCA,highestSpecialMonitorRCA,
 						   lowestSpecialControlRCA,highestSpecialControlRCA;
 
+/* Queue of control messages waiting to be forwarded to the ARCOM.
+   They are forwarded in order by forwardControls(), which the AMB library calls when no CAN request is waiting.
+   So monitor requests go first, unless one reads back a point with a control still queued. */
+#define CONTROL_QUEUE_SIZE 8
+static CAN_MSG_TYPE controlQueue[CONTROL_QUEUE_SIZE];
+static unsigned char idata controlHead, controlTail, controlDepth;
+static unsigned int idata controlsDropped, controlsFailed;
+static unsigned long idata lastFailedControlRCA;
+
+/* Hot list: monitor points refreshed from the ARCOM in the background and answered from here.
+   A full refresh cycle starts every hotPeriod mS, one point per call of refreshHotPoint().
+   A point is only answered locally while its last refresh is less than two periods old, the age taken
+   unsigned.  That holds until amb_get_time() wraps after 28 minutes: expireHotPoint() drops a stale point,
+   one per call of backgroundWork(), so none is kept that long while the refresh is stopped. */
+#define HOT_LIST_SIZE 16
+#define TICKS_PER_MS 2500UL     // amb_get_time() counts
+static struct {
+    unsigned long rca;          // Relative address
+    unsigned long updated;      // amb_get_time() of the last refresh
+    unsigned char valid;        // Holds a reply
+    unsigned char len;          // Reply length
+    unsigned char data[8];      // Reply data
+} hotList[HOT_LIST_SIZE];
+static unsigned char idata numHot, hotNext, hotSweep;
+static unsigned int idata hotPeriod;
+static unsigned long idata hotCycleStart, hotCycleTime;
+
+/* Why configHotList() refused an RCA */
+#define HOT_REFUSED_FULL    1       // the list is full
+#define HOT_REFUSED_RANGE   2       // not in the monitor RCAs of the ARCOM
+#define HOT_REFUSED_LISTED  3       // already on the list
+static unsigned int hotRefused;
+static unsigned char hotRefusedWhy;
+static unsigned long hotRefusedRCA;
+
+/* Circuit breaker for the ARCOM link.
+   After breakerThreshold EPP transactions in a row time out the breaker opens: monitor requests for the
+   ARCOM get no reply and controls are refused at once, instead of each waiting out its deadline.
+   While it is open backgroundWork() probes the link every BREAKER_PROBE_MS.  Any transaction which
+   goes through closes it. */
+#define BREAKER_THRESHOLD   4       // default, two monitor requests with their retries
+#define BREAKER_PROBE_MS    500UL
+static unsigned char idata breakerThreshold, breakerMisses;
+static bit idata breakerOpen;
+static unsigned int idata breakerOpened, breakerClosed, breakerRefused;
+static unsigned long idata breakerProbeTime;
+
+/* Link recovery after an ARCOM restart.
+   The ARCOM board holds INIT high while it restarts.  The link is also taken as lost when the breaker opens.
+   Once INIT is low again, or the breaker closes, the bottom half gets the RCA ranges again and swaps
+   the callbacks, which it also dispatches to, so no request sees the registrations halfway. */
+static bit idata linkDown, relinkPending;
+static unsigned char idata linkRegs;       // ARCOM ranges registered by discoverLink()
+static unsigned int idata relinks, relinkFailures;
+static unsigned long idata linkLostTime, recoveryTime;
+
+/* EPP link benchmark: benchCount monitor requests for benchRCA, one per call of benchmarkStep().
+   Times per phase are kept for the requests which went through, from the timers of implMonitorSingle().
+   benchTicks is the time the link was busy with them. */
+static unsigned int idata benchCount, benchDone, benchTimeouts;
+static unsigned long idata benchRCA, benchBytes, benchTicks;
+static unsigned int idata benchMin[EPP_PHASE_REPLY + 1], benchMax[EPP_PHASE_REPLY + 1];
+static unsigned long idata benchSum[EPP_PHASE_REPLY + 1];
+
 /* A global to fake CAN messages */
 static CAN_MSG_TYPE idata myCANMessage;
 
@@ -120,11 +327,14 @@ static CAN_MSG_TYPE idata myCANMessage;
 static bit idata ready;			// is the communication between the ARCOM and AMBSI ready?
 static bit idata initialized;	// have the RCAs been initialized?
 
+/* The first link setup is tried by the bottom half every SETUP_RETRY_MS until the ARCOM board answers */
+#define SETUP_RETRY_MS      100UL
+static unsigned long idata setupTime;
+
 //! MAIN
 /*! Takes care of initializing the AMBSI1, the AMB CAN library and globally enables interrupts.
     Since version 1.2.0: also performs AMBSI1 to ARCOM link setup. */
 void main(void) {
-    unsigned long timer;
 
 	#ifdef USE_48MS
 	  // Setup the CAPCOM2 unit to receive the 48ms pulse from the Xilinx
@@ -139,17 +349,54 @@ void main(void) {
 	DP4 |= 0x01;
 	DISABLE_EX_BUF = 1;
 
+	/* Default EPP budgets: lenient, until SET_EPP_DEADLINES tightens them */
+	eppBudget[EPP_PHASE_REQUEST] = EPP_US_TO_TICKS(1000);
+	eppBudget[EPP_PHASE_REPLY] = EPP_US_TO_TICKS(2000);
+	eppBudget[EPP_PHASE_CONTROL] = EPP_US_TO_TICKS(3000);
+
 	/* Initialise the slave library */
-	if (amb_init_slave((void *) cb_memory) != 0) 
+	if (amb_init_slave_n((void *) cb_memory, NUM_CB_MEMORY) != 0) 
 		return;
 
+    /* Forward queued control messages and refresh the hot list when the library has nothing else to do */
+    controlHead = controlTail = controlDepth = 0;
+    controlsDropped = controlsFailed = 0;
+    lastFailedControlRCA = 0;
+    numHot = hotNext = hotSweep = 0;
+    hotPeriod = 1000;
+    hotCycleStart = hotCycleTime = 0;
+    hotRefused = hotRefusedWhy = 0;
+    hotRefusedRCA = 0;
+    breakerThreshold = BREAKER_THRESHOLD;
+    breakerMisses = 0;
+    breakerOpen = 0;
+    breakerOpened = breakerClosed = breakerRefused = 0;
+    linkDown = relinkPending = 0;
+    linkRegs = 0;
+    relinks = relinkFailures = 0;
+    recoveryTime = 0;
+    benchCount = benchDone = benchTimeouts = 0;
+    amb_register_idle_function(backgroundWork);
+
     /* Register callback for ambient temperature */
 	if (amb_register_function(0x30003, 0x30003, ambient_msg) != 0)
 		return;
+	if (amb_register_function(GET_AMBIENT_TEMP_CONVERTED, GET_AMBIENT_TEMP_CONVERTED, ambient_converted_msg) != 0)
+		return;
 
-    /* Register callback for firmware version */
+    /* Find the temperature sensors on the 1-Wire line and register the callback for them */
+    ds1820_search();
+    ds1820_set_resolution(DS18B20_RESOLUTION);
+	if (amb_register_function(GET_SENSOR_TEMP, GET_SENSOR_TEMP + DS1820_MAX_SENSORS - 1, sensor_msg) != 0)
+		return;
+
+    /* Register callback for firmware version.
+       The version never changes, so the CAN controller answers it from a preloaded object.
+       The callback stays registered to keep the RCA out of the ARCOM range. */
 	if (amb_register_function(GET_AMBSI1_VERSION_INFO, GET_AMBSI1_VERSION_INFO, getVersionInfo) != 0)
 		return;
+    getVersionInfo(&myCANMessage);
+    amb_register_static_monitor(GET_AMBSI1_VERSION_INFO, myCANMessage.len, myCANMessage.data);
 
 	/* Initialize ports for communication */
 	DP7=0x00;
@@ -158,6 +405,13 @@ void main(void) {
 	SPPS_SELECTIN=1;
 	DP2=0x0580; 
 
+    /* Capture Data Strobe falling edges on CC3 for the control transactions, and time them out on T4 */
+    eppTxBusy = eppTxFailed = 0;
+    CCM0 = (CCM0 & 0x0FFF) | 0x2000;    // CCMOD3: capture on negative edge
+    CC3IC = EPP_STROBE_IC;
+    T4CON = EPP_T4CON;
+    T4IC = EPP_TIMEOUT_IC;
+
     /* Register callback for the special setup message */
 	if (amb_register_function(GET_SETUP_INFO, GET_SETUP_INFO, getSetupInfo) != 0)
 		return;
@@ -175,25 +429,18 @@ void main(void) {
 	while(SPPC_INIT){ // Wait of init line to go to 0. In the mean time read the temperature
 		ds1820_get_temp(&ambient_temp_data[1], &ambient_temp_data[0], &ambient_temp_data[2], &ambient_temp_data[3]);
 	}
-    ready=1;
-
-    /* Loop until the AMBSI1 to ARCOM link is established */
-    while(!initialized) {
-        /* Process a fake GET_SETUP_INFO request */
-        myCANMessage.dirn=CAN_MONITOR;
-        myCANMessage.len=0;
-        myCANMessage.relative_address=GET_SETUP_INFO;
-        if(getSetupInfo(&myCANMessage)) {
-            // if timed out, sleep a bit:
-            for(timer = 100000L; timer; timer--) {}   // about 0.1 second
-        }
-    }
 
-    SPPS_SELECTIN = 0; // Select line to 0
+    /* The bottom half sets up the AMBSI1 to ARCOM link, at once and then every SETUP_RETRY_MS until it is
+       established.  Done from here its transactions could be cut in half by those of the bottom half. */
+    setupTime = amb_get_time() - TICKS_PER_MS * SETUP_RETRY_MS;
+    ready=1;
+    amb_wake_idle();
 
-	/* Never return */
+	/* Never return.  The temperature is read in the background: start the next reading when one is done */
+	ds1820_start_temp();
 	while (1) {
-		ds1820_get_temp(&ambient_temp_data[1], &ambient_temp_data[0], &ambient_temp_data[2], &ambient_temp_data[3]);
+		if (ds1820_poll_temp(&ambient_temp_data[1], &ambient_temp_data[0], &ambient_temp_data[2], &ambient_temp_data[3]) != DS1820_BUSY)
+			ds1820_start_temp();
 	}
 }
 
@@ -245,113 +492,20 @@ int getSetupInfo(CAN_MSG_TYPE *message){
 		return -1;
 	}
 
-	/* SPECIAL MONITOR RCAs */
-	/* Get the information on the available special monitor RCAs from the ARCOM board */
-	/* Set up custom can message to perform monitor request */
-	myCANMessage.dirn=CAN_MONITOR; // Direction: monitor
-	myCANMessage.len=0;	// Size: 0
-	myCANMessage.relative_address=GET_SPECIAL_MONITOR_RCAS; // 0x20003 -> RCA: special address to retrieve the special monitor RCAs informations
-	if(implMonitorSingle(&myCANMessage, FALSE)){ // Send the monitor request.
-		message->data[0]=0x07; // Error 0x07: Timeout while forwarding the message to the ARCOM board
-		return -1;
-	}
-	/* Rebuild highestMonitorRCA */
-	highestSpecialMonitorRCA += ((unsigned long)myCANMessage.data[7])<<24;
-	highestSpecialMonitorRCA += ((unsigned long)myCANMessage.data[6])<<16;
-	highestSpecialMonitorRCA += ((unsigned long)myCANMessage.data[5])<<8;
-	highestSpecialMonitorRCA += ((unsigned long)myCANMessage.data[4]);
-	/* Rebuild lowestMonitorRCA */
-	lowestSpecialMonitorRCA += ((unsigned long)myCANMessage.data[3])<<24;
-	lowestSpecialMonitorRCA += ((unsigned long)myCANMessage.data[2])<<16;
-	lowestSpecialMonitorRCA += ((unsigned long)myCANMessage.data[1])<<8;
-	lowestSpecialMonitorRCA += ((unsigned long)myCANMessage.data[0]);
-    /* Register callback for special monitor messages */
-	amb_register_function(lowestSpecialMonitorRCA, highestSpecialMonitorRCA, monitorMsg);
-
-
-	/* SPECIAL CONTROL RCAs */
-	/* Get the information on the available special control RCAs from the ARCOM board */
-	/* Set up custom can message to perform monitor request */
-	myCANMessage.dirn=CAN_MONITOR; // Direction: monitor
-	myCANMessage.len=0;	// Size: 0
-	myCANMessage.relative_address=GET_SPECIAL_CONTROL_RCAS; // 0x20004 -> RCA: special address to retrieve the special control RCAs informations
-    if(implMonitorSingle(&myCANMessage, FALSE)){ // Send the monitor request.
-		message->data[0]=0x07; // Error 0x07: Timeout while forwarding the message to the ARCOM board
-		/* Unregister previously succesfully registered functions */
-		amb_unregister_last_function(); // SPECIAL MONITOR RCAs
-		return -1;
-	}
-	/* Rebuild highestMonitorRCA */
-	highestSpecialControlRCA += ((unsigned long)myCANMessage.data[7])<<24;
-	highestSpecialControlRCA += ((unsigned long)myCANMessage.data[6])<<16;
-	highestSpecialControlRCA += ((unsigned long)myCANMessage.data[5])<<8;
-	highestSpecialControlRCA += ((unsigned long)myCANMessage.data[4]);
-	/* Rebuild lowestMonitorRCA */
-	lowestSpecialControlRCA += ((unsigned long)myCANMessage.data[3])<<24;
-	lowestSpecialControlRCA += ((unsigned long)myCANMessage.data[2])<<16;
-	lowestSpecialControlRCA += ((unsigned long)myCANMessage.data[1])<<8;
-	lowestSpecialControlRCA += ((unsigned long)myCANMessage.data[0]);
-    /* Register callback for special control messages */
-	amb_register_function(lowestSpecialControlRCA, highestSpecialControlRCA, controlMsg);
-
-
-	/* MONITOR RCAs */
-	/* Get the information on the available monitor RCAs from the ARCOM board */
-	/* Set up custom can message to perform monitor request */
-	myCANMessage.dirn=CAN_MONITOR; // Direction: monitor
-	myCANMessage.len=0;	// Size: 0
-	myCANMessage.relative_address=GET_MONITOR_RCAS; // 0x20005 -> RCA: special address to retrieve the monitor RCAs informations
-    if(implMonitorSingle(&myCANMessage, FALSE)){ // Send the monitor request.
-		message->data[0]=0x07; // Error 0x07: Timeout while forwarding the message to the ARCOM board
-		/* Unregister previously succesfully registered functions */
-		amb_unregister_last_function(); // SPECIAL CONTROL RCAs
-		amb_unregister_last_function(); // SPECIAL MONITOR RCAs
-		return -1;
-	}
-	/* Rebuild highestMonitorRCA */
-	highestMonitorRCA += ((unsigned long)myCANMessage.data[7])<<24;
-	highestMonitorRCA += ((unsigned long)myCANMessage.data[6])<<16;
-	highestMonitorRCA += ((unsigned long)myCANMessage.data[5])<<8;
-	highestMonitorRCA += ((unsigned long)myCANMessage.data[4]);
-	/* Rebuild lowestMonitorRCA */
-	lowestMonitorRCA += ((unsigned long)myCANMessage.data[3])<<24;
-	lowestMonitorRCA += ((unsigned long)myCANMessage.data[2])<<16;
-	lowestMonitorRCA += ((unsigned long)myCANMessage.data[1])<<8;
-	lowestMonitorRCA += ((unsigned long)myCANMessage.data[0]);
-	/* Register callback for standard monitor messages */
-	amb_register_function(lowestMonitorRCA, highestMonitorRCA, monitorMsg);
-
-
-	/* CONTROL RCAs */
-	/* Get the information on the available special monitor RCAs from the ARCOM board */
-	/* Set up custom can message to perform monitor request */
-	myCANMessage.dirn=CAN_MONITOR; // Direction: monitor
-	myCANMessage.len=0;	// Size: 0
-	myCANMessage.relative_address=GET_CONTROL_RCAS; // 0x20006 -> RCA: special address to retrieve the special control RCAs informations
-    if(implMonitorSingle(&myCANMessage, FALSE)){ // Send the monitor request.
+	/* Until the ARCOM board says otherwise, use the legacy EPP header */
+	eppProtocol = EPP_PROTOCOL_LEGACY;
+	eppPageValid = 0;
+
+	/* Get the RCA ranges from the ARCOM board and register the callbacks */
+	if(discoverLink()){
 		message->data[0]=0x07; // Error 0x07: Timeout while forwarding the message to the ARCOM board
-		/* Unregister previously succesfully registered functions */
-		amb_unregister_last_function(); // MONITOR RCAs
-		amb_unregister_last_function(); // SPECIAL CONTROL RCAs
-		amb_unregister_last_function(); // SPECIAL MONITOR RCAs
 		return -1;
 	}
-	/* Rebuild highestMonitorRCA */
-	highestControlRCA += ((unsigned long)myCANMessage.data[7])<<24;
-	highestControlRCA += ((unsigned long)myCANMessage.data[6])<<16;
-	highestControlRCA += ((unsigned long)myCANMessage.data[5])<<8;
-	highestControlRCA += ((unsigned long)myCANMessage.data[4]);
-	/* Rebuild lowestMonitorRCA */
-	lowestControlRCA += ((unsigned long)myCANMessage.data[3])<<24;
-	lowestControlRCA += ((unsigned long)myCANMessage.data[2])<<16;
-	lowestControlRCA += ((unsigned long)myCANMessage.data[1])<<8;
-	lowestControlRCA += ((unsigned long)myCANMessage.data[0]);
-	/* Register callback for standard control messages */
-	amb_register_function(lowestControlRCA, highestControlRCA, controlMsg);
-
 
 	/* No error */
 	initialized=1; // Remember that the RCA have already been initialized
+	linkDown=0;
+	SPPS_SELECTIN = 0; // Select line to 0
 	message->data[0]=0;
 
     return 0;
@@ -361,6 +515,62 @@ int getSetupInfo(CAN_MSG_TYPE *message){
 //! handle all the special monitor messages reserved for the AMBSI1 firmware.
 //! These are to aid debugging
 int getReservedMsg(CAN_MSG_TYPE *message) {
+    unsigned char depth, highWater;
+    unsigned int overflows, delayed, clobbered;
+    unsigned int hist[AMB_LATENCY_BUCKETS], misses, maxLatency;
+    unsigned int errors[AMB_NUM_ERR_CAUSES], cacheStats[4];
+    unsigned char i, offset;
+    unsigned int budget, count;
+    unsigned long low, high, age;
+    unsigned int oldest;
+    unsigned long bytes, ticks, rate;
+    unsigned int fastest, mean;
+
+    if (message -> dirn == CAN_CONTROL) {
+        switch(message -> relative_address) {
+            case SET_EPP_DEADLINES:
+                // Set the EPP budgets.  Zero or too long values are ignored.
+                for (i = 0; i < EPP_NUM_PHASES && 2 * i + 1 < message -> len; i++) {
+                    budget = ((unsigned int) message -> data[2 * i] << 8) + message -> data[2 * i + 1];
+                    if (budget && budget <= EPP_MAX_BUDGET_US)
+                        eppBudget[i] = EPP_US_TO_TICKS(budget);
+                }
+                break;
+            case SET_HOT_LIST:
+                configHotList(message);
+                break;
+            case SET_EPP_BENCHMARK:
+                // Start or stop the benchmark, clearing the results.
+                if (message -> len == 2 || message -> len == 5) {
+                    benchRCA = GET_ARCOM_VERSION_INFO;
+                    if (message -> len == 5)
+                        benchRCA = ((unsigned long) message -> data[2] << 16) + ((unsigned int) message -> data[3] << 8) + message -> data[4];
+                    benchDone = benchTimeouts = 0;
+                    benchBytes = benchTicks = 0;
+                    for (i = 0; i <= EPP_PHASE_REPLY; i++) {
+                        benchMin[i] = 0xFFFF;
+                        benchMax[i] = 0;
+                        benchSum[i] = 0;
+                    }
+                    benchCount = ((unsigned int) message -> data[0] << 8) + message -> data[1];
+                }
+                break;
+            case SET_LINK_BREAKER:
+                if (message -> len == 1)
+                    breakerThreshold = message -> data[0];
+                break;
+            case SET_CACHE_POLICY:
+                // Set the time to live of cached replies for a range of RCAs.
+                if (message -> len == 8) {
+                    low = ((unsigned long) message -> data[0] << 16) + ((unsigned int) message -> data[1] << 8) + message -> data[2];
+                    high = ((unsigned long) message -> data[3] << 16) + ((unsigned int) message -> data[4] << 8) + message -> data[5];
+                    amb_cache_policy(low, high, ((unsigned int) message -> data[6] << 8) + message -> data[7]);
+                }
+                break;
+        }
+        return 0;
+    }
+
     switch(message -> relative_address) {
         case GET_TIMERS_RCA:
             /*! return the timers for phases 1 through 4 of the last monitor request handled. */
@@ -370,8 +580,8 @@ int getReservedMsg(CAN_MSG_TYPE *message) {
             message -> data[3] = (unsigned char) (monTimer2);
             message -> data[4] = (unsigned char) (cmdTimer >> 8);
             message -> data[5] = (unsigned char) (cmdTimer);
-            message -> data[6] = (unsigned char) (EPP_MAX_TIMEOUT >> 8);
-            message -> data[7] = (unsigned char) (EPP_MAX_TIMEOUT);
+            message -> data[6] = (unsigned char) ((eppBudget[EPP_PHASE_REQUEST] + eppBudget[EPP_PHASE_REPLY]) >> 8);
+            message -> data[7] = (unsigned char) (eppBudget[EPP_PHASE_REQUEST] + eppBudget[EPP_PHASE_REPLY]);
             message -> len = 8;
             break;
         case GET_PPORT_STATE:
@@ -386,7 +596,178 @@ int getReservedMsg(CAN_MSG_TYPE *message) {
             message -> data[7] = (unsigned char) initialized;
             message -> len = 8;
             break;
+        case GET_CAN_QUEUE_STATUS:
+            // Return the state of the queue between the CAN interrupt and its bottom half.
+            amb_get_queue_status(&depth, &highWater, &overflows);
+            message -> data[0] = depth;
+            message -> data[1] = highWater;
+            message -> data[2] = (unsigned char) (overflows >> 8);
+            message -> data[3] = (unsigned char) (overflows);
+            message -> len = 4;
+            break;
+        case GET_CAN_TX_STATUS:
+            // Return how often monitor replies found both CAN transmit objects still pending.
+            amb_get_tx_status(&delayed, &clobbered);
+            message -> data[0] = (unsigned char) (delayed >> 8);
+            message -> data[1] = (unsigned char) (delayed);
+            message -> data[2] = (unsigned char) (clobbered >> 8);
+            message -> data[3] = (unsigned char) (clobbered);
+            message -> len = 4;
+            break;
+        case SET_EPP_DEADLINES:
+            // Return the EPP budgets in uS.
+            for (i = 0; i < EPP_NUM_PHASES; i++) {
+                budget = EPP_TICKS_TO_US(eppBudget[i]);
+                message -> data[2 * i] = (unsigned char) (budget >> 8);
+                message -> data[2 * i + 1] = (unsigned char) (budget);
+            }
+            message -> len = 2 * EPP_NUM_PHASES;
+            break;
+        case SET_HOT_LIST:
+            // Return the size, period and refresh cycle time of the hot list, and the age of its oldest point.
+            oldest = 0;
+            for (i = 0; i < numHot; i++) {
+                age = hotList[i].valid ? (amb_get_time() - hotList[i].updated) / TICKS_PER_MS : 0xFFFF;
+                if (age > oldest)
+                    oldest = (age > 0xFFFF) ? 0xFFFF : (unsigned int) age;
+            }
+            message -> data[0] = numHot;
+            message -> data[1] = (unsigned char) (hotPeriod >> 8);
+            message -> data[2] = (unsigned char) (hotPeriod);
+            message -> data[3] = (unsigned char) (hotCycleTime >> 16);
+            message -> data[4] = (unsigned char) (hotCycleTime >> 8);
+            message -> data[5] = (unsigned char) (hotCycleTime);
+            message -> data[6] = (unsigned char) (oldest >> 8);
+            message -> data[7] = (unsigned char) (oldest);
+            message -> len = 8;
+            break;
+        case GET_CONTROL_QUEUE:
+            // Return the state of the queue of control messages to the ARCOM.
+            message -> data[0] = controlDepth;
+            message -> data[1] = (unsigned char) (controlsDropped >> 8);
+            message -> data[2] = (unsigned char) (controlsDropped);
+            message -> data[3] = (unsigned char) (controlsFailed >> 8);
+            message -> data[4] = (unsigned char) (controlsFailed);
+            message -> data[5] = (unsigned char) (lastFailedControlRCA >> 16);
+            message -> data[6] = (unsigned char) (lastFailedControlRCA >> 8);
+            message -> data[7] = (unsigned char) (lastFailedControlRCA);
+            message -> len = 8;
+            break;
+        case GET_HOT_LIST_REFUSED:
+            // Return the RCAs refused for the hot list and the last one.
+            message -> data[0] = (unsigned char) (hotRefused >> 8);
+            message -> data[1] = (unsigned char) (hotRefused);
+            message -> data[2] = hotRefusedWhy;
+            message -> data[3] = (unsigned char) (hotRefusedRCA >> 16);
+            message -> data[4] = (unsigned char) (hotRefusedRCA >> 8);
+            message -> data[5] = (unsigned char) (hotRefusedRCA);
+            message -> len = 6;
+            break;
+        case SET_LINK_BREAKER:
+            // Return the state and counters of the ARCOM link breaker.
+            message -> data[0] = (unsigned char) breakerOpen;
+            message -> data[1] = breakerMisses;
+            message -> data[2] = (unsigned char) (breakerOpened >> 8);
+            message -> data[3] = (unsigned char) (breakerOpened);
+            message -> data[4] = (unsigned char) (breakerClosed >> 8);
+            message -> data[5] = (unsigned char) (breakerClosed);
+            message -> data[6] = (unsigned char) (breakerRefused >> 8);
+            message -> data[7] = (unsigned char) (breakerRefused);
+            message -> len = 8;
+            break;
+        case SET_EPP_BENCHMARK:
+            // Return the benchmark progress and throughput: bytes * 2500000 / ticks, halving both to stay in 32 bits.
+            bytes = benchBytes;
+            ticks = benchTicks;
+            while (bytes > 1700) {
+                bytes >>= 1;
+                ticks >>= 1;
+            }
+            rate = ticks ? bytes * 2500000UL / ticks : 0;
+            message -> data[0] = (unsigned char) (benchCount >> 8);
+            message -> data[1] = (unsigned char) (benchCount);
+            message -> data[2] = (unsigned char) (benchTimeouts >> 8);
+            message -> data[3] = (unsigned char) (benchTimeouts);
+            message -> data[4] = (unsigned char) (rate >> 24);
+            message -> data[5] = (unsigned char) (rate >> 16);
+            message -> data[6] = (unsigned char) (rate >> 8);
+            message -> data[7] = (unsigned char) (rate);
+            message -> len = 8;
+            break;
+        case GET_BENCHMARK_TIMES:
+        case GET_BENCHMARK_TIMES + 1:
+            // Return the minimum, mean and maximum time of one phase in the benchmark.
+            i = (unsigned char) (message -> relative_address - GET_BENCHMARK_TIMES);
+            mean = benchDone ? (unsigned int) (benchSum[i] / benchDone) : 0;
+            fastest = benchDone ? benchMin[i] : 0;
+            message -> data[0] = (unsigned char) (fastest >> 8);
+            message -> data[1] = (unsigned char) (fastest);
+            message -> data[2] = (unsigned char) (mean >> 8);
+            message -> data[3] = (unsigned char) (mean);
+            message -> data[4] = (unsigned char) (benchMax[i] >> 8);
+            message -> data[5] = (unsigned char) (benchMax[i]);
+            message -> data[6] = (unsigned char) (benchDone >> 8);
+            message -> data[7] = (unsigned char) (benchDone);
+            message -> len = 8;
+            break;
+        case GET_LINK_RECOVERY:
+            // Return how often the ARCOM link was set up again and how long the last recovery took.
+            message -> data[0] = (unsigned char) (relinks >> 8);
+            message -> data[1] = (unsigned char) (relinks);
+            message -> data[2] = (unsigned char) (relinkFailures >> 8);
+            message -> data[3] = (unsigned char) (relinkFailures);
+            message -> data[4] = (unsigned char) (recoveryTime >> 24);
+            message -> data[5] = (unsigned char) (recoveryTime >> 16);
+            message -> data[6] = (unsigned char) (recoveryTime >> 8);
+            message -> data[7] = (unsigned char) (recoveryTime);
+            message -> len = 8;
+            break;
+        case SET_CACHE_POLICY:
+            // Return the reply cache counters.
+            amb_get_cache_stats(&cacheStats[0], &cacheStats[1], &cacheStats[2], &cacheStats[3]);
+            for (i = 0; i < 4; i++) {
+                message -> data[2 * i] = (unsigned char) (cacheStats[i] >> 8);
+                message -> data[2 * i + 1] = (unsigned char) (cacheStats[i]);
+            }
+            message -> len = 8;
+            break;
+        case GET_LATENCY_MISSES:
+        case GET_LATENCY_MAX:
+            // Return the deadline misses or the maximum latency for the four classes.
+            for (i = 0; i < AMB_LATENCY_CLASSES; i++) {
+                amb_get_latency(i, hist, &misses, &maxLatency);
+                if (message -> relative_address == GET_LATENCY_MAX)
+                    misses = maxLatency;
+                message -> data[2 * i] = (unsigned char) (misses >> 8);
+                message -> data[2 * i + 1] = (unsigned char) (misses);
+            }
+            message -> len = 8;
+            break;
         default:
+            if (message -> relative_address >= GET_LATENCY_HIST && message -> relative_address < GET_LATENCY_MISSES) {
+                // Return buckets 0-3 or 4-7 of the latency histogram of one class.
+                offset = (unsigned char) (message -> relative_address - GET_LATENCY_HIST);
+                amb_get_latency(offset >> 1, hist, &misses, &maxLatency);
+                offset = (offset & 1) * 4;
+                for (i = 0; i < 4; i++) {
+                    message -> data[2 * i] = (unsigned char) (hist[offset + i] >> 8);
+                    message -> data[2 * i + 1] = (unsigned char) (hist[offset + i]);
+                }
+                message -> len = 8;
+                break;
+            }
+            if (message -> relative_address >= GET_CAN_ERRORS && message -> relative_address < GET_CAN_ERRORS + 3) {
+                // Return four of the CAN error counters.
+                offset = (unsigned char) (message -> relative_address - GET_CAN_ERRORS) * 4;
+                amb_get_error_counts(errors);
+                for (i = 0; i < 4; i++) {
+                    count = offset + i < AMB_NUM_ERR_CAUSES ? errors[offset + i] : 0;
+                    message -> data[2 * i] = (unsigned char) (count >> 8);
+                    message -> data[2 * i + 1] = (unsigned char) (count);
+                }
+                message -> len = 8;
+                break;
+            }
             message -> data[0] = (unsigned char) 0;
             message -> data[1] = (unsigned char) 0;
             message -> data[2] = (unsigned char) 0;
@@ -417,6 +798,231 @@ int ambient_msg(CAN_MSG_TYPE *message) {
 	return 0;
 }
 
+/*! Return the temperature of the AMBSI converted to degrees C, so the raw bytes of 0x30003 needn't be.
+    The conversion is in integers, without floating point.
+
+	\param	*message	a CAN_MSG_TYPE 
+	\return	0 -	Everything went OK */
+int ambient_converted_msg(CAN_MSG_TYPE *message) {
+    short centi, sixteenths;
+
+	if (message->dirn == CAN_MONITOR) {  /* Should only be a monitor requests */
+        centi = Do_1W_Temperature_Centi(ambient_temp_data[1], ambient_temp_data[0], ambient_temp_data[2], ambient_temp_data[3]);
+        sixteenths = Do_1W_Temperature_Full_16(ambient_temp_data[1], ambient_temp_data[0], ambient_temp_data[2], ambient_temp_data[3]);
+		message->len = 4;
+		message->data[0] = (unsigned char) (centi >> 8);
+		message->data[1] = (unsigned char) centi;
+		message->data[2] = (unsigned char) (sixteenths >> 8);
+		message->data[3] = (unsigned char) sixteenths;
+	} 
+	return 0;
+}
+
+/*! Get the four RCA ranges from the ARCOM board and register monitorMsg() and controlMsg() for them,
+    then select the EPP transaction formats.
+    All four ranges are got before anything is registered.  Once the link is set up the callbacks are
+    only swapped if the ranges changed, and only from the bottom half.
+
+    \return
+        - 0 -> Everything went OK
+        - -1 -> Time out getting the ranges, registrations unchanged */
+int discoverLink(void) {
+    unsigned long ranges[8];
+
+    if (queryRange(GET_SPECIAL_MONITOR_RCAS, &ranges[0], &ranges[1]) ||
+        queryRange(GET_SPECIAL_CONTROL_RCAS, &ranges[2], &ranges[3]) ||
+        queryRange(GET_MONITOR_RCAS, &ranges[4], &ranges[5]) ||
+        queryRange(GET_CONTROL_RCAS, &ranges[6], &ranges[7]))
+        return -1;
+
+    if (!linkRegs ||
+        ranges[0] != lowestSpecialMonitorRCA || ranges[1] != highestSpecialMonitorRCA ||
+        ranges[2] != lowestSpecialControlRCA || ranges[3] != highestSpecialControlRCA ||
+        ranges[4] != lowestMonitorRCA || ranges[5] != highestMonitorRCA ||
+        ranges[6] != lowestControlRCA || ranges[7] != highestControlRCA) {
+
+        /* The ARCOM ranges are the last ones registered */
+        for (; linkRegs; linkRegs--)
+            amb_unregister_last_function();
+
+        lowestSpecialMonitorRCA = ranges[0];
+        highestSpecialMonitorRCA = ranges[1];
+        lowestSpecialControlRCA = ranges[2];
+        highestSpecialControlRCA = ranges[3];
+        lowestMonitorRCA = ranges[4];
+        highestMonitorRCA = ranges[5];
+        lowestControlRCA = ranges[6];
+        highestControlRCA = ranges[7];
+
+        /* Register callbacks for special monitor, special control, monitor and control messages.
+           A range already registered in full (e.g. inside the RCAs reserved for this firmware) is refused. */
+        if (!amb_register_function(lowestSpecialMonitorRCA, highestSpecialMonitorRCA, monitorMsg))
+            linkRegs++;
+        if (!amb_register_function(lowestSpecialControlRCA, highestSpecialControlRCA, controlMsg))
+            linkRegs++;
+        if (!amb_register_function(lowestMonitorRCA, highestMonitorRCA, monitorMsg))
+            linkRegs++;
+        if (!amb_register_function(lowestControlRCA, highestControlRCA, controlMsg))
+            linkRegs++;
+    }
+
+	/* EPP PROTOCOL */
+    selectProtocol();
+    return 0;
+}
+
+/*! Select the best EPP transaction formats the ARCOM board understands.
+    Older firmware doesn't give the exact reply at EPP_PROTOCOL_RCA: the format in use is kept,
+    this is not an error.  The new formats are only used once the ARCOM board confirmed them.
+
+    \return
+        - 0 -> The formats in use are the best ones
+        - -1 -> The ARCOM board understands better ones, but didn't take them */
+int selectProtocol(void) {
+    CAN_MSG_TYPE message;
+    unsigned char formats, previous;
+
+    formats = queryProtocol();
+    if (formats == EPP_PROTOCOL_UNKNOWN || !(formats & EPP_PROTOCOL_COMPACT))
+        formats = EPP_PROTOCOL_LEGACY;      // Block requests need the compact header
+    if (formats == eppProtocol)
+        return 0;
+
+    message.dirn = CAN_CONTROL;
+    message.len = EPP_PROTOCOL_LEN;
+    message.data[0] = EPP_PROTOCOL_MAGIC0;
+    message.data[1] = EPP_PROTOCOL_MAGIC1;
+    message.data[2] = EPP_PROTOCOL_VERSION;
+    message.data[3] = formats;
+    message.relative_address = EPP_PROTOCOL_RCA;
+    if (implControlSingle(&message))
+        return -1;
+
+    /* The confirmation is the first transaction in the new format */
+    previous = eppProtocol;
+    eppProtocol = formats;
+    eppPageValid = 0;
+    if (queryProtocol() == EPP_PROTOCOL_UNKNOWN) {
+        eppProtocol = previous;
+        eppPageValid = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/*! Ask the ARCOM board for the EPP transaction formats it understands, in the format in use.
+
+    \return the EPP_PROTOCOL_ bits, or EPP_PROTOCOL_UNKNOWN if the request timed out or the reply
+        isn't exactly EPP_PROTOCOL_LEN bytes with the magic and version */
+unsigned char queryProtocol(void) {
+    CAN_MSG_TYPE message;
+
+    message.dirn = CAN_MONITOR;
+    message.len = 0;
+    message.relative_address = EPP_PROTOCOL_RCA;
+    if (implMonitorSingle(&message, TRUE))      // TRUE keeps the reply length, nothing goes on the CAN bus
+        return EPP_PROTOCOL_UNKNOWN;
+
+    if (message.len != EPP_PROTOCOL_LEN || message.data[0] != EPP_PROTOCOL_MAGIC0 ||
+        message.data[1] != EPP_PROTOCOL_MAGIC1 || message.data[2] != EPP_PROTOCOL_VERSION)
+        return EPP_PROTOCOL_UNKNOWN;
+    return message.data[3] & (EPP_PROTOCOL_COMPACT | EPP_PROTOCOL_BLOCK);
+}
+
+/*! Get one RCA range from the ARCOM board.
+
+    \param  rca         GET_SPECIAL_MONITOR_RCAS, GET_SPECIAL_CONTROL_RCAS, GET_MONITOR_RCAS or GET_CONTROL_RCAS
+    \param  *low        lowest RCA of the range
+    \param  *high       highest RCA of the range
+    \return
+        - 0 -> Everything went OK
+        - -1 -> Time out during the request */
+int queryRange(unsigned long rca, unsigned long *low, unsigned long *high) {
+    CAN_MSG_TYPE message;
+
+	message.dirn=CAN_MONITOR; // Direction: monitor
+	message.len=0;	// Size: 0
+	message.relative_address=rca;
+	if(implMonitorSingle(&message, FALSE)) // Send the monitor request.
+		return -1;
+
+	/* Rebuild highest and lowest RCA, LSB first */
+	*high = ((unsigned long)message.data[7])<<24;
+	*high += ((unsigned long)message.data[6])<<16;
+	*high += ((unsigned long)message.data[5])<<8;
+	*high += ((unsigned long)message.data[4]);
+	*low = ((unsigned long)message.data[3])<<24;
+	*low += ((unsigned long)message.data[2])<<16;
+	*low += ((unsigned long)message.data[1])<<8;
+	*low += ((unsigned long)message.data[0]);
+    return 0;
+}
+
+/*! Data Strobe capture interrupt.
+    Puts the next byte of the control in flight on the port.  After the last one it ends the
+    transaction and wakes the bottom half for the next piece of background work. */
+void eppStrobe(void) interrupt 0x13 {
+
+    if (!eppTxBusy) {
+        CC3IE = 0;
+        return;
+    }
+
+    P7 = eppTxBuf[eppTxNext];
+    TOGGLE_NWAIT;
+
+    if (++eppTxNext == eppTxLen) {
+        /* Untrigger interrupt */
+        EPPS_INTERRUPT = 0;
+        CC3IE = 0;
+        T4R = 0;
+        T4IE = 0;
+        cmdTimer = eppTxDeadline - T3;
+        if ((int) cmdTimer < 0)
+            cmdTimer = 0;
+        breakerMisses = 0;
+        eppTxBusy = 0;
+        amb_wake_idle();
+    }
+}
+
+/*! T4 overflow at the deadline of the control in flight.
+    Ends the transaction, unless the last strobe came first, and wakes the bottom half to count the failure. */
+void eppTimeout(void) interrupt 0x24 {
+
+    T4R = 0;
+    T4IE = 0;
+    if (!eppTxBusy)
+        return;
+
+    /* Untrigger interrupt */
+    EPPS_INTERRUPT = 0;
+    CC3IE = 0;
+    cmdTimer = 0;
+    eppTxBusy = 0;
+    eppTxFailed = 1;
+    amb_wake_idle();
+}
+
+/*! This function will return the last reading of a 1-Wire temperature sensor, as ambient_msg() does.
+    There is no reply for a sensor which isn't there or was never read.
+	\param	*message	a CAN_MSG_TYPE 
+	\return	0 -	Everything went OK */
+int sensor_msg(CAN_MSG_TYPE *message) {
+
+	if (message->dirn == CAN_MONITOR) {  /* Should only be a monitor requests */
+		if (ds1820_get_sensor((ubyte) (message->relative_address - GET_SENSOR_TEMP),
+							  &message->data[1], &message->data[0], &message->data[2], &message->data[3]) == -1) {
+			// No reading: tell the AMB library it's a control msg so nothing is sent
+			message->dirn = CAN_CONTROL;
+			message->len = 0;
+			return 0;
+		}
+		message->len = 4;
+	}
+	return 0;
+}
+
 /* Triggers every 48ms pulse */
 void received_48ms(void) interrupt 0x30{
 // Put whatever you want to be execute at the 48ms clock.
@@ -428,56 +1034,594 @@ void received_48ms(void) interrupt 0x30{
 
 
 /*! This function will be called in case a CAN control message is received.
-	It will start communication with the ARCOM board triggering the parallel port
-	interrupt and the sending the CAN message information to the ARCOM board.
+	It puts the message in the queue of control messages for the ARCOM board and returns.
+	forwardControls() sends it later, when there are no CAN requests waiting.
 
-	Since a CAN control request doesn't require any aknowledgment, this function
-	will then return.
+	Since a CAN control request doesn't require any aknowledgment, a message which
+	doesn't fit in the queue is only counted.
 
 	\param	*message	a CAN_MSG_TYPE 
-	\return	0 -	Everything went OK */
+	\return
+		- 0 -> Everything went OK
+	    - -1 -> Queue full, message dropped */
 int controlMsg(CAN_MSG_TYPE *message){
 
-    unsigned char i, timeout;
+    unsigned char i;
+    unsigned long twin;
 
 	if(message->dirn==CAN_MONITOR){
 		monitorMsg(message);
 		return 0;
 	}
 
-	/* Trigger interrupt */
-	EPPS_INTERRUPT = 1;
+    /* The AMB library drops the cached reply of this RCA: also drop the one of its monitor twin */
+    twin = 0;
+    if (message->relative_address >= lowestControlRCA && message->relative_address <= highestControlRCA)
+        twin = message->relative_address - lowestControlRCA + lowestMonitorRCA;
+    else if (message->relative_address >= lowestSpecialControlRCA && message->relative_address <= highestSpecialControlRCA)
+        twin = message->relative_address - lowestSpecialControlRCA + lowestSpecialMonitorRCA;
+    if (twin) {
+        amb_cache_invalidate(twin);
+
+        /* Same for the hot list, until the next refresh */
+        for (i = 0; i < numHot; i++) {
+            if (hotList[i].rca == twin)
+                hotList[i].valid = 0;
+        }
+    }
 
-	/* Send RCA */
-    timeout = 0;
-    EPP_HANDSHAKE(cmdTimer, timeout)
-	P7 = (uword) (message->relative_address);	// Put data on port
-    TOGGLE_NWAIT;                               // Trigger read by host
+    if (breakerOpen) {
+        breakerRefused++;
+        lastFailedControlRCA = message->relative_address;
+        return -1;
+    }
 
-    if (!timeout) {
-        EPP_HANDSHAKE(cmdTimer, timeout)
-        P7 = (uword) (message->relative_address>>8);
-        TOGGLE_NWAIT;
+    if (controlDepth == CONTROL_QUEUE_SIZE) {
+        controlsDropped++;
+        lastFailedControlRCA = message->relative_address;
+        return -1;
     }
 
-    if (!timeout) {
-        EPP_HANDSHAKE(cmdTimer, timeout)
-        P7 = (uword) (message->relative_address>>16);
-        TOGGLE_NWAIT;
+    controlQueue[controlHead].relative_address = message->relative_address;
+    controlQueue[controlHead].dirn = CAN_CONTROL;
+    controlQueue[controlHead].len = message->len;
+    for (i = 0; i < message->len; i++)
+        controlQueue[controlHead].data[i] = message->data[i];
+    controlHead = (controlHead + 1) % CONTROL_QUEUE_SIZE;
+    controlDepth++;
+    return 0;
+}
+
+/*! Start forwarding the oldest queued control message to the ARCOM board.
+    Nothing waits for the strobe here: eppStrobe() sends the bytes, one per strobe, and eppTimeout()
+    ends the transaction at its deadline.
+    Call only with no control in flight.
+
+    \return
+        - 1 -> A message was started
+        - 0 -> The queue is empty */
+int forwardControls(void) {
+    CAN_MSG_TYPE *message;
+    unsigned char i;
+
+    if (!controlDepth)
+        return 0;
+
+    message = &controlQueue[controlTail];
+    eppTxLen = buildHeader(message, message->len, eppTxBuf);
+    for (i = 0; i < message->len; i++)
+        eppTxBuf[eppTxLen++] = message->data[i];
+    eppTxRCA = message->relative_address;
+    controlTail = (controlTail + 1) % CONTROL_QUEUE_SIZE;
+    controlDepth--;
+
+    /* Arm the capture and the timeout, then trigger interrupt */
+    eppTxNext = 0;
+    eppTxDeadline = T3 + eppBudget[EPP_PHASE_CONTROL];
+    eppTxBusy = 1;
+    T4 = 0 - eppBudget[EPP_PHASE_CONTROL];
+    T4IR = 0;
+    T4IE = 1;
+    T4R = 1;
+    CC3IR = 0;
+    CC3IE = 1;
+    EPPS_INTERRUPT = 1;
+    return 1;
+}
+
+/*! Check on the control in flight, and count it as failed if eppTimeout() ended it.
+
+    \return 1 while the control is in flight, else 0 */
+unsigned char eppAsyncBusy(void) {
+
+    if (eppTxBusy)
+        return 1;
+    if (eppTxFailed) {
+        eppTxFailed = 0;
+        eppPageValid = 0;
+        controlsFailed++;
+        lastFailedControlRCA = eppTxRCA;
+        linkResult(1);
+    }
+    return 0;
+}
+
+/*! Wait for the control in flight to go through or time out, before another EPP transaction.
+    The CPU sleeps until an interrupt.  IEN is clear around the test: a request still ends the idle
+    mode then, so the last strobe or the timeout can't slip in between the test and _idle_().
+    The request is taken as soon as IEN is set again. */
+void eppAsyncWait(void) {
+    unsigned char ien;
+
+    ien = IEN;
+    IEN = 0;
+    while (eppTxBusy) {
+        _idle_();
+        IEN = 1;
+        _nop_();
+        IEN = 0;
+    }
+    IEN = ien;
+    eppAsyncBusy();
+}
+
+/*! Background work for the ARCOM link, registered with the AMB library as its idle function.
+    Until the link is set up only setupLink() runs.  Then queued control messages go first, then the hot
+    list.  With the link breaker open only the probe runs.
+
+    \return
+        - 1 -> Something was done, call again
+        - 0 -> Nothing to do, or a control is in flight: eppStrobe() or eppTimeout() wakes the bottom half when it's through */
+int backgroundWork(void) {
+
+    expireHotPoint();
+    if (eppAsyncBusy())
+        return 0;
+
+    if (!initialized)
+        return setupLink();
+
+    /* The ARCOM board is restarting: it will expect the legacy header */
+    if (SPPC_INIT) {
+        if (!linkDown) {
+            linkDown = 1;
+            linkLostTime = amb_get_time();
+        }
+        eppProtocol = EPP_PROTOCOL_LEGACY;
+        eppPageValid = 0;
+        relinkPending = 1;
+        return 0;
+    }
+
+    if (breakerOpen)
+        return probeLink();
+    if (relinkPending)
+        return relink();
+    if (forwardControls())
+        return 0;
+    if (benchmarkStep())
+        return 1;
+    return refreshHotPoint();
+}
+
+/*! Set up the ARCOM link with a GET_SETUP_INFO request of our own, if the ARCOM board is ready and
+    SETUP_RETRY_MS have passed since the last try.
+
+    \return 0, there is nothing more to do until the next try */
+int setupLink(void) {
+    CAN_MSG_TYPE message;
+
+    if (!ready || amb_get_time() - setupTime < TICKS_PER_MS * SETUP_RETRY_MS)
+        return 0;
+
+    setupTime = amb_get_time();
+    message.dirn = CAN_MONITOR;
+    message.len = 0;
+    message.relative_address = GET_SETUP_INFO;
+    getSetupInfo(&message);
+    return 0;
+}
+
+/*! Run one monitor request of the EPP link benchmark, if one is running.
+
+    \return
+        - 1 -> A request was made, call again
+        - 0 -> No benchmark running */
+int benchmarkStep(void) {
+    CAN_MSG_TYPE message;
+    unsigned int start, phase[EPP_PHASE_REPLY + 1];
+    unsigned char i, bytes;
+
+    if (!benchCount)
+        return 0;
+    benchCount--;
+
+    /* Header bytes as sendHeader() will send them */
+    if (!(eppProtocol & EPP_PROTOCOL_COMPACT))
+        bytes = 5;
+    else if (eppPageValid && (unsigned int) (benchRCA >> 8) == eppPage)
+        bytes = 2;
+    else
+        bytes = 3;
+
+    message.dirn = CAN_MONITOR;
+    message.len = 0;
+    message.relative_address = benchRCA;
+    start = T3;
+    if (implMonitorSingle(&message, TRUE)) {
+        benchTimeouts++;
+        return 1;
+    }
+    benchTicks += (unsigned int) (T3 - start);
+    benchBytes += bytes + 1 + message.len;
+
+    /* Time to the last handshake of each phase */
+    phase[EPP_PHASE_REQUEST] = eppBudget[EPP_PHASE_REQUEST] - monTimer1;
+    phase[EPP_PHASE_REPLY] = eppBudget[EPP_PHASE_REQUEST] + eppBudget[EPP_PHASE_REPLY] - monTimer2 - phase[EPP_PHASE_REQUEST];
+    for (i = 0; i <= EPP_PHASE_REPLY; i++) {
+        if (phase[i] < benchMin[i])
+            benchMin[i] = phase[i];
+        if (phase[i] > benchMax[i])
+            benchMax[i] = phase[i];
+        benchSum[i] += phase[i];
+    }
+    benchDone++;
+    return 1;
+}
+
+/*! Set up the ARCOM link again after it was lost, and time the recovery.
+
+    \return 1 once the link is back, call again.  0 if it failed, to try again at the next wake up. */
+int relink(void) {
+    unsigned char i;
+
+    if (discoverLink()) {
+        relinkFailures++;
+        return 0;
     }
 
+    /* The points may have changed meanwhile */
+    for (i = 0; i < numHot; i++)
+        hotList[i].valid = 0;
+
+    relinkPending = 0;
+    linkDown = 0;
+    relinks++;
+    recoveryTime = (amb_get_time() - linkLostTime) / TICKS_PER_MS;
+    return 1;
+}
+
+/*! Probe the ARCOM link with a GET_ARCOM_VERSION_INFO request, if BREAKER_PROBE_MS have passed since the last try.
+    If the link is to be set up again the relink is the probe, so the restarted ARCOM board sees the legacy
+    header first.  linkResult() closes the breaker if it goes through.
+
+    \return 0, there is nothing more to do until the next probe */
+int probeLink(void) {
+    CAN_MSG_TYPE message;
+
+    if (amb_get_time() - breakerProbeTime < TICKS_PER_MS * BREAKER_PROBE_MS)
+        return 0;
+
+    breakerProbeTime = amb_get_time();
+    if (relinkPending) {
+        relink();
+        return 0;
+    }
+
+    message.dirn = CAN_MONITOR;
+    message.len = 0;
+    message.relative_address = GET_ARCOM_VERSION_INFO;
+    implMonitorSingle(&message, FALSE);
+    return 0;
+}
+
+/*! Count the outcome of an EPP transaction for the link breaker:
+    open it after breakerThreshold time outs in a row, close it when one goes through.
+
+    \param  timeout     nonzero if the transaction timed out */
+void linkResult(unsigned char timeout) {
+
     if (!timeout) {
-        EPP_HANDSHAKE(cmdTimer, timeout)
-        P7 = (uword) (message->relative_address>>24);
+        breakerMisses = 0;
+        if (breakerOpen) {
+            breakerOpen = 0;
+            breakerClosed++;
+
+            /* The ARCOM board may have restarted meanwhile */
+            if (initialized)
+                relinkPending = 1;
+        }
+        return;
+    }
+
+    if (breakerMisses < 0xFF)
+        breakerMisses++;
+    if (!breakerOpen && breakerThreshold && breakerMisses >= breakerThreshold) {
+        breakerOpen = 1;
+        breakerOpened++;
+        breakerProbeTime = amb_get_time();
+        if (!linkDown) {
+            linkDown = 1;
+            linkLostTime = breakerProbeTime;
+        }
+    }
+}
+
+/*! Refresh the next point of the hot list from the ARCOM board, if a refresh cycle is running or due.
+
+    \return
+        - 1 -> A point was refreshed, call again
+        - 0 -> Nothing to do */
+int refreshHotPoint(void) {
+    CAN_MSG_TYPE message;
+    unsigned long now;
+    unsigned char i, count;
+
+    if (!numHot)
+        return 0;
+
+    now = amb_get_time();
+    if (hotNext == 0) {
+        if (now - hotCycleStart < TICKS_PER_MS * hotPeriod)
+            return 0;
+        hotCycleStart = now;
+    }
+
+    /* Controls for these points have gone already */
+    if (eppProtocol & EPP_PROTOCOL_BLOCK) {
+        /* Several points in one transaction */
+        count = numHot - hotNext;
+        if (count > EPP_BLOCK_MAX)
+            count = EPP_BLOCK_MAX;
+        implMonitorBlock(hotNext, count);
+        hotNext += count;
+    } else {
+        message.dirn = CAN_MONITOR;
+        message.len = 0;
+        message.relative_address = hotList[hotNext].rca;
+        if (!implMonitorSingle(&message, TRUE)) {
+            hotList[hotNext].len = message.len;
+            for (i = 0; i < message.len; i++)
+                hotList[hotNext].data[i] = message.data[i];
+            hotList[hotNext].updated = now;
+            hotList[hotNext].valid = 1;
+        }
+        hotNext++;
+    }
+
+    if (hotNext >= numHot) {
+        hotNext = 0;
+        hotCycleTime = amb_get_time() - hotCycleStart;
+    }
+    return 1;
+}
+
+/*! Fetch a run of hot list points from the ARCOM board in one block transaction.
+    The replies go straight into the hot list.  The first reply has the reply budget on top of
+    the time left from the request, as in implMonitorSingle(); each later one has the reply budget
+    from the end of the one before, so the deadline never gets further ahead than request + reply.
+
+    \param  first       index of the first point in the hot list
+    \param  count       number of points, 1 to EPP_BLOCK_MAX
+    \return
+        - 0 -> Everything went OK
+        - -1 -> Time out during the transaction */
+int implMonitorBlock(unsigned char first, unsigned char count) {
+    unsigned char i, k, len, timeout;
+    unsigned long rca, now;
+
+    eppAsyncWait();
+
+    /* Trigger interrupt */
+    EPPS_INTERRUPT = 1;
+    eppDeadline = T3 + eppBudget[EPP_PHASE_REQUEST];
+
+    /* Send the descriptor and the RCAs */
+    timeout = 0;
+    EPP_HANDSHAKE(monTimer1, timeout);
+    P7 = EPP_COMPACT_BLOCK | count;
+    TOGGLE_NWAIT;
+
+    for (i = 0; !timeout && i < count; i++) {
+        rca = hotList[first + i].rca;
+        EPP_HANDSHAKE(monTimer1, timeout);
+        P7 = (uword) (rca >> 16);
         TOGGLE_NWAIT;
+
+        if (!timeout) {
+            EPP_HANDSHAKE(monTimer1, timeout);
+            P7 = (uword) (rca >> 8);
+            TOGGLE_NWAIT;
+        }
+
+        if (!timeout) {
+            EPP_HANDSHAKE(monTimer1, timeout);
+            P7 = (uword) (rca);
+            TOGGLE_NWAIT;
+        }
     }
 
-	/* Send payload size */
     if (!timeout) {
-        EPP_HANDSHAKE(cmdTimer, timeout)
-        P7 = message->len;
-        TOGGLE_NWAIT;
+        /* Set port to receive data */
+        DP7 = 0x00;
+        now = amb_get_time();
+
+        for (i = 0; !timeout && i < count; i++) {
+            if (i == 0)
+                eppDeadline += eppBudget[EPP_PHASE_REPLY];
+            else
+                eppDeadline = T3 + eppBudget[EPP_PHASE_REPLY];
+
+            /* Receive payload size */
+            EPP_HANDSHAKE(monTimer2, timeout);
+            len = (ubyte) P7;
+            TOGGLE_NWAIT;
+
+            if (!timeout && len > MAX_CAN_MSG_PAYLOAD) {
+                timeout = 1;
+            }
+
+            /* Get the payload, the point is not valid until it is complete */
+            hotList[first + i].valid = 0;
+            for (k = 0; !timeout && k < len; k++) {
+                EPP_HANDSHAKE(monTimer2, timeout);
+                hotList[first + i].data[k] = (ubyte) P7;
+                TOGGLE_NWAIT;
+            }
+
+            if (!timeout) {
+                hotList[first + i].len = len;
+                hotList[first + i].updated = now;
+                hotList[first + i].valid = 1;
+            }
+        }
+
+        //Set port to transmit data:
+        DP7 = 0xFF;
+    }
+
+    /* Untrigger interrupt */
+    EPPS_INTERRUPT = 0;
+
+    linkResult(timeout);
+    if (timeout) {
+        eppPageValid = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/*! Answer a monitor request from the hot list.
+
+    \param  *message    a CAN_MSG_TYPE
+    \return 1 if the point is in the hot list and fresh enough, else 0 */
+unsigned char getHotPoint(CAN_MSG_TYPE *message) {
+    unsigned char i, k;
+
+    for (i = 0; i < numHot; i++) {
+        if (hotList[i].rca != message->relative_address)
+            continue;
+        if (!hotFresh(i)) {
+            hotList[i].valid = 0;
+            return 0;
+        }
+        message->len = hotList[i].len;
+        for (k = 0; k < message->len; k++)
+            message->data[k] = hotList[i].data[k];
+        return 1;
+    }
+    return 0;
+}
+
+/*! Check a point of the hot list.
+
+    \param  i           index in the hot list
+    \return 1 if it holds a reply less than two refresh periods old, else 0 */
+unsigned char hotFresh(unsigned char i) {
+
+    return hotList[i].valid && amb_get_time() - hotList[i].updated < 2 * TICKS_PER_MS * hotPeriod;
+}
+
+/*! Drop the next point of the hot list in turn if it is stale.  backgroundWork() runs at least every
+    26 mS, so a point is dropped long before amb_get_time() wraps around and makes it look fresh again. */
+void expireHotPoint(void) {
+
+    if (hotSweep >= numHot)
+        hotSweep = 0;
+    if (hotSweep < numHot && !hotFresh(hotSweep))
+        hotList[hotSweep].valid = 0;
+    hotSweep++;
+}
+
+/*! Change the hot list as requested by a control message to SET_HOT_LIST.
+    An RCA is added only once, and only from the monitor RCAs of the ARCOM: others are counted
+    for GET_HOT_LIST_REFUSED.
+
+    \param  *message    a CAN_MSG_TYPE */
+void configHotList(CAN_MSG_TYPE *message) {
+    unsigned long rca;
+    unsigned char i, why;
+
+    switch (message->len) {
+        case 1:     // Clear the list
+            if (message->data[0] == 0)
+                numHot = hotNext = 0;
+            break;
+        case 2:     // Refresh period in mS
+            hotPeriod = ((unsigned int) message->data[0] << 8) + message->data[1];
+            if (hotPeriod == 0)
+                hotPeriod = 1;
+            break;
+        case 3:     // Add an RCA
+            rca = ((unsigned long) message->data[0] << 16) + ((unsigned int) message->data[1] << 8) + message->data[2];
+            why = 0;
+            if (rca < lowestMonitorRCA || rca > highestMonitorRCA)
+                why = HOT_REFUSED_RANGE;
+            for (i = 0; i < numHot && !why; i++)
+                if (hotList[i].rca == rca)
+                    why = HOT_REFUSED_LISTED;
+            if (!why && numHot >= HOT_LIST_SIZE)
+                why = HOT_REFUSED_FULL;
+            if (why) {
+                hotRefused++;
+                hotRefusedWhy = why;
+                hotRefusedRCA = rca;
+                break;
+            }
+            hotList[numHot].rca = rca;
+            hotList[numHot].valid = 0;
+            numHot++;
+            break;
+    }
+}
+
+/*! Forward all queued control messages if one of them is for the control RCA paired with a monitor RCA,
+    so that the monitor request reads back what was set.
+
+    \param  monitorRCA  the RCA of the monitor request about to be forwarded */
+void flushControls(unsigned long monitorRCA) {
+    unsigned long controlRCA;
+    unsigned char i, k;
+
+    if (!controlDepth)
+        return;
+
+    if (monitorRCA >= lowestMonitorRCA && monitorRCA <= highestMonitorRCA)
+        controlRCA = monitorRCA - lowestMonitorRCA + lowestControlRCA;
+    else if (monitorRCA >= lowestSpecialMonitorRCA && monitorRCA <= highestSpecialMonitorRCA)
+        controlRCA = monitorRCA - lowestSpecialMonitorRCA + lowestSpecialControlRCA;
+    else
+        return;
+
+    for (i = 0, k = controlTail; i < controlDepth; i++, k = (k + 1) % CONTROL_QUEUE_SIZE) {
+        if (controlQueue[k].relative_address == controlRCA) {
+            do {
+                eppAsyncWait();
+            } while (forwardControls());
+            return;
+        }
     }
+}
+
+/*! Implementation of one control transaction.
+    It will start communication with the ARCOM board triggering the parallel port
+	interrupt and the sending the CAN message information to the ARCOM board.
+
+    \param  *message    a CAN_MSG_TYPE
+    \return
+        - 0 -> Everything went OK
+        - -1 -> Time out during CAN message forwarding */
+int implControlSingle(CAN_MSG_TYPE *message) {
+    unsigned char i, timeout;
+
+    eppAsyncWait();
+
+	/* Trigger interrupt */
+	EPPS_INTERRUPT = 1;
+    eppDeadline = T3 + eppBudget[EPP_PHASE_CONTROL];
+
+	/* Send RCA and payload size */
+    timeout = sendHeader(message, message->len, &cmdTimer);
 
     /* Send payload */
 	for(i = 0; !timeout && i < message -> len; i++) {
@@ -488,9 +1632,76 @@ int controlMsg(CAN_MSG_TYPE *message){
 
 	/* Untrigger interrupt */
 	EPPS_INTERRUPT = 0;
+
+    linkResult(timeout);
+    if (timeout) {
+        eppPageValid = 0;
+        return -1;
+    }
 	return 0;
 }
 
+/*! Send the RCA and payload size of a forwarded CAN request to the ARCOM board,
+    using the header format selected in getSetupInfo().
+
+    \param  *message    a CAN_MSG_TYPE
+    \param  len         payload size to send, 0 for a monitor request
+    \param  *timer      countdown register for this phase of the transaction
+    \return 1 on time out, else 0 */
+unsigned char sendHeader(CAN_MSG_TYPE *message, unsigned char len, unsigned int idata *timer) {
+    unsigned char header[EPP_HEADER_MAX];
+    unsigned char i, n, timeout;
+
+    n = buildHeader(message, len, header);
+
+    timeout = 0;
+    for (i = 0; !timeout && i < n; i++) {
+        EPP_HANDSHAKE((*timer), timeout)
+        P7 = header[i];                             // Put data on port
+        TOGGLE_NWAIT;                               // Trigger read by host
+    }
+
+    if (timeout)
+        eppPageValid = 0;
+    return timeout;
+}
+
+/*! Put the header of a forwarded CAN request in a buffer, in the format selected in getSetupInfo().
+    The page becomes the one of this request: the caller forgets it if the transaction doesn't complete.
+
+    \param  *message    a CAN_MSG_TYPE
+    \param  len         payload size to send, 0 for a monitor request
+    \param  *header     EPP_HEADER_MAX bytes
+    \return number of bytes in the header */
+unsigned char buildHeader(CAN_MSG_TYPE *message, unsigned char len, unsigned char *header) {
+    unsigned char n;
+    unsigned int page;
+
+    if (!(eppProtocol & EPP_PROTOCOL_COMPACT)) {
+        header[0] = (unsigned char) (message->relative_address);
+        header[1] = (unsigned char) (message->relative_address>>8);
+        header[2] = (unsigned char) (message->relative_address>>16);
+        header[3] = (unsigned char) (message->relative_address>>24);
+        header[4] = len;
+        return 5;
+    }
+
+    /* Compact header: RCA bits 17-8 are the page */
+    page = (unsigned int) (message->relative_address >> 8);
+    n = 0;
+    if (eppPageValid && page == eppPage) {
+        header[n++] = EPP_COMPACT_PAGE | ((page >> 4) & 0x30) | len;
+    } else {
+        header[n++] = EPP_COMPACT_FULL | ((page >> 4) & 0x30) | len;
+        header[n++] = (unsigned char) (message->relative_address>>8);
+    }
+    header[n++] = (unsigned char) (message->relative_address);
+
+    eppPage = page;
+    eppPageValid = 1;
+    return n;
+}
+
 
 /*! Implementation of one monitor transaction.  
     Abstracted out so that monitorMsg below can retry
@@ -503,41 +1714,19 @@ int controlMsg(CAN_MSG_TYPE *message){
 int implMonitorSingle(CAN_MSG_TYPE *message, unsigned char sendReply) {
     unsigned char i, timeout;
 
+    eppAsyncWait();
+
     /* Trigger interrupt */
     EPPS_INTERRUPT = 1;
+    eppDeadline = T3 + eppBudget[EPP_PHASE_REQUEST];
 
-    /* Send RCA */
-    timeout = 0;
-    EPP_HANDSHAKE(monTimer1, timeout);
-    P7 = (uword) (message->relative_address);   // Put data on port
-    TOGGLE_NWAIT;                               // Trigger read by host
+    /* Send RCA and payload size (0 -> monitor message) */
+    timeout = sendHeader(message, 0, &monTimer1);
 
     if (!timeout) {
-        EPP_HANDSHAKE(monTimer1, timeout);
-        P7 = (uword) (message->relative_address>>8);
-        TOGGLE_NWAIT;
-    }
+        /* Time left from the request phase carries over */
+        eppDeadline += eppBudget[EPP_PHASE_REPLY];
 
-    if (!timeout) {
-        EPP_HANDSHAKE(monTimer1, timeout);
-        P7 = (uword) (message->relative_address>>16);
-        TOGGLE_NWAIT;
-    }
-
-    if (!timeout) {
-        EPP_HANDSHAKE(monTimer1, timeout);
-        P7 = (uword) (message->relative_address>>24);
-        TOGGLE_NWAIT;
-    }
-
-    /* Send payload size (0 -> monitor message) */
-    if (!timeout) {
-        EPP_HANDSHAKE(monTimer1, timeout);
-        P7 = 0;
-        TOGGLE_NWAIT;
-    }
-
-    if (!timeout) {
         /* Set port to receive data */
         DP7 = 0x00;
 
@@ -565,6 +1754,7 @@ int implMonitorSingle(CAN_MSG_TYPE *message, unsigned char sendReply) {
 
     /* Untrigger interrupt */
     EPPS_INTERRUPT = 0;
+    linkResult(timeout);
 
     /* Handle timeout or reply suppressed */
     if (timeout || !sendReply) {
@@ -576,8 +1766,10 @@ int implMonitorSingle(CAN_MSG_TYPE *message, unsigned char sendReply) {
         message->dirn = CAN_CONTROL;
         message->len = 0;
     }
-    if (timeout)
+    if (timeout) {
+        eppPageValid = 0;
         return -1;
+    }
     else
         return 0;
 }
@@ -602,11 +1794,26 @@ int monitorMsg(CAN_MSG_TYPE *message) {
 		return 0;
 	}
 
+    // Points in the hot list are answered from here:
+    if (getHotPoint(message))
+        return 0;
+
+    // ARCOM link down: no reply, without waiting for the deadline
+    if (breakerOpen) {
+        breakerRefused++;
+        message->dirn = CAN_CONTROL;
+        message->len = 0;
+        return -1;
+    }
+
+    // Controls queued for this point go first:
+    flushControls(message->relative_address);
+
     // Try 1:
     ret = implMonitorSingle(message, TRUE);
 
-    if (ret != 0)
-        // Retry once:
+    if (ret != 0 && !breakerOpen)
+        // Retry once, with a budget of its own:
         ret = implMonitorSingle(message, TRUE);
 
 	return ret;
@@ -0,0 +1,83 @@
+/*
+ * Host time of the callback lookup in amb_handle_transaction() with 8, 32
+ * and 128 registered ranges, spread over the whole 18 bit RCA space or
+ * packed into the first pages.  Built once with the binary search and once
+ * with AMB_PAGE_DISPATCH.  The requests fall between the ranges, so that no
+ * callback runs and only the lookup is timed.
+ *
+ * amb.c is included to get at its static functions.
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "libraries/amb/amb.c"
+
+#define MAX_RANGES  128
+#define REQUESTS    200000
+#define RUNS        9           /* the fastest run is taken, the others are host noise */
+
+static CALLBACK_STRUCT callbacks[MAX_RANGES];
+
+static short callback(CAN_MSG_TYPE *msg)
+{
+    (void) msg;
+    return 0;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* ns per lookup with n ranges of 16 RCAs, step RCAs apart */
+static double bench(unsigned n, unsigned long step)
+{
+    static struct rx_frame frames[64];
+    unsigned i, k, run;
+    double start, ns, best = 0;
+
+    amb_init_slave_n(callbacks, MAX_RANGES);
+    for (i = 0; i < n; i++)
+        amb_register_function(i * step, i * step + 15, callback);
+
+    /* Requests just past the end of ranges spread over all of them */
+    for (k = 0; k < 64; k++) {
+        unsigned long id = slave_node.base_address + (k * n / 64) * step + 16;
+
+        frames[k].LAR = ((id & 0x1F) << 11) | ((id & 0x1FE0) >> 5);
+        frames[k].UAR = ((id & 0x1FE000) >> 5) | ((id & 0x1FE00000) >> 21);
+        frames[k].msg.len = 1;
+    }
+
+    for (run = 0; run < RUNS; run++) {
+        start = now_ns();
+        for (i = 0; i < REQUESTS; i++)
+            amb_handle_transaction(&frames[i & 63]);
+        ns = (now_ns() - start) / REQUESTS;
+        if (!run || ns < best)
+            best = ns;
+    }
+    return best;
+}
+
+int main(void)
+{
+    static const unsigned sizes[] = { 8, 32, 128 };
+    unsigned i;
+
+    sim_reset();
+#ifdef AMB_PAGE_DISPATCH
+    printf("page table dispatch, %u RCAs per page\n", 1u << AMB_PAGE_SHIFT);
+#else
+    printf("binary search dispatch\n");
+#endif
+    printf("ranges   spread (ns)   packed (ns)\n");
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        printf("%6u   %11.1f   %11.1f\n", sizes[i],
+               bench(sizes[i], 0x40000UL / sizes[i]), bench(sizes[i], 32));
+    return 0;
+}
@@ -0,0 +1,149 @@
+/*
+ * Cost per frame of taking a CAN request from message object 15 and handing
+ * it to the callback.  The CAN interrupt now copies the arbitration registers
+ * and only the data bytes received into the queue slot, which the callback
+ * then gets in place.  Before, it copied the configuration register and all
+ * eight data registers into the slot, and the bottom half copied the data
+ * again into current_msg for the callback.
+ *
+ * Both copy steps are reproduced here; the rest of amb_queue_frame() is the
+ * same for both.  CAN interrupt times are simulated CPU cycles of 50 ns, at
+ * SIM_ACCESS_CYCLES per register access.  The copy the bottom half no
+ * longer makes touches only RAM, which the simulator doesn't count: it is
+ * timed on the host.
+ *
+ * amb.c is included to get at its static functions.
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "libraries/amb/amb.c"
+
+#define RCA         0x123UL
+#define FRAMES      200000
+#define CAN_OBJ15   14
+
+static CALLBACK_STRUCT callbacks[4];
+
+/* The queue slot and the callback buffer of the two copy path */
+struct old_frame {
+    uword UAR, LAR;
+    ubyte MCFG;
+    ubyte Data[8];
+};
+static struct old_frame old_slot;
+static CAN_MSG_TYPE old_msg;
+
+static short callback(CAN_MSG_TYPE *msg)
+{
+    (void) msg;
+    return 0;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* The copy in the CAN interrupt, before */
+static void old_copy(ubyte obj)
+{
+    ubyte i;
+
+    old_slot.UAR = CAN_OBJ[obj].UAR;
+    old_slot.LAR = CAN_OBJ[obj].LAR;
+    old_slot.MCFG = CAN_OBJ[obj].MCFG;
+    for (i = 0; i < 8; i++)
+        old_slot.Data[i] = CAN_OBJ[obj].Data[i];
+}
+
+/* The copy in the bottom half, before */
+static void old_handoff(void)
+{
+    ubyte i;
+
+    old_msg.len = (old_slot.MCFG & 0xf0) >> 4;
+    for (i = 0; i < old_msg.len; i++)
+        old_msg.data[i] = old_slot.Data[i];
+}
+
+/* The copy in the CAN interrupt, now: the same lines as amb_queue_frame() */
+static void new_copy(ubyte obj)
+{
+    ubyte i, len;
+
+    rx_queue[rx_head].UAR = CAN_OBJ[obj].UAR;
+    rx_queue[rx_head].LAR = CAN_OBJ[obj].LAR;
+    len = (CAN_OBJ[obj].MCFG & 0xf0) >> 4;
+    rx_queue[rx_head].msg.len = len;
+    for (i = 0; i < len; i++)
+        rx_queue[rx_head].msg.data[i] = CAN_OBJ[obj].Data[i];
+}
+
+/* Put a request in message object 15 */
+static void load(ubyte len)
+{
+    unsigned long id = slave_node.base_address + RCA;
+
+    CAN_OBJ[CAN_OBJ15].LAR = ((id & 0x1F) << 11) | ((id & 0x1FE0) >> 5);
+    CAN_OBJ[CAN_OBJ15].UAR = ((id & 0x1FE000) >> 5) | ((id & 0x1FE00000) >> 21);
+    CAN_OBJ[CAN_OBJ15].MCFG = (len << 4) | 0x04;
+}
+
+static sim_time_t cycles(void (*copy)(ubyte))
+{
+    sim_time_t start = sim_now;
+
+    copy(CAN_OBJ15);
+    return sim_now - start;
+}
+
+/* Host ns per frame of the copy the bottom half made before */
+static double handoff_ns(void)
+{
+    double start;
+    unsigned i;
+
+    start = now_ns();
+    for (i = 0; i < FRAMES; i++) {
+        old_handoff();
+        __asm__ volatile("" ::: "memory");
+    }
+    return (now_ns() - start) / FRAMES;
+}
+
+int main(void)
+{
+    static const ubyte lengths[] = { 0, 2, 8 };
+    sim_time_t isr, before, now;
+    double ns;
+    unsigned i;
+
+    sim_reset();
+    amb_init_slave_n(callbacks, 4);
+    amb_register_function(0x100, 0x1FF, callback);
+
+    printf("CAN interrupt in cycles of 50 ns, bottom half copy in host ns\n");
+    printf("request bytes   ISR before   ISR now   saved   bottom half copy before\n");
+    for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        load(lengths[i]);
+
+        /* The whole of amb_queue_frame(), with the slot released again */
+        isr = sim_now;
+        amb_queue_frame(CAN_OBJ15);
+        isr = sim_now - isr;
+        rx_tail = rx_head;
+
+        before = cycles(old_copy);
+        now = cycles(new_copy);
+        old_copy(CAN_OBJ15);
+        ns = handoff_ns();
+        printf("%13u   %10llu   %7llu   %5llu   %23.1f\n", lengths[i],
+               isr - now + before, isr, before - now, ns);
+    }
+    return 0;
+}
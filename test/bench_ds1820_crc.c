@@ -0,0 +1,54 @@
+/*
+ * Host throughput of Do_1W_CRC() in bytes per second.  Built once for each
+ * implementation: DS1820_CRC_TABLE, DS1820_CRC_NIBBLE and DS1820_CRC_BITWISE.
+ *
+ * ds1820.c is included to build it with the implementation of the benchmark.
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "libraries/ds1820/ds1820.c"
+
+#define BYTES       (1UL << 16)
+#define PASSES      64
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(void)
+{
+    static ubyte data[BYTES];
+    unsigned long i, seed = 1;
+    unsigned pass;
+    volatile ubyte result;
+    ubyte crc = 0;
+    double start;
+
+    for (i = 0; i < BYTES; i++) {
+        seed = seed * 1103515245UL + 12345;
+        data[i] = (ubyte) (seed >> 16);
+    }
+
+    start = now_ns();
+    for (pass = 0; pass < PASSES; pass++)
+        for (i = 0; i < BYTES; i++)
+            crc = Do_1W_CRC(data[i], crc);
+    result = crc;
+
+#if defined(DS1820_CRC_TABLE)
+    printf("256 byte table");
+#elif defined(DS1820_CRC_NIBBLE)
+    printf("16 + 16 byte nibble tables");
+#else
+    printf("bit by bit");
+#endif
+    printf(": %.1f Mbytes/s\n", BYTES * PASSES * 1e3 / (now_ns() - start));
+    (void) result;
+    return 0;
+}
@@ -0,0 +1,99 @@
+/*
+ * The EPP link benchmark of the firmware, SET_EPP_BENCHMARK 0x20039, run
+ * against the ARCOM stand-in: the figures it reports for replies of 1 and 8
+ * bytes with the ARCOM strobing every 1, 2 and 5 us, so they can be set
+ * against those of the real link.
+ */
+
+#include <stdio.h>
+
+#include "sim.h"
+#include "libraries/amb/amb.h"
+
+/* From main.c */
+#define SET_EPP_BENCHMARK       0x20039UL
+#define GET_BENCHMARK_TIMES     0x2003AUL
+
+#define REQUESTS                500
+#define POINT                   0x140UL         /* plus the size of its reply */
+
+void femc_main(void);
+
+static unsigned word(const struct sim_can_frame *reply, unsigned i)
+{
+    return (reply->data[i] << 8) | reply->data[i + 1];
+}
+
+static const struct sim_can_frame *request(unsigned long rca)
+{
+    unsigned from = sim_can_logged;
+
+    sim_can_monitor(rca);
+    sim_run_us(2000);
+    return sim_can_reply(rca, from);
+}
+
+/* Run the benchmark on a point and print its figures: the number of timeouts, or -1 if it didn't end */
+static long bench(unsigned strobe_us, unsigned long rca)
+{
+    ubyte start[5];
+    const struct sim_can_frame *reply;
+    unsigned long rate;
+    unsigned phase[2][3], timeouts, i, k;
+
+    sim_arcom.strobe_ns = strobe_us * 1000;
+    start[0] = REQUESTS >> 8;
+    start[1] = REQUESTS & 0xFF;
+    start[2] = (ubyte) (rca >> 16);
+    start[3] = (ubyte) (rca >> 8);
+    start[4] = (ubyte) rca;
+    sim_can_control(SET_EPP_BENCHMARK, sizeof(start), start);
+
+    for (i = 0; i < 100; i++) {
+        reply = request(SET_EPP_BENCHMARK);
+        if (!reply || reply->len != 8)
+            return -1;
+        if (!word(reply, 0))
+            break;
+        sim_run_us(10000);
+    }
+    if (i == 100)
+        return -1;
+    timeouts = word(reply, 2);
+    rate = ((unsigned long) word(reply, 4) << 16) | word(reply, 6);
+
+    for (i = 0; i < 2; i++) {
+        reply = request(GET_BENCHMARK_TIMES + i);
+        if (!reply || reply->len != 8)
+            return -1;
+        for (k = 0; k < 3; k++)
+            phase[i][k] = word(reply, 2 * k);
+    }
+
+    /* Times are in 0.4 us units */
+    printf("%10u   %5lu   %7lu   %4.1f %5.1f %5.1f   %4.1f %5.1f %5.1f   %u\n", strobe_us, rca - POINT, rate,
+           phase[0][0] * 0.4, phase[0][1] * 0.4, phase[0][2] * 0.4,
+           phase[1][0] * 0.4, phase[1][1] * 0.4, phase[1][2] * 0.4, timeouts);
+    return timeouts;
+}
+
+int main(void)
+{
+    static const unsigned strobes_us[] = { 1, 2, 5 };
+    static const ubyte data[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    unsigned i, failed = 0;
+
+    sim_reset();
+    sim_arcom_point(POINT + 1, 1, data);
+    sim_arcom_point(POINT + 8, 8, data);
+    sim_start_main(femc_main);
+    sim_run_us(100000);
+
+    printf("%u monitor requests per run, times in us: min mean max\n", REQUESTS);
+    printf("strobe (us)   reply   bytes/s   request          reply            timeouts\n");
+    for (i = 0; i < sizeof(strobes_us) / sizeof(strobes_us[0]); i++) {
+        failed |= bench(strobes_us[i], POINT + 1) != 0;
+        failed |= bench(strobes_us[i], POINT + 8) != 0;
+    }
+    return failed || sim_arcom.aborted != 0;
+}
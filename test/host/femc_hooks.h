@@ -0,0 +1,15 @@
+/*
+ * Hooks for the host build of src/main.c, included by keil2c after its
+ * include of ds1820.h.
+ */
+
+#ifndef FEMC_HOOKS_H
+#define FEMC_HOOKS_H
+
+/* The test runs main() with sim_start_main() */
+#define main femc_main
+
+/* The main loop only watches memory while a temperature reading runs: let time run on */
+#define ds1820_poll_temp(msb, lsb, remain, per_c) (sim_spin(), ds1820_poll_temp(msb, lsb, remain, per_c))
+
+#endif /* FEMC_HOOKS_H */
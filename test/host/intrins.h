@@ -0,0 +1,14 @@
+/*
+ * intrins.h for the host build: the C166 intrinsics used by the firmware.
+ */
+
+#ifndef INTRINS_H
+#define INTRINS_H
+
+#include "sim.h"
+
+#define _nop_()     sim_step(1)
+#define _idle_()    sim_idle()
+#define _trap_(n)   sim_trap(n)
+
+#endif /* INTRINS_H */
@@ -0,0 +1,15 @@
+/*
+ * The Keil C166 extensions used by the firmware, for the host compiler.
+ * Included ahead of every source rewritten by keil2c.
+ */
+
+#ifndef KEIL_H
+#define KEIL_H
+
+#define idata
+#define sdata
+#define bit volatile unsigned char
+
+#include "sim.h"
+
+#endif /* KEIL_H */
@@ -0,0 +1,262 @@
+/*
+ * keil2c: rewrite a Keil C166 source file so the host compiler builds it
+ * against the simulated C167CR in sim.c.
+ *
+ *   keil2c <in> <out> [hooks.h]
+ *
+ * - CR LF line ends become LF.
+ * - "sbit X = P^N;" becomes "#define X SIM_SBIT(P, N)".
+ * - "void f(void) interrupt V" becomes "SIM_INTERRUPT(V, f) void f(void)",
+ *   which hands the function to the simulator as the handler of vector V.
+ * - "(T sdata *) 0xNNNN", the on-chip CAN registers, becomes
+ *   "(T *) sim_xreg(0xNNNN)".
+ * - Back slashes in #include paths become forward slashes.
+ * - int becomes short and long becomes int, and L suffixes are dropped from
+ *   numbers, so that the types keep their C166 sizes of 16 and 32 bits.
+ * - "while (c) ;", a loop which waits for an interrupt handler to change
+ *   something in memory, becomes "while (c) sim_spin();" so that time runs
+ *   on while it waits.  "do { ... } while (c);" is left alone.
+ * - hooks.h, if given, is included after the include of ds1820.h.
+ *
+ * Comments and string literals are copied unchanged.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_LINE 4096
+
+static FILE *out;
+static int in_comment;		/* inside a block comment */
+static int xreg_pending;	/* "sdata" seen, the next number is an address */
+static int last;		/* last character of code copied, other than space */
+static int in_while;		/* in the condition of a while loop, with the depth of parentheses */
+static int depth;
+static int after_while;		/* just after the condition of a while loop */
+static int braces;		/* depth of braces */
+static int do_braces[64];	/* depth of braces at each open "do" */
+static int num_do;
+
+static int is_ident(int c)
+{
+	return isalnum(c) || c == '_';
+}
+
+static const char *skip_space(const char *p)
+{
+	while (*p == ' ' || *p == '\t')
+		p++;
+	return p;
+}
+
+/* Copy an identifier at p into buf, return the end of it */
+static const char *get_ident(const char *p, char *buf, size_t size)
+{
+	size_t n = 0;
+
+	while (is_ident(*p) && n + 1 < size)
+		buf[n++] = *p++;
+	buf[n] = 0;
+	return p;
+}
+
+static void put_ident(const char *id)
+{
+	if (!strcmp(id, "do") && num_do < 64)
+		do_braces[num_do++] = braces;
+	if (!strcmp(id, "while")) {
+		if (num_do && last == '}' && do_braces[num_do - 1] == braces)
+			num_do--;
+		else {
+			in_while = 1;
+			depth = 0;
+		}
+	}
+	if (!strcmp(id, "int"))
+		fputs("short", out);
+	else if (!strcmp(id, "long"))
+		fputs("int", out);
+	else if (!strcmp(id, "sdata"))
+		xreg_pending = 1;
+	else
+		fputs(id, out);
+}
+
+static void put_number(const char *num)
+{
+	if (xreg_pending)
+		fputs("sim_xreg(", out);
+	for (; *num; num++)
+		if (*num != 'L' && *num != 'l')
+			fputc(*num, out);
+	if (xreg_pending)
+		fputc(')', out);
+	xreg_pending = 0;
+}
+
+/* Copy a line of code, rewriting the identifiers and numbers outside comments and literals */
+static void put_code(const char *p)
+{
+	char tok[MAX_LINE];
+
+	while (*p) {
+		if (in_comment) {
+			if (p[0] == '*' && p[1] == '/') {
+				fputs("*/", out);
+				p += 2;
+				in_comment = 0;
+			} else
+				fputc(*p++, out);
+		} else if (p[0] == '/' && p[1] == '*') {
+			fputs("/*", out);
+			p += 2;
+			in_comment = 1;
+		} else if (p[0] == '/' && p[1] == '/') {
+			fputs(p, out);
+			return;
+		} else if (*p == '"' || *p == '\'') {
+			char quote = *p;
+
+			fputc(*p++, out);
+			while (*p && *p != quote) {
+				if (*p == '\\' && p[1])
+					fputc(*p++, out);
+				fputc(*p++, out);
+			}
+			if (*p)
+				fputc(*p++, out);
+		} else if (*p == ' ' || *p == '\t') {
+			fputc(*p++, out);
+			continue;
+		} else if (after_while && *p == ';') {
+			fputs("sim_spin();", out);
+			p++;
+		} else if (isdigit((unsigned char) *p)) {
+			p = get_ident(p, tok, sizeof(tok));
+			put_number(tok);
+		} else if (is_ident(*p)) {
+			p = get_ident(p, tok, sizeof(tok));
+			put_ident(tok);
+		} else {
+			if (*p == '{')
+				braces++;
+			else if (*p == '}')
+				braces--;
+			if (in_while && *p == '(')
+				depth++;
+			else if (in_while && *p == ')' && --depth == 0) {
+				in_while = 0;
+				last = *p;
+				after_while = 1;
+				fputc(*p++, out);
+				continue;
+			}
+			fputc(*p++, out);
+		}
+		last = p[-1];
+		after_while = 0;
+	}
+}
+
+/* sbit NAME = PORT^BIT; comment */
+static int put_sbit(const char *line)
+{
+	char name[256], port[256], bit[256];
+	const char *p = skip_space(line);
+
+	if (strncmp(p, "sbit", 4) || is_ident(p[4]))
+		return 0;
+	p = get_ident(skip_space(p + 4), name, sizeof(name));
+	p = skip_space(p);
+	if (*p++ != '=')
+		return 0;
+	p = get_ident(skip_space(p), port, sizeof(port));
+	p = skip_space(p);
+	if (*p++ != '^')
+		return 0;
+	p = get_ident(skip_space(p), bit, sizeof(bit));
+	p = skip_space(p);
+	if (*p++ != ';')
+		return 0;
+	fprintf(out, "#define %s SIM_SBIT(%s, %s)", name, port, bit);
+	put_code(p);
+	return 1;
+}
+
+/* void NAME(void) interrupt VECTOR rest */
+static int put_interrupt(const char *line)
+{
+	char name[256], vector[256];
+	const char *p = skip_space(line);
+	const char *q;
+
+	if (strncmp(p, "void", 4) || is_ident(p[4]))
+		return 0;
+	p = get_ident(skip_space(p + 4), name, sizeof(name));
+	p = skip_space(p);
+	if (strncmp(p, "(void)", 6))
+		return 0;
+	q = skip_space(p + 6);
+	if (strncmp(q, "interrupt", 9) || is_ident(q[9]))
+		return 0;
+	q = get_ident(skip_space(q + 9), vector, sizeof(vector));
+	fwrite(line, 1, skip_space(line) - line, out);
+	fprintf(out, "SIM_INTERRUPT(%s, %s) void %s(void)", vector, name, name);
+	put_code(q);
+	return 1;
+}
+
+static int put_include(char *line)
+{
+	char *p = (char *) skip_space(line);
+
+	if (*p != '#')
+		return 0;
+	p = (char *) skip_space(p + 1);
+	if (strncmp(p, "include", 7))
+		return 0;
+	for (; *p; p++)
+		if (*p == '\\')
+			*p = '/';
+	fputs(line, out);
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	FILE *in;
+	char line[MAX_LINE];
+	int lineno = 0;
+
+	if (argc < 3 || argc > 4) {
+		fprintf(stderr, "usage: keil2c <in> <out> [hooks.h]\n");
+		return 2;
+	}
+	in = fopen(argv[1], "rb");
+	if (!in) {
+		perror(argv[1]);
+		return 1;
+	}
+	out = fopen(argv[2], "wb");
+	if (!out) {
+		perror(argv[2]);
+		return 1;
+	}
+	fprintf(out, "#line 1 \"%s\"\n", argv[1]);
+	while (fgets(line, sizeof(line), in)) {
+		size_t len = strlen(line);
+
+		lineno++;
+		while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = 0;
+		if (in_comment || !(put_sbit(line) || put_interrupt(line) || put_include(line)))
+			put_code(line);
+		fputc('\n', out);
+		if (argc == 4 && !in_comment && strstr(line, "#include") && strstr(line, "ds1820.h\""))
+			fprintf(out, "#include \"%s\"\n#line %d\n", argv[3], lineno + 1);
+	}
+	fclose(in);
+	return fclose(out) ? 1 : 0;
+}
@@ -0,0 +1,60 @@
+/*
+ * reg167.h for the host build: the C167CR special function registers used
+ * by the firmware, held by the simulator in sim.c.  Every access lets the
+ * simulated time run on, so that the timers count and interrupts are taken
+ * while the firmware polls a register.
+ */
+
+#ifndef REG167_H
+#define REG167_H
+
+#include "sim.h"
+
+#define P2      (*sim_sfr(SIM_P2))
+#define DP2     (*sim_sfr(SIM_DP2))
+#define P3      (*sim_sfr(SIM_P3))
+#define DP3     (*sim_sfr(SIM_DP3))
+#define P4      (*sim_sfr(SIM_P4))
+#define DP4     (*sim_sfr(SIM_DP4))
+#define P7      (*sim_sfr(SIM_P7))
+#define DP7     (*sim_sfr(SIM_DP7))
+#define P8      (*sim_sfr(SIM_P8))
+#define DP8     (*sim_sfr(SIM_DP8))
+#define T2      (*sim_sfr(SIM_T2))
+#define T3      (*sim_sfr(SIM_T3))
+#define T4      (*sim_sfr(SIM_T4))
+#define T2CON   (*sim_sfr(SIM_T2CON))
+#define T3CON   (*sim_sfr(SIM_T3CON))
+#define T4CON   (*sim_sfr(SIM_T4CON))
+#define CCM0    (*sim_sfr(SIM_CCM0))
+#define CCM4    (*sim_sfr(SIM_CCM4))
+#define CC3     (*sim_sfr(SIM_CC3))
+#define PSW     (*sim_sfr(SIM_PSW))
+#define T2IC    (*sim_sfr(SIM_T2IC))
+#define T3IC    (*sim_sfr(SIM_T3IC))
+#define T4IC    (*sim_sfr(SIM_T4IC))
+#define CC3IC   (*sim_sfr(SIM_CC3IC))
+#define CC16IC  (*sim_sfr(SIM_CC16IC))
+#define ADCIC   (*sim_sfr(SIM_ADCIC))
+#define XP0IC   (*sim_sfr(SIM_XP0IC))
+
+#define IEN     SIM_SBIT(PSW, 11)
+#define T2R     SIM_SBIT(T2CON, 6)
+#define T3R     SIM_SBIT(T3CON, 6)
+#define T4R     SIM_SBIT(T4CON, 6)
+#define T2IR    SIM_SBIT(T2IC, 7)
+#define T2IE    SIM_SBIT(T2IC, 6)
+#define T3IR    SIM_SBIT(T3IC, 7)
+#define T3IE    SIM_SBIT(T3IC, 6)
+#define T4IR    SIM_SBIT(T4IC, 7)
+#define T4IE    SIM_SBIT(T4IC, 6)
+#define CC3IR   SIM_SBIT(CC3IC, 7)
+#define CC3IE   SIM_SBIT(CC3IC, 6)
+#define CC16IR  SIM_SBIT(CC16IC, 7)
+#define CC16IE  SIM_SBIT(CC16IC, 6)
+#define ADCIR   SIM_SBIT(ADCIC, 7)
+#define ADCIE   SIM_SBIT(ADCIC, 6)
+#define XP0IR   SIM_SBIT(XP0IC, 7)
+#define XP0IE   SIM_SBIT(XP0IC, 6)
+
+#endif /* REG167_H */
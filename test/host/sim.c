@@ -0,0 +1,533 @@
+/*
+ * The simulated C167CR: registers, ports, timers T2 to T4, the interrupt
+ * controller and the coroutine which runs the firmware's main().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+
+#include "sim_dev.h"
+
+#define ISR_CYCLES      20          /* interrupt entry and return */
+#define MAIN_STACK      (1 << 20)
+
+sim_time_t sim_now;
+sim_time_t sim_busy[16];
+unsigned long sim_traps;
+
+static volatile unsigned short sfr[SIM_NUM_SFRS];
+static unsigned cpu_level;
+static unsigned long taken;         /* interrupts taken */
+static unsigned long accesses;      /* register accesses by the firmware */
+static unsigned long spin_accesses; /* accesses at the last sim_spin() */
+static int last_sfr;                /* register of the last access */
+
+/*
+ * Ports.  The port register holds what the firmware reads: the latch where
+ * the pin is an output, the outside level where it is an input.  Whatever
+ * the firmware leaves there goes to the latch, so the latch of an input pin
+ * follows the pin until the firmware writes something else to it.  (A write
+ * of the level the pin already has can't be told from no write at all.)
+ */
+static const struct {
+    int reg, dir;
+} ports[] = {
+    { SIM_P2, SIM_DP2 }, { SIM_P3, SIM_DP3 }, { SIM_P4, SIM_DP4 }, { SIM_P7, SIM_DP7 }, { SIM_P8, SIM_DP8 }
+};
+#define NUM_PORTS (sizeof(ports) / sizeof(ports[0]))
+
+static unsigned short port_latch[NUM_PORTS], port_out[NUM_PORTS], port_dir[NUM_PORTS];
+static unsigned short input_value[NUM_PORTS];
+static unsigned node_address;
+
+/* Timers T2 to T4 */
+static const struct {
+    int reg, con, ic;
+} timers[] = {
+    { SIM_T2, SIM_T2CON, SIM_T2IC }, { SIM_T3, SIM_T3CON, SIM_T3IC }, { SIM_T4, SIM_T4CON, SIM_T4IC }
+};
+#define NUM_TIMERS 3
+
+static unsigned prescaled[NUM_TIMERS];
+
+/* Interrupt sources, by vector */
+static const struct {
+    unsigned vector;
+    int ic;
+} sources[] = {
+    { 0x13, SIM_CC3IC }, { 0x22, SIM_T2IC }, { 0x23, SIM_T3IC }, { 0x24, SIM_T4IC },
+    { 0x28, SIM_ADCIC }, { 0x30, SIM_CC16IC }, { 0x40, SIM_XP0IC }
+};
+#define NUM_SOURCES (sizeof(sources) / sizeof(sources[0]))
+
+static void (*vectors[0x80])(void);
+static int can_line;
+
+/* main() of the firmware as a coroutine */
+static ucontext_t test_context, main_context;
+static void *main_stack;
+static void (*main_function)(void);
+static int main_started, main_done, in_main;
+static sim_time_t run_until;
+
+static int port_index(int reg)
+{
+    unsigned i;
+
+    for (i = 0; i < NUM_PORTS; i++)
+        if (ports[i].reg == reg)
+            return i;
+    fprintf(stderr, "sim: no port register %d\n", reg);
+    abort();
+}
+
+/* Level of the port pins seen from outside the CPU */
+static unsigned outside(unsigned i)
+{
+    unsigned level = input_value[i];
+
+    switch (ports[i].reg) {
+    case SIM_P2:
+        level = (level & ~0x006C) | (arcom_p2() & 0x006C);
+        break;
+    case SIM_P3:
+        level = (level & ~0x007F) | (node_address << 1) | (ow_line() ? 1 : 0);
+        break;
+    case SIM_P7:
+        level = arcom_p7();
+        break;
+    }
+    return level;
+}
+
+unsigned sim_port_out(int reg)
+{
+    return port_out[port_index(reg)];
+}
+
+unsigned sim_port_dir(int reg)
+{
+    return port_dir[port_index(reg)];
+}
+
+unsigned sim_pins(int reg)
+{
+    unsigned i = port_index(reg);
+    unsigned dir = sfr[ports[i].dir];
+    unsigned pins = (port_latch[i] & dir) | (outside(i) & ~dir);
+
+    /* The 1-Wire line is open drain */
+    if (ports[i].reg == SIM_P3)
+        pins = (pins & ~1) | (ow_line() ? 1 : 0);
+    return pins & 0xFFFF;
+}
+
+/* Take the firmware's writes to the ports and the CAN controller, then show it the pins */
+static void sync(void)
+{
+    unsigned i;
+    int p2p7 = 0, p3 = 0;
+
+    for (i = 0; i < NUM_PORTS; i++) {
+        unsigned short out, dir = sfr[ports[i].dir];
+
+        port_latch[i] = sfr[ports[i].reg];
+        out = port_latch[i] & dir;
+        if (out != port_out[i] || dir != port_dir[i]) {
+            port_out[i] = out;
+            port_dir[i] = dir;
+            if (ports[i].reg == SIM_P2 || ports[i].reg == SIM_P7)
+                p2p7 = 1;
+            if (ports[i].reg == SIM_P3)
+                p3 = 1;
+        }
+    }
+    if (p2p7)
+        arcom_port();
+    if (p3)
+        ow_port();
+    can_sync();
+
+    for (i = 0; i < NUM_PORTS; i++)
+        sfr[ports[i].reg] = sim_pins(ports[i].reg);
+}
+
+/* The 82527 requests an interrupt on XP0 when C1IR becomes nonzero */
+void sim_can_irq_line(int level)
+{
+    if (level && !can_line)
+        sfr[SIM_XP0IC] |= 0x80;
+    can_line = level;
+}
+
+void sim_cc3_edge(int rising)
+{
+    unsigned mode = (sfr[SIM_CCM0] >> 12) & 7;
+
+    if ((mode == 1 && rising) || (mode == 2 && !rising) || mode == 3)
+        sfr[SIM_CC3IC] |= 0x80;
+}
+
+static void run_timers(sim_time_t cycles)
+{
+    unsigned i;
+
+    for (i = 0; i < NUM_TIMERS; i++) {
+        unsigned con = sfr[timers[i].con];
+        unsigned long long ticks, prescale;
+
+        if (!(con & 0x0040))
+            continue;
+        if (con & 0x00B8) {
+            fprintf(stderr, "sim: T%uCON 0x%04X: only timer mode counting up is simulated\n", i + 2, con);
+            abort();
+        }
+        prescale = 8ULL << (con & 7);
+        ticks = (prescaled[i] + cycles) / prescale;
+        prescaled[i] = (prescaled[i] + cycles) % prescale;
+        if (ticks) {
+            ticks += sfr[timers[i].reg];
+            if (ticks > 0xFFFF)
+                sfr[timers[i].ic] |= 0x80;
+            sfr[timers[i].reg] = (unsigned short) ticks;
+        }
+    }
+}
+
+static sim_time_t next_timer(void)
+{
+    sim_time_t next = SIM_NEVER, t;
+    unsigned i;
+
+    for (i = 0; i < NUM_TIMERS; i++) {
+        unsigned con = sfr[timers[i].con];
+
+        if (!(con & 0x0040))
+            continue;
+        t = sim_now + (0x10000ULL - sfr[timers[i].reg]) * (8ULL << (con & 7)) - prescaled[i];
+        if (t < next)
+            next = t;
+    }
+    return next;
+}
+
+static sim_time_t next_event(void)
+{
+    sim_time_t next = next_timer(), t;
+
+    if ((t = can_next()) < next)
+        next = t;
+    if ((t = arcom_next()) < next)
+        next = t;
+    if ((t = ow_next()) < next)
+        next = t;
+    return next;
+}
+
+static void tick(void)
+{
+    can_tick();
+    arcom_tick();
+    ow_tick();
+}
+
+/* Let time run on, the devices with it, from one of their events to the next */
+static void run(sim_time_t cycles)
+{
+    sim_time_t end = sim_now + cycles, next;
+
+    for (;;) {
+        tick();
+        if (sim_now >= end)
+            return;
+        next = next_event();
+        if (next > end)
+            next = end;
+        if (next <= sim_now)
+            next = sim_now + 1;
+        run_timers(next - sim_now);
+        sim_now = next;
+    }
+}
+
+/* Take the highest interrupt above the CPU level, and the ones which come up meanwhile */
+static void dispatch(void)
+{
+    for (;;) {
+        unsigned i, ic, level, saved_level;
+        unsigned short saved_psw;
+        int best = -1, best_priority = -1;
+
+        if (!(sfr[SIM_PSW] & 0x0800))
+            return;
+        for (i = 0; i < NUM_SOURCES; i++) {
+            ic = sfr[sources[i].ic];
+            if ((ic & 0xC0) != 0xC0 || ((ic >> 2) & 15) <= cpu_level)
+                continue;
+            if ((int) (ic & 0x3F) > best_priority) {
+                best_priority = ic & 0x3F;
+                best = i;
+            }
+        }
+        if (best < 0)
+            return;
+
+        sfr[sources[best].ic] &= ~0x80;
+        if (!vectors[sources[best].vector]) {
+            fprintf(stderr, "sim: no handler for interrupt 0x%02X\n", sources[best].vector);
+            abort();
+        }
+        level = (best_priority >> 2) & 15;
+        saved_level = cpu_level;
+        saved_psw = sfr[SIM_PSW];
+        cpu_level = level;
+        taken++;
+        sim_busy[level] += ISR_CYCLES;
+        run(ISR_CYCLES);
+        vectors[sources[best].vector]();
+        sync();
+        cpu_level = saved_level;
+        sfr[SIM_PSW] = saved_psw;
+    }
+}
+
+/* Back to the test once main() has run for the time asked */
+static void yield(void)
+{
+    if (in_main && cpu_level == 0 && sim_now >= run_until) {
+        in_main = 0;
+        swapcontext(&main_context, &test_context);
+        in_main = 1;
+    }
+}
+
+void sim_step(unsigned cycles)
+{
+    sync();
+    sim_busy[cpu_level] += cycles;
+    run(cycles);
+    sync();
+    dispatch();
+    yield();
+}
+
+volatile unsigned short *sim_sfr(int id)
+{
+    if (id < 0 || id >= SIM_NUM_SFRS)
+        abort();
+    accesses++;
+    last_sfr = id;
+    sim_step(SIM_ACCESS_CYCLES);
+    return &sfr[id];
+}
+
+/* Wait for the next device or timer event, at most until limit */
+static void wait_event(sim_time_t limit, int busy)
+{
+    sim_time_t next = next_event();
+
+    if (next > limit)
+        next = limit;
+    if (next > sim_now + SIM_US(1000))
+        next = sim_now + SIM_US(1000);
+    if (next <= sim_now)
+        next = sim_now + 1;
+    sync();
+    if (busy)
+        sim_busy[cpu_level] += next - sim_now;
+    run(next - sim_now);
+    sync();
+    dispatch();
+}
+
+static int interrupt_requested(void)
+{
+    unsigned i;
+
+    for (i = 0; i < NUM_SOURCES; i++)
+        if ((sfr[sources[i].ic] & 0xC0) == 0xC0)
+            return 1;
+    return 0;
+}
+
+void sim_idle(void)
+{
+    unsigned long before = taken;
+    sim_time_t give_up = sim_now + SIM_US(10000000);
+
+    while (taken == before && !interrupt_requested()) {
+        if (sim_now >= give_up) {
+            fprintf(stderr, "sim: idle for 10 s at level %u\n", cpu_level);
+            abort();
+        }
+        wait_event(in_main && cpu_level == 0 ? run_until : SIM_NEVER, 0);
+        yield();
+    }
+}
+
+/* The running timer whose register was accessed last, or -1 */
+static int polled_timer(void)
+{
+    unsigned i;
+
+    for (i = 0; i < NUM_TIMERS; i++)
+        if (timers[i].reg == last_sfr && (sfr[timers[i].con] & 0x0040))
+            return i;
+    return -1;
+}
+
+/*
+ * A loop which polls a register takes its time with the accesses.  One
+ * which only watches memory waits for the next event, when an interrupt
+ * handler may change it.  One which reads nothing but a running timer
+ * sees the same count until the timer counts again: it waits for that, or
+ * for an earlier event, as the accesses would have.
+ */
+void sim_spin(void)
+{
+    sim_time_t limit = in_main && cpu_level == 0 ? run_until : SIM_NEVER, tick;
+    int timer = accesses == spin_accesses + 1 ? polled_timer() : -1;
+
+    if (accesses != spin_accesses) {
+        spin_accesses = accesses;
+        if (timer < 0)
+            return;
+        tick = sim_now + (8ULL << (sfr[timers[timer].con] & 7)) - prescaled[timer];
+        if (tick < limit)
+            limit = tick;
+    }
+    wait_event(limit, 1);
+    yield();
+}
+
+void sim_vector(unsigned vector, void (*isr)(void))
+{
+    if (vector >= 0x80)
+        abort();
+    vectors[vector] = isr;
+}
+
+void sim_trap(unsigned n)
+{
+    (void) n;
+    sim_traps++;
+}
+
+volatile void *sim_xreg(unsigned addr)
+{
+    extern unsigned char sim_can_registers[256];
+
+    if (addr < 0xEF00 || addr > 0xEFFF) {
+        fprintf(stderr, "sim: no register at 0x%04X\n", addr);
+        abort();
+    }
+    accesses++;
+    sim_step(SIM_ACCESS_CYCLES);
+    can_access(addr);
+    return &sim_can_registers[addr - 0xEF00];
+}
+
+unsigned sim_level(void)
+{
+    return cpu_level;
+}
+
+void sim_at_level(unsigned level, void (*fn)(void))
+{
+    unsigned saved_level = cpu_level;
+    unsigned short saved_psw = sfr[SIM_PSW];
+
+    cpu_level = level;
+    fn();
+    sync();
+    cpu_level = saved_level;
+    sfr[SIM_PSW] = saved_psw;
+    dispatch();
+}
+
+void sim_set_input(int reg, unsigned mask, unsigned value)
+{
+    unsigned i = port_index(reg);
+
+    input_value[i] = (input_value[i] & ~mask) | (value & mask);
+    sync();
+}
+
+void sim_set_node(unsigned node)
+{
+    node_address = node & 0x3F;
+    sync();
+}
+
+static void main_entry(void)
+{
+    main_function();
+    main_done = 1;
+    in_main = 0;
+}
+
+void sim_start_main(void (*main_fn)(void))
+{
+    main_function = main_fn;
+    if (!main_stack)
+        main_stack = malloc(MAIN_STACK);
+    getcontext(&main_context);
+    main_context.uc_stack.ss_sp = main_stack;
+    main_context.uc_stack.ss_size = MAIN_STACK;
+    main_context.uc_link = &test_context;
+    makecontext(&main_context, main_entry, 0);
+    main_started = 1;
+    main_done = 0;
+}
+
+void sim_run_us(unsigned long us)
+{
+    run_until = sim_now + SIM_US(us);
+    if (main_started && !main_done && cpu_level == 0) {
+        in_main = 1;
+        swapcontext(&test_context, &main_context);
+        in_main = 0;
+    }
+    while (sim_now < run_until)
+        wait_event(run_until, 0);
+}
+
+int sim_run_until(int (*done)(void), unsigned long us)
+{
+    sim_time_t end = sim_now + SIM_US(us);
+
+    while (!done()) {
+        if (sim_now >= end)
+            return 0;
+        sim_run_us(10);
+    }
+    return 1;
+}
+
+void sim_reset(void)
+{
+    unsigned i;
+
+    for (i = 0; i < SIM_NUM_SFRS; i++)
+        sfr[i] = 0;
+    memset(port_latch, 0, sizeof(port_latch));
+    memset(port_out, 0, sizeof(port_out));
+    memset(port_dir, 0, sizeof(port_dir));
+    memset(input_value, 0, sizeof(input_value));
+    memset(prescaled, 0, sizeof(prescaled));
+    memset(sim_busy, 0, sizeof(sim_busy));
+    sim_now = 0;
+    sim_traps = 0;
+    cpu_level = 0;
+    taken = 0;
+    accesses = spin_accesses = 0;
+    can_line = 0;
+    node_address = 0;
+    main_started = main_done = in_main = 0;
+    can_reset();
+    arcom_reset();
+    ow_reset();
+    sync();
+}
@@ -0,0 +1,156 @@
+/*
+ * A simulated C167CR for the host build of the firmware: the special
+ * function registers, timers T2 to T4, the interrupt controller, the 82527
+ * CAN controller with a bus master, the ARCOM Pegasus on the EPP port and
+ * DS1820/DS18B20 sensors on the 1-Wire bus.
+ *
+ * Time is counted in CPU cycles of 50 ns.  The firmware runs on the host
+ * CPU at no cost except where it touches the hardware: every register
+ * access takes SIM_ACCESS_CYCLES, lets the timers and devices run on and
+ * takes any interrupt that is due, at its level, nested as on the C167.
+ * Loops which poll a register therefore take about the time they would on
+ * the target.
+ *
+ * The firmware's main() can be run as a coroutine with sim_start_main();
+ * sim_run_us() then runs it for the given time.  Without it the CPU is idle
+ * at level 0 while time runs, and only the interrupts run.
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+#define SIM_CYCLES_PER_US   20              /* 20 MHz */
+#define SIM_ACCESS_CYCLES   2               /* per register access */
+#define SIM_US(us)          ((sim_time_t) (us) * SIM_CYCLES_PER_US)
+
+typedef unsigned long long sim_time_t;
+
+enum {
+    SIM_P2, SIM_DP2, SIM_P3, SIM_DP3, SIM_P4, SIM_DP4, SIM_P7, SIM_DP7, SIM_P8, SIM_DP8,
+    SIM_T2, SIM_T3, SIM_T4, SIM_T2CON, SIM_T3CON, SIM_T4CON,
+    SIM_CCM0, SIM_CCM4, SIM_CC3, SIM_PSW,
+    SIM_T2IC, SIM_T3IC, SIM_T4IC, SIM_CC3IC, SIM_CC16IC, SIM_ADCIC, SIM_XP0IC,
+    SIM_NUM_SFRS
+};
+
+struct sim_bits {
+    unsigned short b0:1, b1:1, b2:1, b3:1, b4:1, b5:1, b6:1, b7:1,
+                   b8:1, b9:1, b10:1, b11:1, b12:1, b13:1, b14:1, b15:1;
+};
+
+/* sbit */
+#define SIM_SBIT(reg, n) (((volatile struct sim_bits *) &(reg))->b##n)
+
+/* void isr(void) interrupt vector */
+#define SIM_INTERRUPT(vector, isr) \
+    void isr(void); \
+    static void __attribute__((constructor)) isr##_vector(void) { sim_vector(vector, isr); }
+
+/*
+ * Firmware side
+ */
+volatile unsigned short *sim_sfr(int sfr);
+volatile void *sim_xreg(unsigned addr);     /* 0xEF00 to 0xEFFF: the CAN controller */
+void sim_vector(unsigned vector, void (*isr)(void));
+void sim_trap(unsigned n);
+void sim_step(unsigned cycles);             /* the CPU is busy for cycles */
+void sim_idle(void);                        /* _idle_(): sleep until an interrupt is taken */
+void sim_spin(void);                        /* one turn of a busy wait loop */
+
+/*
+ * Test side
+ */
+extern sim_time_t sim_now;
+extern sim_time_t sim_busy[16];             /* CPU cycles spent at each interrupt level */
+extern unsigned long sim_traps;
+
+void sim_reset(void);                       /* power up, with the default devices */
+void sim_start_main(void (*main_fn)(void));
+void sim_run_us(unsigned long us);
+int sim_run_until(int (*done)(void), unsigned long us);
+unsigned sim_level(void);
+void sim_at_level(unsigned level, void (*fn)(void));
+void sim_set_input(int port, unsigned mask, unsigned value);
+unsigned sim_pins(int port);                /* the level of the port pins */
+void sim_set_node(unsigned node);           /* the node address on P3.1 to P3.6 */
+
+/*
+ * CAN bus at 1 Mbit/s with a master which sends monitor and control
+ * requests, and logs the frames the node sends.
+ */
+#define SIM_CAN_MAX_LOG 4096
+
+struct sim_can_frame {
+    unsigned long id;
+    unsigned char len;
+    unsigned char data[8];
+    sim_time_t sent;                        /* end of the frame on the bus */
+};
+
+void sim_can_send(unsigned long id, unsigned char len, const unsigned char *data);
+void sim_can_monitor(unsigned long rca);
+void sim_can_control(unsigned long rca, unsigned char len, const unsigned char *data);
+int sim_can_pending(void);                  /* master frames not yet on the bus */
+unsigned long sim_can_base(void);           /* the node's base address */
+unsigned sim_can_frame_us(unsigned char len);
+
+extern struct sim_can_frame sim_can_log[SIM_CAN_MAX_LOG];
+extern unsigned sim_can_logged;
+/* Reply to a monitor request of rca sent at or after from, or 0 */
+const struct sim_can_frame *sim_can_reply(unsigned long rca, unsigned from);
+
+/*
+ * ARCOM Pegasus on the EPP port.  It serves monitor requests from a table
+ * of points, or with the RCA's low bytes for a point not in it, logs the
+ * controls and speaks the legacy or the compact transaction format.
+ */
+#define SIM_ARCOM_MAX_POINTS 64
+#define SIM_ARCOM_MAX_LOG 1024
+
+struct sim_arcom_control {
+    unsigned long rca;
+    unsigned char len;
+    unsigned char data[8];
+};
+
+struct sim_arcom {
+    unsigned strobe_ns;                     /* from NWAIT high to the next strobe */
+    unsigned reply_us;                      /* from a monitor request to the reply */
+    int dead;                               /* no strobes at all */
+    int stall_after;                        /* bytes of a transaction before it stops strobing, or -1 */
+    int old_firmware;                       /* knows only the legacy format and the RCA ranges */
+    int no_confirm;                         /* stops strobing in the transaction which confirms a new format */
+    unsigned long ranges[8];                /* special monitor, special control, monitor, control: low, high */
+    unsigned long transactions, aborted, bytes, errors;
+    unsigned long monitors, controls;
+    unsigned protocol;                      /* formats in use, EPP_PROTOCOL_ bits of main.c */
+    struct sim_arcom_control log[SIM_ARCOM_MAX_LOG];
+    unsigned logged;
+};
+
+extern struct sim_arcom sim_arcom;
+
+void sim_arcom_point(unsigned long rca, unsigned char len, const unsigned char *data);
+void sim_arcom_restart(unsigned long us);   /* hold INIT high for us */
+
+/*
+ * 1-Wire bus on P3.0 with up to SIM_OW_MAX DS1820 or DS18B20 sensors.
+ */
+#define SIM_OW_MAX 4
+
+struct sim_ow_sensor {
+    unsigned char rom[8];
+    int temp16;                             /* temperature in 1/16 degree C */
+    unsigned char resolution;               /* DS18B20: 9 to 12 bits */
+    int corrupt;                            /* send a bad scratchpad CRC */
+};
+
+extern struct sim_ow_sensor sim_ow[SIM_OW_MAX];
+extern unsigned sim_ow_count;               /* sensors on the wire */
+extern unsigned long sim_ow_resets, sim_ow_conversions, sim_ow_copies;
+
+/* Make sensor i a DS1820 (family 0x10) or DS18B20 (0x28) with a serial number, and a valid CRC */
+void sim_ow_sensor(unsigned i, unsigned char family, unsigned long serial, int temp16);
+void sim_ow_power_up(unsigned i);           /* sensor i lost power: its registers come back from EEPROM */
+
+#endif /* SIM_H */
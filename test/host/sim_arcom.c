@@ -0,0 +1,385 @@
+/*
+ * The ARCOM Pegasus board on the EPP port, as the FEMC firmware sees it.
+ *
+ * It starts a byte by pulling nDataStrobe (P2.3) low and ends it when the
+ * AMBSI raises NWAIT (P2.8): it takes the byte on P7 then, or has put its own
+ * byte on P7 before the strobe.  EPPS_INTERRUPT (P2.7) high starts a
+ * transaction, and low ends it, complete or not.  INIT (P2.5) is high while
+ * the board restarts.
+ *
+ * A control at EPP_PROTOCOL_RCA selects the transaction format from the
+ * next transaction on.  That one must be a monitor request at the same RCA,
+ * which confirms the format, or the board goes back to the old one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim_dev.h"
+
+/* From main.c */
+#define GET_ARCOM_VERSION_INFO      0x20002UL
+#define GET_SPECIAL_MONITOR_RCAS    0x20003UL
+#define GET_CONTROL_RCAS            0x20006UL
+#define EPP_PROTOCOL_RCA            0x2003EUL
+
+#define EPP_PROTOCOL_LEN            4
+#define EPP_PROTOCOL_MAGIC0         0x45
+#define EPP_PROTOCOL_MAGIC1         0x50
+#define EPP_PROTOCOL_VERSION        1
+
+#define EPP_PROTOCOL_LEGACY         0x00
+#define EPP_PROTOCOL_COMPACT        0x01
+#define EPP_PROTOCOL_BLOCK          0x02
+
+#define EPP_COMPACT_FULL            0x00
+#define EPP_COMPACT_PAGE            0x40
+#define EPP_COMPACT_BLOCK           0x80
+
+#define P2_NWRITE                   0x0004
+#define P2_NDATASTROBE              0x0008
+#define P2_INIT                     0x0020
+#define P2_INTERRUPT                0x0080
+#define P2_NWAIT                    0x0100
+
+struct sim_arcom sim_arcom;
+
+enum { IDLE, READ, WRITE, DONE };
+
+static struct {
+    unsigned long rca;
+    unsigned char len;
+    unsigned char data[8];
+} points[SIM_ARCOM_MAX_POINTS];
+static unsigned num_points;
+
+static int phase;
+static int strobe_low, interrupt_high, nwait_high;
+static sim_time_t strobe_at, init_until;
+static unsigned char p7_out;
+
+static unsigned char in[64];                /* bytes from the AMBSI in this transaction */
+static unsigned nin;
+static unsigned char out[128];              /* reply */
+static unsigned nout, sent;
+static unsigned tx_bytes;                   /* bytes of this transaction */
+static unsigned page;
+static int page_valid;
+static int switch_to;                       /* protocol once the transaction completes, or -1 */
+static int confirming;                      /* the next transaction must confirm the protocol */
+static unsigned previous;                   /* protocol to go back to if it doesn't */
+static int confirmed;                       /* this transaction asked for EPP_PROTOCOL_RCA */
+
+void sim_arcom_point(unsigned long rca, unsigned char len, const unsigned char *data)
+{
+    unsigned i;
+
+    for (i = 0; i < num_points && points[i].rca != rca; i++)
+        ;
+    if (i == SIM_ARCOM_MAX_POINTS)
+        abort();
+    if (i == num_points)
+        num_points++;
+    points[i].rca = rca;
+    points[i].len = len;
+    memcpy(points[i].data, data, len);
+}
+
+/* Append the reply to a monitor request of rca: payload size then payload */
+static void reply(unsigned long rca)
+{
+    unsigned i, k;
+
+    sim_arcom.monitors++;
+    if (rca >= GET_SPECIAL_MONITOR_RCAS && rca <= GET_CONTROL_RCAS) {
+        unsigned long low = sim_arcom.ranges[2 * (rca - GET_SPECIAL_MONITOR_RCAS)];
+        unsigned long high = sim_arcom.ranges[2 * (rca - GET_SPECIAL_MONITOR_RCAS) + 1];
+
+        out[nout++] = 8;
+        for (k = 0; k < 4; k++)
+            out[nout++] = (unsigned char) (low >> (8 * k));
+        for (k = 0; k < 4; k++)
+            out[nout++] = (unsigned char) (high >> (8 * k));
+        return;
+    }
+    for (i = 0; i < num_points; i++) {
+        if (points[i].rca == rca) {
+            out[nout++] = points[i].len;
+            for (k = 0; k < points[i].len; k++)
+                out[nout++] = points[i].data[k];
+            return;
+        }
+    }
+    if (rca == EPP_PROTOCOL_RCA && !sim_arcom.old_firmware) {
+        out[nout++] = EPP_PROTOCOL_LEN;
+        out[nout++] = EPP_PROTOCOL_MAGIC0;
+        out[nout++] = EPP_PROTOCOL_MAGIC1;
+        out[nout++] = EPP_PROTOCOL_VERSION;
+        out[nout++] = EPP_PROTOCOL_COMPACT | EPP_PROTOCOL_BLOCK;
+        confirmed = 1;
+        return;
+    }
+    if (rca == GET_ARCOM_VERSION_INFO) {
+        out[nout++] = 3;
+        out[nout++] = 1;
+        out[nout++] = 2;
+        out[nout++] = 3;
+        return;
+    }
+    if (rca >= 0x20000UL && rca < 0x20040UL) {
+        /* A special RCA it doesn't serve */
+        out[nout++] = 0;
+        return;
+    }
+    out[nout++] = 4;
+    out[nout++] = (unsigned char) rca;
+    out[nout++] = (unsigned char) (rca >> 8);
+    out[nout++] = (unsigned char) (rca >> 16);
+    out[nout++] = 0xA5;
+}
+
+static void control(unsigned long rca, unsigned char len, const unsigned char *data)
+{
+    struct sim_arcom_control *c;
+
+    sim_arcom.controls++;
+    if (sim_arcom.logged < SIM_ARCOM_MAX_LOG) {
+        c = &sim_arcom.log[sim_arcom.logged++];
+        c->rca = rca;
+        c->len = len;
+        memcpy(c->data, data, len > 8 ? 8 : len);
+    }
+    if (rca == EPP_PROTOCOL_RCA && len == EPP_PROTOCOL_LEN && data[0] == EPP_PROTOCOL_MAGIC0 &&
+        data[1] == EPP_PROTOCOL_MAGIC1 && data[2] == EPP_PROTOCOL_VERSION && !sim_arcom.old_firmware)
+        switch_to = data[3] & (EPP_PROTOCOL_COMPACT | EPP_PROTOCOL_BLOCK);
+}
+
+/* The header and payload so far: how many bytes the transaction needs from the AMBSI, 0 once they are in */
+static unsigned header(unsigned long *rca, unsigned *len)
+{
+    unsigned descriptor, count, k;
+
+    if (!(sim_arcom.protocol & EPP_PROTOCOL_COMPACT)) {
+        if (nin < 5)
+            return 5;
+        *rca = in[0] | ((unsigned long) in[1] << 8) | ((unsigned long) in[2] << 16) | ((unsigned long) in[3] << 24);
+        *len = in[4];
+        return 5 + *len;
+    }
+
+    if (nin < 1)
+        return 1;
+    descriptor = in[0];
+    switch (descriptor & 0xC0) {
+    case EPP_COMPACT_FULL:
+        if (nin < 3)
+            return 3;
+        *rca = ((unsigned long) (descriptor & 0x30) << 12) | ((unsigned long) in[1] << 8) | in[2];
+        *len = descriptor & 0x0F;
+        if (nin == 3) {
+            page = (unsigned) (*rca >> 8);
+            page_valid = 1;
+        }
+        return 3 + *len;
+    case EPP_COMPACT_PAGE:
+        if (nin < 2)
+            return 2;
+        if (nin == 2 && (!page_valid || ((page >> 8) & 3) != ((descriptor >> 4) & 3)))
+            sim_arcom.errors++;
+        *rca = ((unsigned long) page << 8) | in[1];
+        *len = descriptor & 0x0F;
+        return 2 + *len;
+    case EPP_COMPACT_BLOCK:
+        count = descriptor & 0x0F;
+        if (!count || !(sim_arcom.protocol & EPP_PROTOCOL_BLOCK))
+            sim_arcom.errors++;
+        if (nin < 1 + 3 * count)
+            return 1 + 3 * count;
+        for (k = 0; k < count; k++)
+            reply(((unsigned long) (in[1 + 3 * k] & 3) << 16) | ((unsigned long) in[2 + 3 * k] << 8) | in[3 + 3 * k]);
+        *len = 0;
+        return 0;
+    default:
+        sim_arcom.errors++;
+        *len = 0;
+        return 0;
+    }
+}
+
+static int stalled(void)
+{
+    return sim_arcom.dead || init_until > sim_now || (confirming && sim_arcom.no_confirm) ||
+           (sim_arcom.stall_after >= 0 && tx_bytes >= (unsigned) sim_arcom.stall_after);
+}
+
+static void next_strobe(sim_time_t delay)
+{
+    strobe_at = stalled() ? SIM_NEVER : sim_now + delay;
+}
+
+/* A byte has come in: ask for the next one, reply or finish */
+static void received(void)
+{
+    unsigned long rca = 0;
+    unsigned len = 0;
+    unsigned total = header(&rca, &len);
+
+    if (nin < total) {
+        next_strobe(SIM_US(sim_arcom.strobe_ns) / 1000);
+        return;
+    }
+    if ((in[0] & 0xC0) == EPP_COMPACT_BLOCK && (sim_arcom.protocol & EPP_PROTOCOL_COMPACT)) {
+        /* Replies built by header() */
+    } else if (len == 0)
+        reply(rca);
+    else
+        control(rca, len, in + nin - len);
+
+    if (nout) {
+        phase = WRITE;
+        sent = 0;
+        p7_out = out[0];
+        next_strobe(SIM_US(sim_arcom.reply_us));
+    } else {
+        phase = DONE;
+        strobe_at = SIM_NEVER;
+    }
+}
+
+static void strobe(int low)
+{
+    if (low == strobe_low)
+        return;
+    strobe_low = low;
+    sim_cc3_edge(!low);
+}
+
+void arcom_port(void)
+{
+    unsigned p2 = sim_port_out(SIM_P2);
+    int interrupt = (p2 & P2_INTERRUPT) != 0;
+    int nwait = (p2 & P2_NWAIT) != 0;
+
+    if (interrupt && !interrupt_high) {
+        /* A transaction starts */
+        phase = READ;
+        nin = nout = sent = tx_bytes = 0;
+        switch_to = -1;
+        confirmed = 0;
+        next_strobe(SIM_US(sim_arcom.strobe_ns) / 1000);
+    } else if (!interrupt && interrupt_high) {
+        if (phase == DONE) {
+            sim_arcom.transactions++;
+            if (confirming && !confirmed)
+                sim_arcom.protocol = previous;
+            confirming = 0;
+            if (switch_to >= 0) {
+                previous = sim_arcom.protocol;
+                sim_arcom.protocol = switch_to;
+                confirming = 1;
+                page_valid = 0;
+            }
+        } else if (phase != IDLE) {
+            sim_arcom.aborted++;
+            page_valid = 0;
+            if (confirming)
+                sim_arcom.protocol = previous;
+            confirming = 0;
+        }
+        phase = IDLE;
+        strobe_at = SIM_NEVER;
+        strobe(0);
+    }
+    interrupt_high = interrupt;
+
+    if (nwait && !nwait_high && strobe_low && interrupt_high) {
+        /* The AMBSI is done with this byte */
+        strobe(0);
+        tx_bytes++;
+        sim_arcom.bytes++;
+        if (phase == READ) {
+            if (nin < sizeof(in))
+                in[nin++] = (unsigned char) sim_port_out(SIM_P7);
+            received();
+        } else if (phase == WRITE) {
+            if (++sent < nout) {
+                p7_out = out[sent];
+                next_strobe(SIM_US(sim_arcom.strobe_ns) / 1000);
+            } else {
+                phase = DONE;
+                strobe_at = SIM_NEVER;
+            }
+        }
+    }
+    nwait_high = nwait;
+}
+
+void arcom_tick(void)
+{
+    if (strobe_at <= sim_now) {
+        strobe_at = SIM_NEVER;
+        if (interrupt_high && !stalled())
+            strobe(1);
+    }
+}
+
+sim_time_t arcom_next(void)
+{
+    if (init_until > sim_now)
+        return init_until;
+    return strobe_at;
+}
+
+unsigned arcom_p2(void)
+{
+    unsigned p2 = 0;
+
+    if (phase != WRITE)
+        p2 |= P2_NWRITE;
+    if (!strobe_low)
+        p2 |= P2_NDATASTROBE;
+    if (init_until > sim_now)
+        p2 |= P2_INIT;
+    return p2;
+}
+
+unsigned arcom_p7(void)
+{
+    return p7_out;
+}
+
+void sim_arcom_restart(unsigned long us)
+{
+    init_until = sim_now + SIM_US(us);
+    sim_arcom.protocol = EPP_PROTOCOL_LEGACY;
+    page_valid = 0;
+    confirming = 0;
+    strobe_at = SIM_NEVER;
+    strobe(0);
+}
+
+void arcom_reset(void)
+{
+    memset(&sim_arcom, 0, sizeof(sim_arcom));
+    sim_arcom.strobe_ns = 1000;
+    sim_arcom.reply_us = 5;
+    sim_arcom.stall_after = -1;
+    sim_arcom.ranges[0] = 0x20000UL;        /* special monitor */
+    sim_arcom.ranges[1] = 0x20FFFUL;
+    sim_arcom.ranges[2] = 0x21000UL;        /* special control */
+    sim_arcom.ranges[3] = 0x21FFFUL;
+    sim_arcom.ranges[4] = 0x00001UL;        /* monitor */
+    sim_arcom.ranges[5] = 0x0FFFFUL;
+    sim_arcom.ranges[6] = 0x10000UL;        /* control */
+    sim_arcom.ranges[7] = 0x1FFFFUL;
+    num_points = 0;
+    phase = IDLE;
+    strobe_low = interrupt_high = nwait_high = 0;
+    strobe_at = SIM_NEVER;
+    init_until = 0;
+    p7_out = 0;
+    page_valid = 0;
+    switch_to = -1;
+    confirming = 0;
+}
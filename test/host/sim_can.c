@@ -0,0 +1,374 @@
+/*
+ * The on-chip 82527 CAN controller of the C167CR, on a 1 Mbit/s bus with a
+ * master.  Message objects take the commands written to their control
+ * registers, receive data frames in the lowest numbered matching object, and
+ * transmit from the lowest numbered object with TXRQ set.  Object 15 has two
+ * buffers.  Remote frames and bus errors are not simulated.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim_dev.h"
+
+unsigned char sim_can_registers[256];
+
+#define REG16(offset)   (*(unsigned short *) &sim_can_registers[offset])
+#define CSR             REG16(0x00)
+#define IR              REG16(0x02)
+#define UGML            REG16(0x08)
+#define LGML            REG16(0x0A)
+#define UMLM            REG16(0x0C)
+#define LMLM            REG16(0x0E)
+#define OBJ(n)          (0x10 + 0x10 * (n))
+#define MCR(n)          REG16(OBJ(n))
+#define UAR(n)          REG16(OBJ(n) + 2)
+#define LAR(n)          REG16(OBJ(n) + 4)
+#define MCFG(n)         sim_can_registers[OBJ(n) + 6]
+#define DATA(n)         (&sim_can_registers[OBJ(n) + 7])
+
+#define NUM_OBJECTS     15
+
+/* Bit pairs of the message control register, 10 is set and 01 reset */
+#define INTPND          0
+#define RXIE            2
+#define TXIE            4
+#define MSGVAL          6
+#define NEWDAT          8
+#define MSGLST          10      /* CPUUPD in transmit objects */
+#define CPUUPD          10
+#define TXRQ            12
+#define RMTPND          14
+
+#define CSR_INIT        0x0001
+#define CSR_IE          0x0002
+#define CSR_SIE         0x0004
+#define CSR_TXOK        0x0800
+#define CSR_RXOK        0x1000
+
+#define MASTER_QUEUE    1024
+
+struct frame {
+    unsigned long id;
+    unsigned char len;
+    unsigned char data[8];
+};
+
+struct sim_can_frame sim_can_log[SIM_CAN_MAX_LOG];
+unsigned sim_can_logged;
+
+static unsigned short mcr[NUM_OBJECTS];         /* state after the last command */
+static struct frame shadow;                     /* second buffer of object 15 */
+static int shadow_full;
+static int status_pending;
+
+static struct frame master[MASTER_QUEUE];
+static unsigned master_head, master_tail;
+
+static int busy;                                /* a frame is on the bus */
+static sim_time_t busy_until;
+static struct frame on_bus;
+static int on_bus_object;                       /* sender, -1 for the master */
+
+static int is_set(unsigned short v, int pair)
+{
+    return ((v >> pair) & 3) == 2;
+}
+
+static unsigned short set(unsigned short v, int pair, int on)
+{
+    return (v & ~(3 << pair)) | ((on ? 2 : 1) << pair);
+}
+
+/* Apply a command to the state: only the pairs written as 10 or 01 change */
+static unsigned short command(unsigned short state, unsigned short cmd)
+{
+    int pair;
+
+    for (pair = 0; pair < 16; pair += 2) {
+        unsigned v = (cmd >> pair) & 3;
+
+        if (v == 1 || v == 2)
+            state = (state & ~(3 << pair)) | (v << pair);
+    }
+    return state;
+}
+
+unsigned sim_can_frame_us(unsigned char len)
+{
+    /* Extended data frame and interframe space, with some stuff bits */
+    return 67 + 8 * len + (54 + 8 * len) / 10;
+}
+
+unsigned long sim_can_base(void)
+{
+    return ((unsigned long) ((sim_pins(SIM_P3) & 0x7E) >> 1) + 1) * 0x40000;
+}
+
+static void id_to_arb(unsigned long id, unsigned short *uar, unsigned short *lar)
+{
+    *lar = (unsigned short) (((id & 0x1F) << 11) | ((id & 0x1FE0) >> 5));
+    *uar = (unsigned short) (((id & 0x1FE000) >> 5) | ((id & 0x1FE00000) >> 21));
+}
+
+static unsigned long arb_to_id(unsigned short uar, unsigned short lar)
+{
+    return ((unsigned long) (lar & 0xF800) >> 11) | ((unsigned long) (lar & 0x00FF) << 5) |
+           ((unsigned long) (uar & 0xFF00) << 5) | ((unsigned long) (uar & 0x00FF) << 21);
+}
+
+static void update_irq(void)
+{
+    int n;
+
+    IR = 0;
+    if (status_pending)
+        IR = 1;
+    else if (is_set(mcr[14], INTPND))
+        IR = 2;
+    else {
+        for (n = 0; n < 14; n++) {
+            if (is_set(mcr[n], INTPND)) {
+                IR = n + 3;
+                break;
+            }
+        }
+    }
+    sim_can_irq_line((CSR & CSR_IE) && IR);
+}
+
+static void store(int n, const struct frame *f)
+{
+    unsigned short uar, lar;
+
+    id_to_arb(f->id, &uar, &lar);
+    if (is_set(mcr[n], NEWDAT))
+        mcr[n] = set(mcr[n], MSGLST, 1);
+    UAR(n) = uar;
+    LAR(n) = lar;
+    MCFG(n) = (MCFG(n) & 0x0F) | (f->len << 4);
+    memcpy(DATA(n), f->data, 8);
+    mcr[n] = set(mcr[n], NEWDAT, 1);
+    if (is_set(mcr[n], RXIE))
+        mcr[n] = set(mcr[n], INTPND, 1);
+    MCR(n) = mcr[n];
+}
+
+static int matches(int n, unsigned short uar, unsigned short lar, unsigned short umask, unsigned short lmask)
+{
+    return is_set(mcr[n], MSGVAL) && !(MCFG(n) & 0x08) && (MCFG(n) & 0x04) &&
+           !((uar ^ UAR(n)) & umask) && !((lar ^ LAR(n)) & lmask & 0xF8FF);
+}
+
+/* A frame from the master has gone through */
+static void receive(const struct frame *f)
+{
+    unsigned short uar, lar;
+    int n;
+
+    if (CSR & CSR_INIT)
+        return;
+    id_to_arb(f->id, &uar, &lar);
+    for (n = 0; n < 14; n++) {
+        if (matches(n, uar, lar, UGML, LGML)) {
+            store(n, f);
+            break;
+        }
+    }
+    if (n == 14 && matches(14, uar, lar, UGML & UMLM, LGML & LMLM)) {
+        if (!is_set(mcr[14], NEWDAT))
+            store(14, f);
+        else {
+            /* The foreground buffer is with the CPU */
+            if (shadow_full) {
+                mcr[14] = set(mcr[14], MSGLST, 1);
+                MCR(14) = mcr[14];
+            }
+            shadow = *f;
+            shadow_full = 1;
+        }
+    }
+    CSR |= CSR_RXOK;
+    if (CSR & CSR_SIE)
+        status_pending = 1;
+}
+
+/* The node's frame has gone through */
+static void transmitted(int n, const struct frame *f)
+{
+    struct sim_can_frame *log;
+
+    /* TXRQ stays set if the CPU has put new data in meanwhile */
+    if (!is_set(mcr[n], NEWDAT))
+        mcr[n] = set(mcr[n], TXRQ, 0);
+    if (is_set(mcr[n], TXIE))
+        mcr[n] = set(mcr[n], INTPND, 1);
+    MCR(n) = mcr[n];
+    CSR |= CSR_TXOK;
+    if (CSR & CSR_SIE)
+        status_pending = 1;
+
+    if (sim_can_logged < SIM_CAN_MAX_LOG) {
+        log = &sim_can_log[sim_can_logged++];
+        log->id = f->id;
+        log->len = f->len;
+        memcpy(log->data, f->data, 8);
+        log->sent = sim_now;
+    }
+}
+
+/* Lowest numbered object waiting to transmit, or -1 */
+static int tx_object(void)
+{
+    int n;
+
+    if (CSR & CSR_INIT)
+        return -1;
+    for (n = 0; n < 14; n++) {
+        if (is_set(mcr[n], MSGVAL) && (MCFG(n) & 0x08) && is_set(mcr[n], TXRQ) && !is_set(mcr[n], CPUUPD))
+            return n;
+    }
+    return -1;
+}
+
+/* Start the next frame: the lowest ID wins the arbitration */
+static void start(sim_time_t at)
+{
+    int n = tx_object();
+    int from_master = master_head != master_tail;
+
+    if (n >= 0 && from_master) {
+        if (arb_to_id(UAR(n), LAR(n)) < master[master_tail].id)
+            from_master = 0;
+    }
+    if (from_master) {
+        on_bus = master[master_tail];
+        master_tail = (master_tail + 1) % MASTER_QUEUE;
+        on_bus_object = -1;
+    } else if (n >= 0) {
+        on_bus.id = arb_to_id(UAR(n), LAR(n));
+        on_bus.len = MCFG(n) >> 4;
+        if (on_bus.len > 8)
+            on_bus.len = 8;
+        memcpy(on_bus.data, DATA(n), 8);
+        on_bus_object = n;
+        mcr[n] = set(mcr[n], NEWDAT, 0);
+        MCR(n) = mcr[n];
+    } else
+        return;
+    busy = 1;
+    busy_until = at + SIM_US(sim_can_frame_us(on_bus.len));
+}
+
+void can_tick(void)
+{
+    while (busy && sim_now >= busy_until) {
+        busy = 0;
+        if (on_bus_object < 0)
+            receive(&on_bus);
+        else
+            transmitted(on_bus_object, &on_bus);
+        start(busy_until);
+    }
+    if (!busy)
+        start(sim_now);
+    update_irq();
+}
+
+sim_time_t can_next(void)
+{
+    if (busy)
+        return busy_until;
+    if (master_head != master_tail || tx_object() >= 0)
+        return sim_now;
+    return SIM_NEVER;
+}
+
+void can_sync(void)
+{
+    int n;
+
+    for (n = 0; n < NUM_OBJECTS; n++) {
+        unsigned short written = MCR(n);
+
+        if (written == mcr[n])
+            continue;
+        mcr[n] = command(mcr[n], written);
+
+        /* Object 15: the CPU is done with the foreground buffer */
+        if (n == 14 && !is_set(mcr[n], NEWDAT) && shadow_full) {
+            shadow_full = 0;
+            store(14, &shadow);
+        }
+        MCR(n) = mcr[n];
+    }
+    update_irq();
+}
+
+void can_access(unsigned addr)
+{
+    /* Reading the status ends the status change interrupt */
+    if (addr == 0xEF00)
+        status_pending = 0;
+    update_irq();
+}
+
+void can_reset(void)
+{
+    int n;
+
+    memset(sim_can_registers, 0, sizeof(sim_can_registers));
+    for (n = 0; n < NUM_OBJECTS; n++) {
+        mcr[n] = 0x5555;
+        MCR(n) = mcr[n];
+    }
+    CSR = CSR_INIT;
+    shadow_full = 0;
+    status_pending = 0;
+    master_head = master_tail = 0;
+    busy = 0;
+    sim_can_logged = 0;
+}
+
+void sim_can_send(unsigned long id, unsigned char len, const unsigned char *data)
+{
+    struct frame *f = &master[master_head];
+
+    if ((master_head + 1) % MASTER_QUEUE == master_tail) {
+        fprintf(stderr, "sim: CAN master queue full\n");
+        abort();
+    }
+    memset(f, 0, sizeof(*f));
+    f->id = id;
+    f->len = len;
+    if (len)
+        memcpy(f->data, data, len);
+    master_head = (master_head + 1) % MASTER_QUEUE;
+}
+
+void sim_can_monitor(unsigned long rca)
+{
+    sim_can_send(sim_can_base() + rca, 0, 0);
+}
+
+void sim_can_control(unsigned long rca, unsigned char len, const unsigned char *data)
+{
+    sim_can_send(sim_can_base() + rca, len, data);
+}
+
+int sim_can_pending(void)
+{
+    return (master_head - master_tail + MASTER_QUEUE) % MASTER_QUEUE + (busy && on_bus_object < 0);
+}
+
+const struct sim_can_frame *sim_can_reply(unsigned long rca, unsigned from)
+{
+    unsigned i;
+    unsigned long id = sim_can_base() + rca;
+
+    for (i = from; i < sim_can_logged; i++)
+        if (sim_can_log[i].id == id)
+            return &sim_can_log[i];
+    return 0;
+}
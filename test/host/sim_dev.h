@@ -0,0 +1,38 @@
+/*
+ * Interface between the simulated CPU in sim.c and the devices.
+ */
+
+#ifndef SIM_DEV_H
+#define SIM_DEV_H
+
+#include "sim.h"
+
+#define SIM_NEVER ((sim_time_t) -1)
+
+/* Port pins driven by the CPU: latch where the direction is output */
+unsigned sim_port_out(int port);
+unsigned sim_port_dir(int port);
+void sim_can_irq_line(int level);           /* XP0 request from the CAN controller */
+void sim_cc3_edge(int rising);              /* P2.3 changed, for the CC3 capture */
+
+/* Called by sim.c: reset, register writes, time, next event */
+void can_reset(void);
+void can_access(unsigned addr);             /* before the firmware touches a CAN register */
+void can_sync(void);                        /* firmware writes to the message objects */
+void can_tick(void);
+sim_time_t can_next(void);
+
+void arcom_reset(void);
+void arcom_port(void);                      /* P2 or P7 outputs changed */
+void arcom_tick(void);
+sim_time_t arcom_next(void);
+unsigned arcom_p2(void);                    /* ARCOM side of P2 */
+unsigned arcom_p7(void);
+
+void ow_reset(void);
+void ow_port(void);                         /* P3.0 output changed */
+void ow_tick(void);
+sim_time_t ow_next(void);
+int ow_line(void);                          /* 1-Wire line level */
+
+#endif /* SIM_DEV_H */
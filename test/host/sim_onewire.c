@@ -0,0 +1,378 @@
+/*
+ * DS1820 and DS18B20 sensors on the 1-Wire line at P3.0.
+ *
+ * The line is low while the C167 drives it low or a sensor pulls it down.
+ * A low pulse of 480 us or more resets the sensors, which answer with a
+ * presence pulse from 30 to 150 us after it.  Any other falling edge starts
+ * a time slot: a sensor sending a 0 holds the line low for 30 us, a sensor
+ * listening takes the level 30 us into the slot.  TH, TL and the DS18B20
+ * configuration register have a copy in EEPROM, written by Copy Scratchpad
+ * and read back when the sensor is powered up.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim_dev.h"
+
+#define RESET_US        450
+#define PRESENCE_US     30
+#define PRESENCE_LEN_US 120
+#define SAMPLE_US       30
+#define HOLD_US         30
+
+struct sim_ow_sensor sim_ow[SIM_OW_MAX];
+unsigned sim_ow_count;
+unsigned long sim_ow_resets, sim_ow_conversions, sim_ow_copies;
+
+enum { OFF, ROM_COMMAND, ROM_MATCH, ROM_SEARCH, FUNCTION, SEND, WRITE, CONVERT };
+
+static struct {
+    int state;
+    unsigned char rx;                       /* bits coming in */
+    unsigned rx_bits, rx_need;
+    unsigned char rx_buf[8];
+    unsigned rx_bytes;
+    unsigned char tx[16];                   /* bytes going out, LSB first */
+    unsigned tx_bits, tx_pos;
+    unsigned search_bit, search_step;
+    sim_time_t convert_until;
+    int converted;                          /* temperature at the end of the last conversion */
+    unsigned char th, tl, config;
+    unsigned char ee_th, ee_tl, ee_config;  /* EEPROM */
+    sim_time_t pull_from, pull_until;
+    sim_time_t sample_at;
+} dev[SIM_OW_MAX];
+
+static int master_low;
+static sim_time_t master_low_since;
+
+static unsigned char crc8(const unsigned char *p, unsigned n)
+{
+    unsigned char crc = 0;
+    unsigned i, b;
+
+    for (i = 0; i < n; i++) {
+        crc ^= p[i];
+        for (b = 0; b < 8; b++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0x8C : crc >> 1;
+    }
+    return crc;
+}
+
+void sim_ow_sensor(unsigned i, unsigned char family, unsigned long serial, int temp16)
+{
+    unsigned k;
+
+    sim_ow[i].rom[0] = family;
+    for (k = 1; k < 7; k++)
+        sim_ow[i].rom[k] = (unsigned char) (serial >> (8 * (k - 1)));
+    sim_ow[i].rom[7] = crc8(sim_ow[i].rom, 7);
+    sim_ow[i].temp16 = temp16;
+    sim_ow[i].corrupt = 0;
+    dev[i].ee_th = 0x4B;
+    dev[i].ee_tl = 0x46;
+    dev[i].ee_config = 0x7F;
+    sim_ow_power_up(i);
+}
+
+void sim_ow_power_up(unsigned i)
+{
+    dev[i].state = OFF;
+    dev[i].convert_until = 0;
+    dev[i].converted = 85 * 16;
+    dev[i].th = dev[i].ee_th;
+    dev[i].tl = dev[i].ee_tl;
+    dev[i].config = dev[i].ee_config;
+    sim_ow[i].resolution = 9 + ((dev[i].config >> 5) & 3);
+}
+
+static int is_b20(unsigned i)
+{
+    return sim_ow[i].rom[0] == 0x28;
+}
+
+static void scratchpad(unsigned i, unsigned char *s)
+{
+    int t = dev[i].converted;
+
+    if (is_b20(i)) {
+        unsigned res = 9 + ((dev[i].config >> 5) & 3);
+
+        t &= ~((1 << (12 - res)) - 1);
+        s[0] = (unsigned char) t;
+        s[1] = (unsigned char) (t >> 8);
+        s[2] = dev[i].th;
+        s[3] = dev[i].tl;
+        s[4] = dev[i].config;
+        s[5] = 0xFF;
+        s[6] = 0x0C;
+        s[7] = 0x10;
+    } else {
+        int half = (t + 4) >> 3;
+        int whole = half >> 1;
+
+        s[0] = (unsigned char) half;
+        s[1] = (unsigned char) (half >> 8);
+        s[2] = dev[i].th;
+        s[3] = dev[i].tl;
+        s[4] = 0xFF;
+        s[5] = 0xFF;
+        s[6] = (unsigned char) (16 * whole + 12 - t);
+        s[7] = 16;
+    }
+    s[8] = crc8(s, 8);
+    if (sim_ow[i].corrupt)
+        s[8] ^= 0x01;
+}
+
+static void send(unsigned i, const unsigned char *bytes, unsigned n)
+{
+    memcpy(dev[i].tx, bytes, n);
+    dev[i].tx_bits = 8 * n;
+    dev[i].tx_pos = 0;
+    dev[i].state = SEND;
+}
+
+static void listen(unsigned i, int state, unsigned bits)
+{
+    dev[i].state = state;
+    dev[i].rx = 0;
+    dev[i].rx_bits = 0;
+    dev[i].rx_need = bits;
+    dev[i].rx_bytes = 0;
+}
+
+static sim_time_t conversion_time(unsigned i)
+{
+    if (is_b20(i))
+        return SIM_US(93750) << ((dev[i].config >> 5) & 3);
+    return SIM_US(750000);
+}
+
+/* A whole byte or the bits asked for have come in */
+static void byte_in(unsigned i, unsigned char b)
+{
+    unsigned char s[9];
+
+    switch (dev[i].state) {
+    case ROM_COMMAND:
+        switch (b) {
+        case 0x33:
+            send(i, sim_ow[i].rom, 8);
+            break;
+        case 0x55:
+            listen(i, ROM_MATCH, 8);
+            break;
+        case 0xCC:
+            listen(i, FUNCTION, 8);
+            break;
+        case 0xF0:
+            dev[i].state = ROM_SEARCH;
+            dev[i].search_bit = 0;
+            dev[i].search_step = 0;
+            break;
+        default:
+            dev[i].state = OFF;
+        }
+        break;
+    case ROM_MATCH:
+        dev[i].rx_buf[dev[i].rx_bytes++] = b;
+        if (dev[i].rx_bytes < 8) {
+            dev[i].rx = 0;
+            dev[i].rx_bits = 0;
+            return;
+        }
+        if (memcmp(dev[i].rx_buf, sim_ow[i].rom, 8))
+            dev[i].state = OFF;
+        else
+            listen(i, FUNCTION, 8);
+        break;
+    case FUNCTION:
+        switch (b) {
+        case 0x44:
+            dev[i].state = CONVERT;
+            dev[i].convert_until = sim_now + conversion_time(i);
+            sim_ow_conversions++;
+            break;
+        case 0xBE:
+            scratchpad(i, s);
+            send(i, s, 9);
+            break;
+        case 0x4E:
+            listen(i, WRITE, 8);
+            break;
+        case 0x48:
+            dev[i].ee_th = dev[i].th;
+            dev[i].ee_tl = dev[i].tl;
+            dev[i].ee_config = dev[i].config;
+            sim_ow_copies++;
+            dev[i].state = OFF;
+            break;
+        default:
+            dev[i].state = OFF;
+        }
+        break;
+    case WRITE:
+        dev[i].rx_buf[dev[i].rx_bytes++] = b;
+        dev[i].rx = 0;
+        dev[i].rx_bits = 0;
+        if (dev[i].rx_bytes == 1)
+            dev[i].th = b;
+        else if (dev[i].rx_bytes == 2)
+            dev[i].tl = b;
+        else if (dev[i].rx_bytes == 3 && is_b20(i)) {
+            dev[i].config = (b & 0x60) | 0x1F;
+            sim_ow[i].resolution = 9 + ((b >> 5) & 3);
+        }
+        if (dev[i].rx_bytes == (is_b20(i) ? 3u : 2u))
+            dev[i].state = OFF;
+        break;
+    }
+}
+
+static void bit_in(unsigned i, int b)
+{
+    if (dev[i].state == ROM_SEARCH) {
+        /* Bit, complement, then the master's choice */
+        int mine = (sim_ow[i].rom[dev[i].search_bit / 8] >> (dev[i].search_bit % 8)) & 1;
+
+        if (b != mine) {
+            dev[i].state = OFF;
+            return;
+        }
+        dev[i].search_step = 0;
+        if (++dev[i].search_bit == 64)
+            listen(i, FUNCTION, 8);
+        return;
+    }
+    if (b)
+        dev[i].rx |= 1 << dev[i].rx_bits;
+    if (++dev[i].rx_bits == dev[i].rx_need)
+        byte_in(i, dev[i].rx);
+}
+
+/* The bit a sensor sends in this slot: -1 if it doesn't */
+static int bit_out(unsigned i)
+{
+    int b;
+
+    switch (dev[i].state) {
+    case SEND:
+        if (dev[i].tx_pos >= dev[i].tx_bits)
+            return 1;
+        b = (dev[i].tx[dev[i].tx_pos / 8] >> (dev[i].tx_pos % 8)) & 1;
+        dev[i].tx_pos++;
+        return b;
+    case CONVERT:
+        if (sim_now < dev[i].convert_until)
+            return 0;
+        dev[i].converted = sim_ow[i].temp16;
+        return 1;
+    case ROM_SEARCH:
+        if (dev[i].search_step == 2)
+            return -1;
+        b = (sim_ow[i].rom[dev[i].search_bit / 8] >> (dev[i].search_bit % 8)) & 1;
+        if (dev[i].search_step++ == 1)
+            b = !b;
+        return b;
+    }
+    return -1;
+}
+
+int ow_line(void)
+{
+    unsigned i;
+
+    if (master_low)
+        return 0;
+    for (i = 0; i < sim_ow_count; i++)
+        if (dev[i].pull_from <= sim_now && sim_now < dev[i].pull_until)
+            return 0;
+    return 1;
+}
+
+void ow_port(void)
+{
+    int low = (sim_port_dir(SIM_P3) & 1) && !(sim_port_out(SIM_P3) & 1);
+    unsigned i;
+
+    if (low == master_low)
+        return;
+    master_low = low;
+    if (low) {
+        /* A time slot, or a reset */
+        master_low_since = sim_now;
+        for (i = 0; i < sim_ow_count; i++) {
+            int b;
+
+            if (dev[i].state == OFF)
+                continue;
+            b = bit_out(i);
+            if (b == 0) {
+                dev[i].pull_from = sim_now;
+                dev[i].pull_until = sim_now + SIM_US(HOLD_US);
+            } else if (b < 0)
+                dev[i].sample_at = sim_now + SIM_US(SAMPLE_US);
+        }
+    } else if (sim_now - master_low_since >= SIM_US(RESET_US)) {
+        sim_ow_resets++;
+        for (i = 0; i < sim_ow_count; i++) {
+            /* A conversion runs on, but the sensor listens again */
+            listen(i, ROM_COMMAND, 8);
+            dev[i].sample_at = SIM_NEVER;
+            dev[i].pull_from = sim_now + SIM_US(PRESENCE_US);
+            dev[i].pull_until = dev[i].pull_from + SIM_US(PRESENCE_LEN_US);
+        }
+    }
+}
+
+void ow_tick(void)
+{
+    unsigned i;
+
+    for (i = 0; i < sim_ow_count; i++) {
+        if (dev[i].sample_at <= sim_now) {
+            dev[i].sample_at = SIM_NEVER;
+            bit_in(i, !master_low);
+        }
+        if (dev[i].convert_until && sim_now >= dev[i].convert_until) {
+            dev[i].converted = sim_ow[i].temp16;
+            dev[i].convert_until = 0;
+        }
+    }
+}
+
+sim_time_t ow_next(void)
+{
+    sim_time_t next = SIM_NEVER;
+    unsigned i;
+
+    for (i = 0; i < sim_ow_count; i++) {
+        if (dev[i].sample_at < next)
+            next = dev[i].sample_at;
+        if (dev[i].pull_from > sim_now && dev[i].pull_from < next)
+            next = dev[i].pull_from;
+        if (dev[i].pull_until > sim_now && dev[i].pull_until < next)
+            next = dev[i].pull_until;
+        if (dev[i].convert_until > sim_now && dev[i].convert_until < next)
+            next = dev[i].convert_until;
+    }
+    return next;
+}
+
+void ow_reset(void)
+{
+    unsigned i;
+
+    memset(dev, 0, sizeof(dev));
+    for (i = 0; i < SIM_OW_MAX; i++) {
+        dev[i].state = OFF;
+        dev[i].sample_at = SIM_NEVER;
+    }
+    master_low = 0;
+    sim_ow_resets = sim_ow_conversions = sim_ow_copies = 0;
+    sim_ow_count = 1;
+    sim_ow_sensor(0, 0x10, 0x123456UL, 25 * 16);
+}
@@ -0,0 +1,98 @@
+/*
+ * Bursts of M&C requests: a long run of back-to-back frames, and frames
+ * arriving while the CAN interrupt is held off by a higher priority one.
+ * No request may be lost, and every monitor request gets its reply.
+ */
+
+#include "check.h"
+#include "sim.h"
+#include "libraries/amb/amb.h"
+
+#define BURST 200
+
+static CALLBACK_STRUCT callbacks[4];
+static unsigned long calls;
+
+static short callback(CAN_MSG_TYPE *msg)
+{
+    calls++;
+    if (msg->dirn == CAN_MONITOR) {
+        msg->len = 2;
+        msg->data[0] = (ubyte) msg->relative_address;
+        msg->data[1] = (ubyte) (msg->relative_address >> 8);
+    }
+    return 0;
+}
+
+/* Replies to the monitor requests of RCAs first to first + n - 1 logged from 'from' */
+static unsigned replies(unsigned long first, unsigned n, unsigned from)
+{
+    unsigned i, found = 0;
+
+    for (i = 0; i < n; i++) {
+        const struct sim_can_frame *reply = sim_can_reply(first + i, from);
+
+        if (reply && reply->len == 2 && reply->data[0] == (ubyte) (first + i) &&
+            reply->data[1] == (ubyte) ((first + i) >> 8))
+            found++;
+    }
+    return found;
+}
+
+/* Something at a higher level than the CAN interrupt runs for 150 us, two frames */
+static void hold_off(void)
+{
+    sim_step(SIM_US(150));
+}
+
+static void check_no_loss(void)
+{
+    uword counts[AMB_NUM_ERR_CAUSES];
+    ubyte depth, high_water, i;
+    uword overflows;
+
+    amb_get_error_counts(counts);
+    for (i = 0; i < AMB_NUM_ERR_CAUSES; i++)
+        CHECK_EQ(counts[i], 0);
+    amb_get_queue_status(&depth, &high_water, &overflows);
+    CHECK_EQ(depth, 0);
+    CHECK_EQ(overflows, 0);
+}
+
+int main(void)
+{
+    unsigned from, i;
+
+    sim_reset();
+    CHECK_EQ(amb_init_slave_n(callbacks, 4), 0);
+    CHECK_EQ(amb_register_function(0x100, 0xFFFF, callback), 0);
+    amb_start();
+    sim_run_us(100);
+
+    /* Back to back: each reply has a lower ID than the next request and goes first */
+    from = sim_can_logged;
+    for (i = 0; i < BURST; i++)
+        sim_can_monitor(0x100 + i);
+    sim_run_us(BURST * 200);
+    CHECK_EQ(sim_can_pending(), 0);
+    CHECK_EQ(calls, BURST);
+    CHECK_EQ(replies(0x100, BURST, from), BURST);
+    check_no_loss();
+
+    /* Two frames while the CAN interrupt can't run: object 15 and its second buffer */
+    for (i = 0; i < 20; i++) {
+        unsigned long rca = 0x1000 + 2 * i;
+
+        from = sim_can_logged;
+        sim_can_monitor(rca);
+        sim_can_monitor(rca + 1);
+        sim_at_level(14, hold_off);
+        sim_run_us(1000);
+        CHECK_EQ(replies(rca, 2, from), 2);
+    }
+    CHECK_EQ(calls, BURST + 40);
+    check_no_loss();
+    CHECK_EQ(sim_traps, 0);
+
+    return CHECK_DONE();
+}
@@ -0,0 +1,96 @@
+/*
+ * The monitor reply cache: a reply is given again while it is fresh, the
+ * callback is called once it is stale, however long ago it was stored.  The
+ * time of the cache wraps around after 2^32 T3 counts, about 28.6 minutes.
+ * Replies from the cache count in the latencies of the callback's replies.
+ */
+
+#include "check.h"
+#include "sim.h"
+#include "libraries/amb/amb.h"
+
+#define TTL_MS      100
+#define WRAP_US     1717986918UL        /* 2^32 T3 counts of 0.4 us */
+
+static CALLBACK_STRUCT callbacks[4];
+static unsigned long calls;
+
+/* Each reply carries the number of the call which made it */
+static short callback(CAN_MSG_TYPE *msg)
+{
+    calls++;
+    if (msg->dirn == CAN_MONITOR) {
+        msg->len = 2;
+        msg->data[0] = (ubyte) msg->relative_address;
+        msg->data[1] = (ubyte) calls;
+    }
+    return 0;
+}
+
+/* Ask for rca: the call number in the reply, or -1 without one */
+static int request(unsigned long rca)
+{
+    const struct sim_can_frame *reply;
+    unsigned from = sim_can_logged;
+
+    sim_can_monitor(rca);
+    sim_run_us(1000);
+    reply = sim_can_reply(rca, from);
+    if (!reply || reply->len != 2 || reply->data[0] != (ubyte) rca)
+        return -1;
+    return reply->data[1];
+}
+
+/* Requests logged in a latency class */
+static unsigned logged(ubyte lat_class)
+{
+    uword hist[AMB_LATENCY_BUCKETS], misses, max;
+    unsigned b, n = 0;
+
+    amb_get_latency(lat_class, hist, &misses, &max);
+    for (b = 0; b < AMB_LATENCY_BUCKETS; b++)
+        n += hist[b];
+    return n;
+}
+
+int main(void)
+{
+    uword hits, misses, evictions, invalidations;
+    int first;
+
+    sim_reset();
+    CHECK_EQ(amb_init_slave_n(callbacks, 4), 0);
+    CHECK_EQ(amb_register_function(0x100, 0x1FF, callback), 0);
+    CHECK_EQ(amb_cache_policy(0x100, 0x1FF, TTL_MS), 0);
+    amb_start();
+    sim_run_us(100);
+
+    /* Fresh, then stale */
+    first = request(0x100);
+    CHECK_EQ(first, 1);
+    CHECK_EQ(request(0x100), first);
+    sim_run_us(TTL_MS * 1000);
+    CHECK_EQ(request(0x100), 2);
+    CHECK_EQ(calls, 2);
+
+    /* Half way round the time past the expiry, where a signed comparison turns round */
+    first = request(0x101);
+    sim_run_us(WRAP_US / 2 + TTL_MS * 1000 + 10000);
+    CHECK(request(0x101) != first);
+
+    /* All the way round: the age taken unsigned would be small again */
+    first = request(0x102);
+    sim_run_us(WRAP_US + 10000);
+    CHECK(request(0x102) != first);
+    CHECK_EQ(calls, 6);
+
+    amb_get_cache_stats(&hits, &misses, &evictions, &invalidations);
+    CHECK_EQ(hits, 1);
+    CHECK_EQ(misses, 6);
+    CHECK_EQ(evictions, 0);
+    CHECK_EQ(logged(AMB_LATENCY_MONITOR_CALLBACK), 7);
+    CHECK_EQ(logged(AMB_LATENCY_MONITOR_BUILTIN), 0);
+    CHECK_EQ(sim_traps, 0);
+
+    return CHECK_DONE();
+}
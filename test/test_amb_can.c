@@ -0,0 +1,119 @@
+/*
+ * The AMB slave library on the simulated C167CR: monitor and control
+ * requests from the CAN master reach the registered callback and the
+ * monitor replies go back out on the bus.  A monitor request the callback
+ * has no reply for counts in the monitor latencies, not the control ones.
+ */
+
+#include <string.h>
+
+#include "check.h"
+#include "sim.h"
+#include "libraries/amb/amb.h"
+
+static CALLBACK_STRUCT callbacks[8];
+
+static CAN_MSG_TYPE last_control;
+static int monitors, controls;
+
+static short callback(CAN_MSG_TYPE *msg)     /* int on the C167 */
+{
+    /* No reply for these, as when the ARCOM doesn't answer */
+    if (msg->dirn == CAN_MONITOR && msg->relative_address >= 0x1F0) {
+        monitors++;
+        msg->dirn = CAN_CONTROL;
+        return -1;
+    }
+    if (msg->dirn == CAN_MONITOR) {
+        monitors++;
+        msg->len = 4;
+        msg->data[0] = (ubyte) msg->relative_address;
+        msg->data[1] = (ubyte) (msg->relative_address >> 8);
+        msg->data[2] = 0x5A;
+        msg->data[3] = 0xA5;
+    } else {
+        controls++;
+        last_control = *msg;
+    }
+    return 0;
+}
+
+/* Requests logged in a latency class */
+static unsigned logged(ubyte lat_class)
+{
+    uword hist[AMB_LATENCY_BUCKETS], misses, max;
+    unsigned b, n = 0;
+
+    amb_get_latency(lat_class, hist, &misses, &max);
+    for (b = 0; b < AMB_LATENCY_BUCKETS; b++)
+        n += hist[b];
+    return n;
+}
+
+int main(void)
+{
+    const struct sim_can_frame *reply;
+    static const unsigned char control[3] = { 1, 2, 3 };
+    unsigned from;
+
+    sim_reset();
+    sim_set_node(5);
+    CHECK_EQ(amb_init_slave_n(callbacks, 8), 0);
+    CHECK_EQ(amb_register_function(0x100, 0x1FF, callback), 0);
+    amb_start();
+    sim_run_us(100);
+
+    from = sim_can_logged;
+    sim_can_monitor(0x123);
+    sim_run_us(1000);
+    reply = sim_can_reply(0x123, from);
+    CHECK(reply != 0);
+    if (reply) {
+        CHECK_EQ(reply->len, 4);
+        CHECK_EQ(reply->data[0], 0x23);
+        CHECK_EQ(reply->data[1], 0x01);
+        CHECK_EQ(reply->data[2], 0x5A);
+        CHECK_EQ(reply->data[3], 0xA5);
+    }
+    CHECK_EQ(monitors, 1);
+
+    sim_can_control(0x180, 3, control);
+    sim_run_us(1000);
+    CHECK_EQ(controls, 1);
+    CHECK_EQ(last_control.relative_address, 0x180);
+    CHECK_EQ(last_control.len, 3);
+    CHECK(!memcmp(last_control.data, control, 3));
+    CHECK_EQ(sim_can_reply(0x180, from), 0);
+
+    /* A monitor request without a reply */
+    from = sim_can_logged;
+    sim_can_monitor(0x1F0);
+    sim_run_us(1000);
+    CHECK_EQ(monitors, 2);
+    CHECK_EQ(sim_can_reply(0x1F0, from), 0);
+    CHECK_EQ(logged(AMB_LATENCY_MONITOR_CALLBACK), 2);
+    CHECK_EQ(logged(AMB_LATENCY_CONTROL_CALLBACK), 1);
+
+    /* Protocol revision level, preloaded by the library */
+    from = sim_can_logged;
+    sim_can_monitor(0x30000);
+    sim_run_us(1000);
+    reply = sim_can_reply(0x30000, from);
+    CHECK(reply != 0);
+    if (reply) {
+        CHECK_EQ(reply->len, 3);
+        CHECK_EQ(reply->data[0], 1);
+        CHECK_EQ(reply->data[1], 1);
+        CHECK_EQ(reply->data[2], 2);
+    }
+
+    /* Nothing for an RCA without a callback */
+    from = sim_can_logged;
+    sim_can_monitor(0x400);
+    sim_run_us(1000);
+    CHECK_EQ(sim_can_reply(0x400, from), 0);
+    CHECK_EQ(monitors, 2);
+    CHECK_EQ(sim_traps, 0);
+
+    return CHECK_DONE();
+}
@@ -0,0 +1,101 @@
+/*
+ * Monitor replies on a busy bus.  Frames of a node with lower IDs win the
+ * arbitration over the replies, which pile up in the transmit objects.  The
+ * replies must still leave in the order of the requests, and a reply
+ * overwritten after the wait for a transmit object must be counted, as
+ * overload and not as a CAN error.
+ */
+
+#include "check.h"
+#include "sim.h"
+#include "libraries/amb/amb.h"
+
+#define OTHER_NODE 0x3FF00UL            /* below the base address of node 0 */
+
+static CALLBACK_STRUCT callbacks[4];
+
+static short callback(CAN_MSG_TYPE *msg)
+{
+    if (msg->dirn == CAN_MONITOR) {
+        msg->len = 2;
+        msg->data[0] = (ubyte) msg->relative_address;
+        msg->data[1] = (ubyte) (msg->relative_address >> 8);
+    }
+    return 0;
+}
+
+/* Position in the log of the reply to rca sent at or after from, or -1 */
+static int reply_at(unsigned long rca, unsigned from)
+{
+    const struct sim_can_frame *reply = sim_can_reply(rca, from);
+
+    if (!reply || reply->len != 2 || reply->data[0] != (ubyte) rca)
+        return -1;
+    return (int) (reply - sim_can_log);
+}
+
+static void other_traffic(unsigned frames)
+{
+    unsigned i;
+
+    for (i = 0; i < frames; i++)
+        sim_can_send(OTHER_NODE, 0, 0);
+}
+
+int main(void)
+{
+    uword counts[AMB_NUM_ERR_CAUSES];
+    uword delayed, clobbered;
+    unsigned from;
+    int a, b, c, i;
+
+    sim_reset();
+    CHECK_EQ(amb_init_slave_n(callbacks, 4), 0);
+    CHECK_EQ(amb_register_function(0x100, 0xFFFF, callback), 0);
+    amb_start();
+    sim_run_us(100);
+
+    /*
+     * The reply to 0x120 waits in the second object behind other traffic
+     * when the request for 0x118, whose ID beats it, comes in.  More traffic
+     * holds the bus while the reply to 0x118 is loaded: it must not go in
+     * the first object, which would send it first.
+     */
+    from = sim_can_logged;
+    sim_can_monitor(0x110);
+    sim_can_monitor(0x120);
+    other_traffic(1);
+    sim_can_monitor(0x118);
+    other_traffic(1);
+    sim_run_us(2000);
+    a = reply_at(0x110, from);
+    b = reply_at(0x120, from);
+    c = reply_at(0x118, from);
+    CHECK(a >= 0 && b > a && c > b);
+    amb_get_tx_status(&delayed, &clobbered);
+    CHECK(delayed > 0);
+    CHECK_EQ(clobbered, 0);
+
+    /* Same, but the traffic goes on for longer than the reply to 0x118 may wait */
+    from = sim_can_logged;
+    sim_can_monitor(0x210);
+    sim_can_monitor(0x220);
+    other_traffic(1);
+    sim_can_monitor(0x218);
+    other_traffic(20);
+    sim_run_us(5000);
+    a = reply_at(0x210, from);
+    b = reply_at(0x220, from);
+    c = reply_at(0x218, from);
+    CHECK(a >= 0 && c > a);
+    CHECK_EQ(b, -1);
+    amb_get_tx_status(&delayed, &clobbered);
+    CHECK_EQ(clobbered, 1);
+    /* An overwritten reply is overload here, not an error on the bus */
+    amb_get_error_counts(counts);
+    for (i = 0; i < AMB_NUM_ERR_CAUSES; i++)
+        CHECK_EQ(counts[i], 0);
+    CHECK_EQ(sim_traps, 0);
+
+    return CHECK_DONE();
+}
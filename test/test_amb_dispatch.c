@@ -0,0 +1,104 @@
+/*
+ * Callback ranges of the AMB slave library: overlapping registrations,
+ * first registration wins, lookup at the range edges, unregistering and a
+ * full callback array.  Built once with the binary search and once with
+ * AMB_PAGE_DISPATCH.
+ */
+
+#include "check.h"
+#include "sim.h"
+#include "libraries/amb/amb.h"
+
+#define MAX_CBS 6
+
+static CALLBACK_STRUCT callbacks[MAX_CBS];
+
+/* Each callback answers with its own tag */
+static short answer(CAN_MSG_TYPE *msg, ubyte tag)
+{
+    if (msg->dirn == CAN_MONITOR) {
+        msg->len = 1;
+        msg->data[0] = tag;
+    }
+    return 0;
+}
+
+static short cb_a(CAN_MSG_TYPE *msg) { return answer(msg, 'A'); }
+static short cb_b(CAN_MSG_TYPE *msg) { return answer(msg, 'B'); }
+static short cb_c(CAN_MSG_TYPE *msg) { return answer(msg, 'C'); }
+static short cb_d(CAN_MSG_TYPE *msg) { return answer(msg, 'D'); }
+
+/* Tag of the callback which answered a monitor request, 0 if none */
+static int owner(unsigned long rca)
+{
+    const struct sim_can_frame *reply;
+    unsigned from = sim_can_logged;
+
+    sim_can_monitor(rca);
+    sim_run_us(500);
+    reply = sim_can_reply(rca, from);
+    return reply ? reply->data[0] : 0;
+}
+
+int main(void)
+{
+    sim_reset();
+    CHECK_EQ(amb_init_slave_n(callbacks, MAX_CBS), 0);
+    amb_start();
+
+    /* A, then B overlapping its top: B only gets what A left */
+    CHECK_EQ(amb_register_function(0x100, 0x1FF, cb_a), 0);
+    CHECK_EQ(amb_register_function(0x180, 0x27F, cb_b), 0);
+    /* C around both: the gaps below and above */
+    CHECK_EQ(amb_register_function(0x050, 0x2FF, cb_c), 0);
+    /* D wholly inside A: nothing left for it */
+    CHECK_EQ(amb_register_function(0x120, 0x130, cb_d), -1);
+    CHECK_EQ(amb_register_function(0x300, 0x2FF, cb_d), -1);
+
+    CHECK_EQ(owner(0x04F), 0);
+    CHECK_EQ(owner(0x050), 'C');
+    CHECK_EQ(owner(0x0FF), 'C');
+    CHECK_EQ(owner(0x100), 'A');
+    CHECK_EQ(owner(0x125), 'A');
+    CHECK_EQ(owner(0x180), 'A');
+    CHECK_EQ(owner(0x1FF), 'A');
+    CHECK_EQ(owner(0x200), 'B');
+    CHECK_EQ(owner(0x27F), 'B');
+    CHECK_EQ(owner(0x280), 'C');
+    CHECK_EQ(owner(0x2FF), 'C');
+    CHECK_EQ(owner(0x300), 0);
+
+    /* Ranges in other pages */
+    CHECK_EQ(amb_register_function(0x3FFFF, 0x3FFFF, cb_d), 0);
+    CHECK_EQ(owner(0x3FFFF), 'D');
+    CHECK_EQ(owner(0x3FFFE), 0);
+    CHECK_EQ(amb_register_function(0x10000, 0x20000, cb_b), 0);
+    CHECK_EQ(owner(0x0FFFF), 0);
+    CHECK_EQ(owner(0x10000), 'B');
+    CHECK_EQ(owner(0x17FFF), 'B');
+    CHECK_EQ(owner(0x20000), 'B');
+    CHECK_EQ(owner(0x20001), 0);
+
+    /* The array holds A, B, the two of C, D and the last B: full */
+    CHECK_EQ(amb_register_function(0x400, 0x4FF, cb_d), -1);
+    CHECK_EQ(owner(0x400), 0);
+
+    /* Unregistering C's registration frees both its ranges, and only them */
+    CHECK_EQ(amb_unregister_last_function(), 0);
+    CHECK_EQ(owner(0x10000), 0);
+    CHECK_EQ(amb_unregister_last_function(), 0);
+    CHECK_EQ(owner(0x3FFFF), 0);
+    CHECK_EQ(amb_unregister_last_function(), 0);
+    CHECK_EQ(owner(0x050), 0);
+    CHECK_EQ(owner(0x2FF), 0);
+    CHECK_EQ(owner(0x100), 'A');
+    CHECK_EQ(owner(0x200), 'B');
+
+    /* Now there is room again, and the gap of C can be taken by D */
+    CHECK_EQ(amb_register_function(0x000, 0x0FF, cb_d), 0);
+    CHECK_EQ(owner(0x001), 'D');
+    CHECK_EQ(owner(0x100), 'A');
+    CHECK_EQ(sim_traps, 0);
+
+    return CHECK_DONE();
+}
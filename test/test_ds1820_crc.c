@@ -0,0 +1,43 @@
+/*
+ * Do_1W_CRC() of the lookup tables against the bit by bit CRC of Dallas
+ * Application Note 27, for every byte with every CRC before it.  Built once
+ * with DS1820_CRC_TABLE, the default, and once with DS1820_CRC_NIBBLE.
+ *
+ * ds1820.c is included to build it with the implementation of the test.
+ */
+
+#include "check.h"
+#include "libraries/ds1820/ds1820.c"
+
+/* X^8 + X^5 + X^4 + 1, one bit at a time */
+static ubyte crc_bitwise(ubyte next_byte, ubyte crc)
+{
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        if ((next_byte ^ crc) & 0x01)
+            crc = ((crc ^ 0x18) >> 1) | 0x80;
+        else
+            crc >>= 1;
+        next_byte >>= 1;
+    }
+    return crc;
+}
+
+int main(void)
+{
+    /* ROM code of the example in Application Note 27, its CRC last */
+    static const ubyte rom[8] = { 0x02, 0x1C, 0xB8, 0x01, 0x00, 0x00, 0x00, 0xA2 };
+    unsigned next_byte, crc, i;
+
+    for (crc = 0; crc < 256; crc++)
+        for (next_byte = 0; next_byte < 256; next_byte++)
+            CHECK_EQ(Do_1W_CRC(next_byte, crc), crc_bitwise(next_byte, crc));
+
+    for (crc = i = 0; i < 7; i++)
+        crc = Do_1W_CRC(rom[i], crc);
+    CHECK_EQ(crc, rom[7]);
+    CHECK_EQ(Do_1W_CRC(rom[7], crc), 0);
+
+    return CHECK_DONE();
+}
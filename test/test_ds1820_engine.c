@@ -0,0 +1,129 @@
+/*
+ * The Timer 2 engine of the DS1820 library against simulated sensors: a
+ * DS1820 and a DS18B20 on the wire, one conversion for both, then each
+ * scratchpad.  The readings must give the sensors' temperatures, a bad CRC
+ * must keep the last good reading, and the engine must leave the CPU free
+ * while the conversion runs.  The board's DS1820 is always sensor 0, and
+ * with two DS1820s on the wire it must be given.  A DS18B20 keeps the
+ * resolution set through a loss of power.
+ */
+
+#include <string.h>
+
+#include "check.h"
+#include "sim.h"
+#include "reg167.h"
+#include "libraries/ds1820/ds1820.h"
+
+#define READING_US      800000UL        /* 750 ms conversion, polled every 10 ms, and the scratchpads */
+
+/* Run a reading to its end: its result, or DS1820_BUSY if it took too long */
+static short reading(void)
+{
+    ubyte msb, lsb, remain, per_c;
+    unsigned long us;
+    short result;
+
+    CHECK_EQ(ds1820_start_temp(), 0);
+    CHECK_EQ(ds1820_start_temp(), -1);
+    for (us = 0; us < READING_US; us += 1000) {
+        result = ds1820_poll_temp(&msb, &lsb, &remain, &per_c);
+        if (result != DS1820_BUSY)
+            return result;
+        sim_run_us(1000);
+    }
+    return DS1820_BUSY;
+}
+
+/* Temperature of a sensor in 1/16 degree C, with the result of its last reading in *status */
+static int temp16(ubyte index, short *status)
+{
+    ubyte msb, lsb, remain, per_c;
+
+    *status = ds1820_get_sensor(index, &msb, &lsb, &remain, &per_c);
+    return Do_1W_Temperature_Full_16(msb, lsb, remain, per_c);
+}
+
+int main(void)
+{
+    sim_time_t start, busy;
+    short status;
+    ubyte sn[8], rom[8];
+
+    sim_reset();
+    sim_ow_count = 2;
+    sim_ow_sensor(0, DS1820_FAMILY, 0x123456UL, 25 * 16 + 5);
+    sim_ow_sensor(1, DS18B20_FAMILY, 0x654321UL, -161);
+    IEN = 1;
+
+    CHECK_EQ(ds1820_init(), 0);
+    CHECK_EQ(ds1820_search(), -1);                /* the board's DS1820 not known yet */
+    CHECK_EQ(ds1820_get_sn(sn), 0);
+    CHECK(!memcmp(sn, sim_ow[0].rom, 8));
+    CHECK_EQ(ds1820_search(), 2);
+    CHECK_EQ(ds1820_set_resolution(12), 0);
+
+    /* One conversion for both sensors, with the CPU free meanwhile */
+    start = sim_now;
+    busy = sim_busy[5];
+    CHECK_EQ(reading(), 0);
+    CHECK(sim_now - start < SIM_US(READING_US));
+    CHECK(sim_busy[5] - busy < (sim_now - start) / 50);
+    CHECK_EQ(sim_ow_conversions, 2);              /* one Convert T, on both sensors */
+    CHECK_EQ(temp16(0, &status), 25 * 16 + 5);
+    CHECK_EQ(status, 0);
+    CHECK_EQ(temp16(1, &status), -161);
+    CHECK_EQ(status, 0);
+
+    /* New temperatures, and a bad scratchpad from the DS18B20: it keeps its last reading */
+    sim_ow[0].temp16 = -3 * 16 - 7;
+    sim_ow[1].temp16 = 85 * 16 - 1;
+    sim_ow[1].corrupt = 1;
+    CHECK_EQ(reading(), 0);
+    CHECK_EQ(sim_ow_conversions, 4);
+    CHECK_EQ(temp16(0, &status), -3 * 16 - 7);
+    CHECK_EQ(status, 0);
+    CHECK_EQ(temp16(1, &status), -161);
+    CHECK_EQ(status, -2);
+
+    /* Good again */
+    sim_ow[1].corrupt = 0;
+    CHECK_EQ(reading(), 0);
+    CHECK_EQ(temp16(1, &status), 85 * 16 - 1);
+    CHECK_EQ(status, 0);
+
+    /* 10 bits, copied to EEPROM once: the DS18B20 has them again after losing power */
+    CHECK_EQ(ds1820_set_resolution(10), 0);
+    CHECK_EQ(sim_ow_copies, 1);
+    CHECK_EQ(ds1820_set_resolution(10), 0);
+    CHECK_EQ(sim_ow_copies, 1);
+    sim_ow_power_up(1);
+    CHECK_EQ(sim_ow[1].resolution, 10);
+    CHECK_EQ(reading(), 0);
+    CHECK_EQ(temp16(1, &status), (85 * 16 - 1) & ~3);
+
+    /* No sensor answers: the reading fails */
+    sim_ow_count = 0;
+    CHECK_EQ(reading(), -1);
+
+    /* Two DS1820s: the board's can't be told from the probe */
+    sim_ow_count = 2;
+    sim_ow_sensor(0, DS1820_FAMILY, 0x123456UL, 20 * 16);
+    sim_ow_sensor(1, DS1820_FAMILY, 0x654321UL, 30 * 16);
+    CHECK_EQ(ds1820_get_sn(sn), -1);
+    CHECK_EQ(ds1820_search(), -1);
+
+    /* Unless its ROM code is given: found second by Search ROM, it is still sensor 0 */
+    CHECK_EQ(ds1820_set_onboard(sim_ow[1].rom), 0);
+    CHECK_EQ(ds1820_get_sn(sn), 0);
+    CHECK(!memcmp(sn, sim_ow[1].rom, 8));
+    CHECK_EQ(ds1820_search(), 2);
+    CHECK_EQ(ds1820_get_rom(0, rom), 0);
+    CHECK(!memcmp(rom, sim_ow[1].rom, 8));
+    CHECK_EQ(reading(), 0);
+    CHECK_EQ(temp16(0, &status), 30 * 16);
+    CHECK_EQ(temp16(1, &status), 20 * 16);
+    CHECK_EQ(sim_traps, 0);
+
+    return CHECK_DONE();
+}
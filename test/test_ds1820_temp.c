@@ -0,0 +1,43 @@
+/*
+ * The fixed point temperature conversions against the float ones, for
+ * every scratchpad a sensor can give: temperature bytes of either sign and
+ * COUNT_REMAIN up to COUNT_PER_C.  In 1/16 degree C they must agree exactly
+ * for the COUNT_PER_C of 16 of the DS1820, and within rounding otherwise;
+ * in 1/100 degree C within rounding.
+ */
+
+#include <math.h>
+
+#include "check.h"
+#include "libraries/ds1820/ds1820.h"
+
+#define ROUNDING    (0.5 + 1e-3)       /* float error at the halves */
+
+int main(void)
+{
+    static const ubyte signs[2] = { 0x00, 0xFF };
+    unsigned s, lsb, per_c, remain;
+    unsigned long compared = 0;
+    double full;
+
+    for (s = 0; s < 2; s++)
+        for (lsb = 0; lsb < 256; lsb++) {
+            CHECK_EQ(Do_1W_Temperature_16(signs[s], lsb), Do_1W_Temperature(signs[s], lsb) * 16);
+
+            for (per_c = 0; per_c < 256; per_c++)
+                for (remain = 0; remain <= per_c; remain++) {
+                    full = Do_1W_Temperature_Full(signs[s], lsb, remain, per_c);
+                    if (per_c == 16 || per_c == 0)
+                        CHECK_EQ(Do_1W_Temperature_Full_16(signs[s], lsb, remain, per_c), full * 16);
+                    else
+                        CHECK(fabs(Do_1W_Temperature_Full_16(signs[s], lsb, remain, per_c) - full * 16) <= ROUNDING);
+                    CHECK(fabs(Do_1W_Temperature_Centi(signs[s], lsb, remain, per_c) - full * 100) <= ROUNDING);
+                    compared++;
+                    if (check_failures > 10)
+                        return CHECK_DONE();
+                }
+        }
+    CHECK_EQ(compared, 2UL * 256 * (256 * 257 / 2));
+
+    return CHECK_DONE();
+}
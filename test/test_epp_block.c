@@ -0,0 +1,74 @@
+/*
+ * Hot list refresh by block transactions with the longest EPP budgets.  The
+ * deadline is kept in 16 bits of T3 and tested signed, so it must never get
+ * 2^15 counts ahead of T3: every reply of a block must still get its budget.
+ */
+
+#include "check.h"
+#include "sim.h"
+#include "libraries/amb/amb.h"
+
+/* From main.c */
+#define SET_EPP_DEADLINES   0x20033UL
+#define SET_HOT_LIST        0x20036UL
+#define EPP_MAX_BUDGET_US   6000
+#define EPP_BLOCK_MAX       8
+
+#define FIRST_POINT         0x101UL
+
+void femc_main(void);
+
+/* Ask for a point: 1 if the reply came, with the ARCOM asked for it or not in *forwarded */
+static int request(unsigned long rca, int *forwarded)
+{
+    const struct sim_can_frame *reply;
+    unsigned from = sim_can_logged;
+    unsigned long monitors = sim_arcom.monitors;
+
+    sim_can_monitor(rca);
+    sim_run_us(2000);
+    *forwarded = sim_arcom.monitors != monitors;
+    reply = sim_can_reply(rca, from);
+    return reply && reply->len == 4 && reply->data[0] == (ubyte) rca;
+}
+
+int main(void)
+{
+    static const ubyte budgets[6] = {
+        EPP_MAX_BUDGET_US >> 8, EPP_MAX_BUDGET_US & 0xFF,
+        EPP_MAX_BUDGET_US >> 8, EPP_MAX_BUDGET_US & 0xFF,
+        EPP_MAX_BUDGET_US >> 8, EPP_MAX_BUDGET_US & 0xFF
+    };
+    static const ubyte period[2] = { 0, 100 };
+    ubyte point[3];
+    unsigned long rca, transactions;
+    int forwarded;
+
+    sim_reset();
+    sim_start_main(femc_main);
+    sim_run_us(100000);
+
+    /* A full block of points, refreshed every 100 ms */
+    sim_can_control(SET_EPP_DEADLINES, sizeof(budgets), budgets);
+    sim_can_control(SET_HOT_LIST, sizeof(period), period);
+    for (rca = FIRST_POINT; rca < FIRST_POINT + EPP_BLOCK_MAX; rca++) {
+        point[0] = (ubyte) (rca >> 16);
+        point[1] = (ubyte) (rca >> 8);
+        point[2] = (ubyte) rca;
+        sim_can_control(SET_HOT_LIST, sizeof(point), point);
+    }
+    transactions = sim_arcom.transactions;
+    sim_run_us(500000);
+    CHECK(sim_arcom.transactions > transactions);
+
+    /* Every point came with its block, and is answered from the hot list */
+    for (rca = FIRST_POINT; rca < FIRST_POINT + EPP_BLOCK_MAX; rca++) {
+        CHECK(request(rca, &forwarded));
+        CHECK(!forwarded);
+    }
+    CHECK_EQ(sim_arcom.aborted, 0);
+    CHECK_EQ(sim_arcom.errors, 0);
+    CHECK_EQ(sim_traps, 0);
+
+    return CHECK_DONE();
+}
@@ -0,0 +1,116 @@
+/*
+ * Controls sent from the Data Strobe interrupt when the ARCOM stops
+ * strobing halfway.  T4 must end the transaction at its deadline, with no
+ * CPU polling for it, and a monitor request waiting behind it must sleep
+ * until then, not spin.  The budgets start lenient and are tightened to the
+ * ICD limit through SET_EPP_DEADLINES.
+ */
+
+#include <string.h>
+
+#include "check.h"
+#include "sim.h"
+#include "libraries/amb/amb.h"
+
+/* From main.c */
+#define SET_EPP_DEADLINES   0x20033UL
+#define GET_CONTROL_QUEUE   0x20035UL
+#define CONTROL_BUDGET_US   150
+
+#define CONTROL_RCA         0x10123UL
+#define MONITOR_RCA         0x00123UL
+#define P2_INTERRUPT        0x0080
+
+void femc_main(void);
+
+static unsigned long stall_at;
+
+static int in_transaction(void)
+{
+    return (sim_pins(SIM_P2) & P2_INTERRUPT) != 0;
+}
+
+static int aborted(void)
+{
+    return sim_arcom.aborted != 0;
+}
+
+static int stalled(void)
+{
+    return sim_arcom.bytes >= stall_at;
+}
+
+/* Send a control, which the ARCOM stops strobing after its 3 byte header */
+static void stall(unsigned char len)
+{
+    static const ubyte data[8];
+
+    stall_at = sim_arcom.bytes + 3;
+    sim_arcom.stall_after = 3;
+    sim_can_control(CONTROL_RCA, len, data);
+    while (!in_transaction())
+        sim_run_us(1);
+    CHECK(sim_run_until(stalled, 100));
+    sim_arcom.stall_after = -1;
+}
+
+int main(void)
+{
+    static const ubyte data[2] = { 0x12, 0x34 };
+    static const ubyte defaults[6] = { 1000 >> 8, 1000 & 0xFF, 2000 >> 8, 2000 & 0xFF, 3000 >> 8, 3000 & 0xFF };
+    static const ubyte budgets[6] = { 0, 50, 0, 100, 0, CONTROL_BUDGET_US };
+    const struct sim_can_frame *reply;
+    sim_time_t start, busy;
+    unsigned from;
+
+    sim_reset();
+    sim_start_main(femc_main);
+    sim_run_us(100000);
+
+    /* The default budgets, then those of the ICD */
+    from = sim_can_logged;
+    sim_can_monitor(SET_EPP_DEADLINES);
+    sim_run_us(2000);
+    reply = sim_can_reply(SET_EPP_DEADLINES, from);
+    CHECK(reply && reply->len == 6 && !memcmp(reply->data, defaults, 6));
+    sim_can_control(SET_EPP_DEADLINES, sizeof(budgets), budgets);
+    sim_run_us(2000);
+
+    /* A control goes through */
+    sim_can_control(CONTROL_RCA, sizeof(data), data);
+    sim_run_us(2000);
+    CHECK_EQ(sim_arcom.controls, 2);        /* the format selection at setup, and this one */
+    CHECK_EQ(sim_arcom.log[1].rca, CONTROL_RCA);
+    CHECK_EQ(sim_arcom.log[1].data[1], 0x34);
+
+    /* The next one stops after its header: T4 ends it at the deadline */
+    stall(sizeof(data));
+    start = sim_now;
+    CHECK(sim_run_until(aborted, 1000));
+    CHECK(sim_now - start <= SIM_US(CONTROL_BUDGET_US + 10));
+
+    /* Again, with a monitor request behind it: the bottom half sleeps until then */
+    from = sim_can_logged;
+    busy = sim_busy[4];
+    stall(sizeof(data));
+    sim_can_monitor(MONITOR_RCA);
+    sim_run_us(2000);
+    CHECK(sim_busy[4] - busy < SIM_US(CONTROL_BUDGET_US) / 4);
+    CHECK_EQ(sim_arcom.aborted, 2);
+    reply = sim_can_reply(MONITOR_RCA, from);
+    CHECK(reply && reply->len == 4 && reply->data[0] == (ubyte) MONITOR_RCA);
+
+    /* Both failures are counted */
+    from = sim_can_logged;
+    sim_can_monitor(GET_CONTROL_QUEUE);
+    sim_run_us(2000);
+    reply = sim_can_reply(GET_CONTROL_QUEUE, from);
+    CHECK(reply && reply->len == 8);
+    if (reply) {
+        CHECK_EQ(reply->data[4], 2);
+        CHECK_EQ(reply->data[7], (ubyte) CONTROL_RCA);
+    }
+    CHECK_EQ(sim_traps, 0);
+
+    return CHECK_DONE();
+}
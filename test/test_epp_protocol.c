@@ -0,0 +1,83 @@
+/*
+ * Selection of the EPP transaction format at link setup.  Firmware which
+ * understands the compact format gets it only after the confirmation.
+ * Older ARCOM firmware, whatever it answers at the RCAs it serves, keeps the
+ * legacy format, as does a link which fails during the confirmation.
+ */
+
+#include <string.h>
+
+#include "check.h"
+#include "sim.h"
+#include "libraries/amb/amb.h"
+
+/* From main.c */
+#define EPP_PROTOCOL_RCA        0x2003EUL
+#define EPP_PROTOCOL_LEGACY     0x00
+#define EPP_PROTOCOL_COMPACT    0x01
+#define EPP_PROTOCOL_BLOCK      0x02
+
+void femc_main(void);
+
+/* A monitor request forwarded to the ARCOM gets the reply of the stand-in */
+static int forwarded(unsigned long rca)
+{
+    const struct sim_can_frame *reply;
+    unsigned from = sim_can_logged;
+
+    sim_can_monitor(rca);
+    sim_run_us(2000);
+    reply = sim_can_reply(rca, from);
+    return reply && reply->len == 4 && reply->data[0] == (ubyte) rca &&
+           reply->data[1] == (ubyte) (rca >> 8) && reply->data[3] == 0xA5;
+}
+
+/*
+ * The firmware keeps its state in statics, so each ARCOM is a run of its own:
+ *   current    firmware with the compact format and block requests
+ *   old        older firmware, which serves 0x20007 with a byte that would pass for the formats
+ *   long       older firmware with a reply at EPP_PROTOCOL_RCA one byte too long
+ *   noconfirm  current firmware, but the confirmation doesn't go through
+ */
+int main(int argc, char **argv)
+{
+    static const ubyte formats[1] = { EPP_PROTOCOL_COMPACT | EPP_PROTOCOL_BLOCK };
+    static const ubyte long_reply[5] = { 'E', 'P', 1, EPP_PROTOCOL_COMPACT | EPP_PROTOCOL_BLOCK, 0 };
+    const char *arcom = argc > 1 ? argv[1] : "current";
+
+    sim_reset();
+    if (!strcmp(arcom, "old")) {
+        sim_arcom.old_firmware = 1;
+        sim_arcom_point(0x20007UL, 1, formats);
+    } else if (!strcmp(arcom, "long")) {
+        sim_arcom.old_firmware = 1;
+        sim_arcom_point(EPP_PROTOCOL_RCA, sizeof(long_reply), long_reply);
+    } else if (!strcmp(arcom, "noconfirm"))
+        sim_arcom.no_confirm = 1;
+    else if (strcmp(arcom, "current"))
+        return 2;
+
+    /* Power up and let main() set the link up */
+    sim_start_main(femc_main);
+    sim_run_us(100000);
+
+    if (!strcmp(arcom, "current")) {
+        CHECK_EQ(sim_arcom.protocol, EPP_PROTOCOL_COMPACT | EPP_PROTOCOL_BLOCK);
+        CHECK_EQ(sim_arcom.controls, 1);
+        CHECK_EQ(sim_arcom.log[0].rca, EPP_PROTOCOL_RCA);
+        CHECK_EQ(sim_arcom.aborted, 0);
+    } else if (!strcmp(arcom, "noconfirm")) {
+        /* Both sides stay with the legacy format */
+        CHECK_EQ(sim_arcom.controls, 1);
+        CHECK_EQ(sim_arcom.aborted, 1);
+        CHECK_EQ(sim_arcom.protocol, EPP_PROTOCOL_LEGACY);
+    } else {
+        CHECK_EQ(sim_arcom.protocol, EPP_PROTOCOL_LEGACY);
+        CHECK_EQ(sim_arcom.controls, 0);
+    }
+    CHECK(forwarded(0x123));
+    CHECK_EQ(sim_arcom.errors, 0);
+    CHECK_EQ(sim_traps, 0);
+
+    return CHECK_DONE();
+}
@@ -0,0 +1,131 @@
+/*
+ * Setting the ARCOM link up, and up again after the ARCOM board restarted.
+ * The restarted board knows only the legacy header, from the moment INIT
+ * goes high: a request forwarded before the relink must use it.  With the
+ * link breaker open the relink must be the probe.  The first setup runs in
+ * the bottom half, so a GET_SETUP_INFO from the CAN bus can't cut into it.
+ */
+
+#include <string.h>
+
+#include "check.h"
+#include "sim.h"
+#include "libraries/amb/amb.h"
+
+/* From main.c */
+#define GET_SETUP_INFO          0x20001UL
+#define SET_LINK_BREAKER        0x20037UL
+#define GET_LINK_RECOVERY       0x20038UL
+#define EPP_PROTOCOL_COMPACT    0x01
+#define EPP_PROTOCOL_BLOCK      0x02
+#define BREAKER_PROBE_MS        500
+
+#define P2_INIT                 0x0020
+
+void femc_main(void);
+
+static int init_low(void)
+{
+    return !(sim_pins(SIM_P2) & P2_INIT);
+}
+
+/* A monitor request: its reply, or 0 */
+static const struct sim_can_frame *request(unsigned long rca)
+{
+    unsigned from = sim_can_logged;
+
+    sim_can_monitor(rca);
+    sim_run_us(2000);
+    return sim_can_reply(rca, from);
+}
+
+/* A monitor request forwarded to the ARCOM gets the reply of the stand-in */
+static int forwarded(unsigned long rca)
+{
+    const struct sim_can_frame *reply = request(rca);
+
+    return reply && reply->len == 4 && reply->data[0] == (ubyte) rca &&
+           reply->data[1] == (ubyte) (rca >> 8) && reply->data[3] == 0xA5;
+}
+
+/* Times the link was set up again */
+static unsigned relinks(void)
+{
+    const struct sim_can_frame *reply = request(GET_LINK_RECOVERY);
+
+    return reply && reply->len == 8 ? (reply->data[0] << 8) | reply->data[1] : 0xFFFF;
+}
+
+static int breaker_open(void)
+{
+    const struct sim_can_frame *reply = request(SET_LINK_BREAKER);
+
+    return reply && reply->len == 8 && reply->data[0];
+}
+
+/*
+ * One case per run:
+ *   restart    the ARCOM restarts, a request comes the moment INIT is low again
+ *   breaker    the ARCOM restarts with the link breaker open
+ *   setup      the ARCOM answers late, with GET_SETUP_INFO requests on the CAN bus meanwhile
+ */
+int main(int argc, char **argv)
+{
+    const char *arcom = argc > 1 ? argv[1] : "restart";
+    unsigned long aborted;
+    unsigned i;
+
+    sim_reset();
+    if (!strcmp(arcom, "setup")) {
+        /* A slow ARCOM, and every 100 us a GET_SETUP_INFO, from before it answers to after */
+        sim_arcom.dead = 1;
+        sim_arcom.reply_us = 80;
+        sim_start_main(femc_main);
+        for (i = 0; i < 1500; i++) {
+            if (i == 750) {
+                sim_arcom.dead = 0;
+                aborted = sim_arcom.aborted;
+            }
+            sim_can_monitor(GET_SETUP_INFO);
+            sim_run_us(100);
+        }
+        CHECK(sim_arcom.aborted <= aborted + 1);    /* one may have started before */
+    } else if (!strcmp(arcom, "restart")) {
+        sim_start_main(femc_main);
+        sim_run_us(100000);
+        aborted = sim_arcom.aborted;
+
+        sim_arcom_restart(50000);
+        CHECK(sim_run_until(init_low, 60000));
+        CHECK(forwarded(0x123));
+        sim_run_us(10000);
+        CHECK_EQ(sim_arcom.aborted, aborted);
+    } else if (!strcmp(arcom, "breaker")) {
+        sim_start_main(femc_main);
+        sim_run_us(100000);
+
+        /* Two requests with their retries open the breaker */
+        sim_arcom.dead = 1;
+        request(0x123);
+        request(0x123);
+        CHECK(breaker_open());
+        sim_arcom.dead = 0;
+        aborted = sim_arcom.aborted;
+
+        sim_arcom_restart(50000);
+        CHECK(sim_run_until(init_low, 60000));
+        sim_run_us(1000UL * BREAKER_PROBE_MS);
+        CHECK(!breaker_open());
+        CHECK_EQ(sim_arcom.aborted, aborted);
+    } else
+        return 2;
+
+    CHECK_EQ(sim_arcom.protocol, EPP_PROTOCOL_COMPACT | EPP_PROTOCOL_BLOCK);
+    if (strcmp(arcom, "setup"))
+        CHECK_EQ(relinks(), 1);
+    CHECK(forwarded(0x123));
+    CHECK_EQ(sim_arcom.errors, 0);
+    CHECK_EQ(sim_traps, 0);
+
+    return CHECK_DONE();
+}
@@ -0,0 +1,118 @@
+/*
+ * The hot list of the FEMC firmware: points refreshed from the ARCOM in the
+ * background are answered locally while fresh.  Once the ARCOM stops
+ * answering the points go stale, and must stay so when amb_get_time()
+ * wraps around after 2^32 T3 counts, about 28.6 minutes.  Only monitor RCAs
+ * of the ARCOM are added, each once, up to the size of the list.
+ */
+
+#include "check.h"
+#include "sim.h"
+#include "libraries/amb/amb.h"
+
+/* From main.c */
+#define SET_HOT_LIST            0x20036UL
+#define GET_HOT_LIST_REFUSED    0x2003CUL
+#define HOT_LIST_SIZE           16
+#define HOT_REFUSED_FULL        1
+#define HOT_REFUSED_RANGE       2
+#define HOT_REFUSED_LISTED      3
+
+#define WRAP_US                 1717986918UL    /* 2^32 T3 counts of 0.4 us */
+#define POINT                   0x123UL
+
+void femc_main(void);
+
+/* Ask for the point: 1 if the reply came, with the ARCOM asked for it or not in *forwarded */
+static int request(int *forwarded)
+{
+    const struct sim_can_frame *reply;
+    unsigned from = sim_can_logged;
+    unsigned long monitors = sim_arcom.monitors;
+
+    sim_can_monitor(POINT);
+    sim_run_us(2000);
+    *forwarded = sim_arcom.monitors != monitors;
+    reply = sim_can_reply(POINT, from);
+    return reply && reply->len == 4 && reply->data[0] == (ubyte) POINT;
+}
+
+static void add(unsigned long rca)
+{
+    ubyte point[3];
+
+    point[0] = (ubyte) (rca >> 16);
+    point[1] = (ubyte) (rca >> 8);
+    point[2] = (ubyte) rca;
+    sim_can_control(SET_HOT_LIST, sizeof(point), point);
+    sim_run_us(1000);
+}
+
+/* RCAs refused so far: 1 if as many as expected, the last one for why */
+static int refused(unsigned count, ubyte why, unsigned long rca)
+{
+    const struct sim_can_frame *reply;
+    unsigned from = sim_can_logged;
+
+    sim_can_monitor(GET_HOT_LIST_REFUSED);
+    sim_run_us(2000);
+    reply = sim_can_reply(GET_HOT_LIST_REFUSED, from);
+    return reply && reply->len == 6 && ((reply->data[0] << 8) | reply->data[1]) == count &&
+           reply->data[2] == why && reply->data[3] == (ubyte) (rca >> 16) &&
+           reply->data[4] == (ubyte) (rca >> 8) && reply->data[5] == (ubyte) rca;
+}
+
+/* Points on the list */
+static int listed(void)
+{
+    const struct sim_can_frame *reply;
+    unsigned from = sim_can_logged;
+
+    sim_can_monitor(SET_HOT_LIST);
+    sim_run_us(2000);
+    reply = sim_can_reply(SET_HOT_LIST, from);
+    return reply && reply->len == 8 ? reply->data[0] : -1;
+}
+
+int main(void)
+{
+    static const ubyte period[2] = { 0, 100 };
+    int forwarded;
+    unsigned long rca;
+
+    sim_reset();
+    sim_start_main(femc_main);
+    sim_run_us(100000);
+
+    /* Refreshed every 100 ms, fresh for 200 ms */
+    sim_can_control(SET_HOT_LIST, sizeof(period), period);
+    add(POINT);
+    sim_run_us(500000);
+    CHECK(request(&forwarded));
+    CHECK(!forwarded);
+
+    /* A control RCA, a reserved RCA, the point again, then one past the size of the list */
+    add(0x10000UL + POINT);
+    CHECK(refused(1, HOT_REFUSED_RANGE, 0x10000UL + POINT));
+    add(SET_HOT_LIST);
+    CHECK(refused(2, HOT_REFUSED_RANGE, SET_HOT_LIST));
+    add(POINT);
+    CHECK(refused(3, HOT_REFUSED_LISTED, POINT));
+    CHECK_EQ(listed(), 1);
+    for (rca = POINT + 1; rca <= POINT + HOT_LIST_SIZE; rca++)
+        add(rca);
+    CHECK(refused(4, HOT_REFUSED_FULL, POINT + HOT_LIST_SIZE));
+    CHECK_EQ(listed(), HOT_LIST_SIZE);
+
+    /* The ARCOM stops: the breaker opens and the point goes stale */
+    sim_arcom.dead = 1;
+    sim_run_us(2000000);
+    CHECK(!request(&forwarded));
+
+    /* Its last refresh is now 2^32 counts and less than 200 ms ago */
+    sim_run_us(WRAP_US - 2000000 - 2000 + 50000);
+    CHECK(!request(&forwarded));
+    CHECK_EQ(sim_traps, 0);
+
+    return CHECK_DONE();
+}